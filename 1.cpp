@@ -4,26 +4,29 @@
 #include <ctype.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <atomic>
 #include <iostream>
+#include <iomanip>
 #include <algorithm>
+#include <vector>
+#include "common.h"
+#include "shuffle.h"
+#include "input.h"
+#include "tokenize.h"
+#include "metrics.h"
+#include "log.h"
 
 using namespace std;
 
-const int MAX_WORDS = 100000;
-const int MAX_WORD_LENGTH = 255;
 const int NUM_MAPPERS = 4;
 const int NUM_REDUCERS = 2;
 
-// Key-Value Pair Struct
-struct KeyValuePair {
-    char word[MAX_WORD_LENGTH];
-    int count;
-};
-
 // Mapper Arguments Struct
 struct MapperArgs {
     char** input_data;
     int data_size;
+    const char* text;           // byte range of a mapped file, or NULL
+    size_t text_size;
     int mapper_id;
 };
 
@@ -36,190 +39,167 @@ struct ReducerArgs {
 
 // Synchronization primitives
 pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t mapper_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t reducer_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // Semaphores for synchronization
 sem_t mapper_complete_sem;    // Signals when all mappers are done
 sem_t shuffle_complete_sem;   // Signals when shuffling is done
 sem_t reducer_complete_sem;   // Signals when all reducers are done
 
-// Global synchronization flags
-int mapper_count = 0;
-int reducer_count = 0;
-int mapper_done = 0;
-int shuffle_done = 0;
+// Completion counters: the last mapper or reducer to finish posts its
+// phase's semaphore. Each counter has a cache line of its own, apart from
+// the result counts below, so finishing threads do not disturb each other.
+alignas(64) std::atomic<int> mapper_count(0);
+alignas(64) std::atomic<int> reducer_count(0);
 
-// Global shared resources
-struct KeyValuePair global_intermediate_results[MAX_WORDS];
-int global_intermediate_count = 0;
-struct KeyValuePair global_final_results[MAX_WORDS];
-int global_final_count = 0;
-
-// Function to remove punctuation and convert to lowercase
-void clean_word(const char* input, char* output) {
-    int j = 0;
-    for (int i = 0; input[i] != '\0'; i++) {
-        if (isalnum(input[i])) {
-            output[j++] = tolower(input[i]);
-        }
-    }
-    output[j] = '\0';
-}
+// Global shared resources; the result vectors are guarded by
+// global_mutex. File input has no word cap, so they grow as needed.
+alignas(64) std::vector<KeyValuePair> global_intermediate_results;
+std::vector<KeyValuePair> global_shuffled_results;
+ShufflePlan<KeyValuePair> shuffle_plan;
+StringArena mapper_arenas[NUM_MAPPERS];     // word text of all records
+alignas(64) std::vector<KeyValuePair> global_final_results;
 
 // Map Function: Tokenize and count word occurrences
 void* mapper(void* args) {
     struct MapperArgs* map_args = (struct MapperArgs*)args;
     
-    pthread_mutex_lock(&mapper_mutex);
-    
-    cout << "Mapper " << map_args->mapper_id << " processing " 
-         << map_args->data_size << " words\n";
-    
-    // Process each word in the input data
-    for (int i = 0; i < map_args->data_size; i++) {
-        char clean[MAX_WORD_LENGTH];
-        clean_word(map_args->input_data[i], clean);
-        
-        if (strlen(clean) == 0) continue; // Skip empty strings after cleaning
-        
-        pthread_mutex_lock(&global_mutex);
-        struct KeyValuePair kv;
-        strncpy(kv.word, clean, MAX_WORD_LENGTH);
-        kv.count = 1;
-        
-        // Add to global intermediate results
-        cout << "Mapper " << map_args->mapper_id << " mapped word: " 
-             << kv.word << endl;
-        global_intermediate_results[global_intermediate_count++] = kv;
-        pthread_mutex_unlock(&global_mutex);
+    // Combine into a mapper-local table; mappers run concurrently
+    WordCountMap combiner(&mapper_arenas[map_args->mapper_id]);
+    char name[32];
+    snprintf(name, sizeof(name), "mapper %d", map_args->mapper_id);
+    metrics_name_thread(name);
+    
+    if (map_args->text != NULL) {
+        // Tokenize this mapper's byte range of the mapped file in place
+        map_args->data_size = (int)tokenize_clean(
+            map_args->text, map_args->text + map_args->text_size,
+            [&](const char* word, size_t length) {
+                if (log_enabled(LOG_TRACE)) {
+                    log_printf(LOG_TRACE, "Mapper %d mapped word: %s",
+                               map_args->mapper_id, word);
+                }
+                combiner.add(word, length, 1);
+            });
+        metrics_add(METRIC_BYTES, map_args->text_size);
+    } else {
+        // Process each word in the input data
+        for (int i = 0; i < map_args->data_size; i++) {
+            char clean[MAX_WORD_LENGTH];
+            clean_word(map_args->input_data[i], clean);
+            
+            size_t length = strlen(clean);
+            if (length == 0) continue; // Skip empty strings after cleaning
+            
+            log_printf(LOG_TRACE, "Mapper %d mapped word: %s",
+                       map_args->mapper_id, clean);
+            combiner.add(clean, length, 1);
+        }
     }
     
-    cout << "Mapper " << map_args->mapper_id << " completed. "
-         << "Mapped " << global_intermediate_count << " words\n";
+    metrics_add(METRIC_TOKENS, map_args->data_size);
     
-    // Track mapper completion
-    mapper_count++;
-    if (mapper_count == NUM_MAPPERS) {
-        mapper_done = 1;
+    // Publish partial counts to global intermediate results in one step
+    metrics_lock(&global_mutex);
+    global_intermediate_results.insert(global_intermediate_results.end(),
+                                       combiner.entries.begin(),
+                                       combiner.entries.end());
+    pthread_mutex_unlock(&global_mutex);
+    log_printf(LOG_INFO, "Mapper %d completed. Mapped %d words into %zu "
+               "partial counts", map_args->mapper_id, map_args->data_size,
+               combiner.entries.size());
+    
+    // Track mapper completion; the semaphore publishes every mapper's
+    // results to the shuffle
+    if (mapper_count.fetch_add(1) + 1 == NUM_MAPPERS) {
         sem_post(&mapper_complete_sem);
     }
     
-    pthread_mutex_unlock(&mapper_mutex);
     return NULL;
 }
 
-// Shuffle Phase: Group by key
+// Shuffle Phase: Hash-partition keys into one disjoint set per reducer
 void shuffle() {
     // Wait for all mappers to complete
-    sem_wait(&mapper_complete_sem);
-    
-    pthread_mutex_lock(&global_mutex);
+    metrics_sem_wait(&mapper_complete_sem);
     
-    // Sort intermediate results by word
-    sort(global_intermediate_results, 
-         global_intermediate_results + global_intermediate_count, 
-         [](const KeyValuePair& a, const KeyValuePair& b) {
-             return strcmp(a.word, b.word) < 0;
-         });
+    int count = (int)global_intermediate_results.size();
+    global_shuffled_results.resize(count);
+    shuffle_init(&shuffle_plan, global_intermediate_results.data(), count,
+                 global_shuffled_results.data(), NUM_MAPPERS, NUM_REDUCERS);
+    partition_pairs(&shuffle_plan);
     
-    // Print shuffled and grouped results before reduction
-    cout << "After Shuffle: ";
-    for (int i = 0; i < global_intermediate_count - 1; i++) {
-        cout << "(\"" << global_intermediate_results[i].word << "\", [1";
-        
-        // Check for subsequent identical words to show multiple 1's
-        int duplicates = 0;
-        for (int j = i + 1; j < global_intermediate_count; j++) {
-            if (strcmp(global_intermediate_results[i].word, 
-                       global_intermediate_results[j].word) == 0) {
-                cout << ", 1";
-                duplicates++;
-            }
-        }
-        cout << "]) ";
-    }
-    cout << endl;
-    
-    // Group and aggregate counts
-    for (int i = 0; i < global_intermediate_count - 1; i++) {
-        if (strcmp(global_intermediate_results[i].word, 
-                   global_intermediate_results[i+1].word) == 0) {
-            global_intermediate_results[i].count += 
-                global_intermediate_results[i+1].count;
-            
-            // Shift remaining elements
-            for (int j = i+1; j < global_intermediate_count - 1; j++) {
-                global_intermediate_results[j] = global_intermediate_results[j+1];
-            }
-            global_intermediate_count--;
-            i--; // Recheck this index
-        }
+    log_printf(LOG_INFO, "Shuffle phase completed. Partitioned %d partial "
+               "counts into %d partitions", count, NUM_REDUCERS);
+    for (int i = 0; i < NUM_REDUCERS; i++) {
+        log_printf(LOG_DEBUG, "Partition %d holds %d partial counts", i,
+                   shuffle_plan.partition_offset[i + 1] -
+                   shuffle_plan.partition_offset[i]);
     }
     
-    cout << "Shuffle phase completed. Grouped into " 
-         << global_intermediate_count << " unique words\n";
-    
-    shuffle_done = 1;
-    pthread_mutex_unlock(&global_mutex);
-    
-    // Signal that shuffle is complete
-    sem_post(&shuffle_complete_sem);
+    // Signal every reducer that shuffle is complete
+    for (int i = 0; i < NUM_REDUCERS; i++) {
+        sem_post(&shuffle_complete_sem);
+    }
 }
 
 // Reduce Function: Aggregate word counts
 void* reducer(void* args) {
     struct ReducerArgs* reduce_args = (struct ReducerArgs*)args;
     
-    // Wait for shuffle to complete
-    sem_wait(&shuffle_complete_sem);
-    
-    pthread_mutex_lock(&reducer_mutex);
+    char name[32];
+    snprintf(name, sizeof(name), "reducer %d", reduce_args->reducer_id);
+    metrics_name_thread(name);
     
-    cout << "Reducer " << reduce_args->reducer_id << " processing " 
-         << reduce_args->data_size << " word groups\n";
+    // Wait for shuffle to complete
+    metrics_sem_wait(&shuffle_complete_sem);
     
-    // Aggregate counts for each unique word
+    // This reducer owns every occurrence of its keys, so it can sum them
+    // locally without consulting other reducers' results
+    WordCountMap totals;
     for (int i = 0; i < reduce_args->data_size; i++) {
-        pthread_mutex_lock(&global_mutex);
-        
-        cout << "Reducer " << reduce_args->reducer_id 
-             << " reducing word: " << reduce_args->intermediate_data[i].word 
-             << endl;
-        
-        int found = 0;
-        for (int j = 0; j < global_final_count; j++) {
-            if (strcmp(global_final_results[j].word, 
-                       reduce_args->intermediate_data[i].word) == 0) {
-                global_final_results[j].count += 
-                    reduce_args->intermediate_data[i].count;
-                found = 1;
-                break;
-            }
-        }
-        
-        if (!found) {
-            global_final_results[global_final_count++] = 
-                reduce_args->intermediate_data[i];
-        }
-        
-        pthread_mutex_unlock(&global_mutex);
+        totals.add(reduce_args->intermediate_data[i]);
     }
     
-    cout << "Reducer " << reduce_args->reducer_id << " completed. "
-         << "Reduced to " << global_final_count << " final word groups\n";
+    // Publish final counts in one step
+    metrics_lock(&global_mutex);
+    global_final_results.insert(global_final_results.end(),
+                                totals.entries.begin(), totals.entries.end());
+    pthread_mutex_unlock(&global_mutex);
+    if (log_enabled(LOG_TRACE)) {
+        for (size_t i = 0; i < totals.entries.size(); i++) {
+            log_printf(LOG_TRACE, "Reducer %d reduced word: %s (%d)",
+                       reduce_args->reducer_id, totals.entries[i].word,
+                       totals.entries[i].count);
+        }
+    }
+    log_printf(LOG_INFO, "Reducer %d completed. Reduced %d partial counts to "
+               "%zu final word groups", reduce_args->reducer_id,
+               reduce_args->data_size, totals.entries.size());
     
     // Track reducer completion
-    reducer_count++;
-    if (reducer_count == NUM_REDUCERS) {
+    if (reducer_count.fetch_add(1) + 1 == NUM_REDUCERS) {
         sem_post(&reducer_complete_sem);
     }
     
-    pthread_mutex_unlock(&reducer_mutex);
     return NULL;
 }
 
-int main() {
+int main(int argc, char** argv) {
+    // --metrics FILE dumps per-thread counters and phase times there.
+    // -v / --verbose raises the log level one step (debug, then trace).
+    int level = LOG_INFO;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metrics_enable(argv[++i], 0);
+            metrics_name_thread("main");
+        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+            level = min(level + 1, (int)LOG_TRACE);
+        } else {
+            cerr << "Usage: " << argv[0] << " [--metrics FILE] [-v|--verbose]\n";
+            return 1;
+        }
+    }
+    
     // Initialize all semaphores
     sem_init(&mapper_complete_sem, 0, 0);
     sem_init(&shuffle_complete_sem, 0, 0);
@@ -228,6 +208,7 @@ int main() {
     // User input for words
     char* input_data[MAX_WORDS];
     int input_size = 0;
+    struct MappedFile input_file = {NULL, 0};
     int input_choice;
     
     cout << "Choose input method:\n";
@@ -235,13 +216,17 @@ int main() {
     cout << "2. Read words from file\n";
     cout << "Enter choice (1 or 2): ";
     cin >> input_choice;
-
+    
     if (input_choice == 1) {
         cout << "Enter words (type 'END' to finish):\n";
         char buffer[MAX_WORD_LENGTH];
-        while (1) {
-            cin >> buffer;
+        while (cin >> setw(MAX_WORD_LENGTH) >> buffer) {
             if (strcmp(buffer, "END") == 0) break;
+            if (input_size == MAX_WORDS) {
+                cerr << "Too many words for manual input; "
+                     << "read them from a file (2)\n";
+                return 1;
+            }
             input_data[input_size] = (char*)malloc(MAX_WORD_LENGTH * sizeof(char));
             strncpy(input_data[input_size++], buffer, MAX_WORD_LENGTH);
         }
@@ -250,33 +235,33 @@ int main() {
         cout << "Enter file name: ";
         cin >> filename;
         
-        FILE* file = fopen(filename, "r");
-        if (!file) {
+        // Map the file; mappers tokenize their byte ranges in place
+        if (!map_file(filename, &input_file)) {
             cerr << "Error opening file\n";
             return 1;
         }
-
-        char buffer[MAX_WORD_LENGTH];
-        while (fscanf(file, "%s", buffer) != EOF) {
-            input_data[input_size] = (char*)malloc(MAX_WORD_LENGTH * sizeof(char));
-            strncpy(input_data[input_size++], buffer, MAX_WORD_LENGTH);
-        }
-        fclose(file);
     } else {
         cout << "Invalid choice. Exiting.\n";
         return 1;
     }
     
     // Mapper threads
+    log_init(level);
+    double phase_start = now_seconds();
     pthread_t mapper_threads[NUM_MAPPERS];
     struct MapperArgs mapper_args[NUM_MAPPERS];
     
-    // Distribute input data across mappers
+    // Distribute input data across mappers: whitespace-aligned byte ranges
+    // of a mapped file, or equal word-count chunks of manual input
+    size_t bounds[NUM_MAPPERS + 1];
+    split_on_whitespace(input_file.data, input_file.size, NUM_MAPPERS, bounds);
     int chunk_size = input_size / NUM_MAPPERS;
     for (int i = 0; i < NUM_MAPPERS; i++) {
         mapper_args[i].input_data = &input_data[i * chunk_size];
         mapper_args[i].data_size = (i == NUM_MAPPERS - 1) ? 
             (input_size - i * chunk_size) : chunk_size;
+        mapper_args[i].text = input_file.data ? input_file.data + bounds[i] : NULL;
+        mapper_args[i].text_size = bounds[i + 1] - bounds[i];
         mapper_args[i].mapper_id = i;
         
         pthread_create(&mapper_threads[i], NULL, mapper, &mapper_args[i]);
@@ -287,54 +272,64 @@ int main() {
         pthread_join(mapper_threads[i], NULL);
     }
     
+    metrics_phase("map", now_seconds() - phase_start);
+    
     // Shuffle Phase
+    phase_start = now_seconds();
     shuffle();
+    metrics_phase("shuffle", now_seconds() - phase_start);
+    phase_start = now_seconds();
     
     // Reducer threads
     pthread_t reducer_threads[NUM_REDUCERS];
     struct ReducerArgs reducer_args[NUM_REDUCERS];
     
-    // Distribute intermediate results across reducers
-    chunk_size = global_intermediate_count / NUM_REDUCERS;
+    // Each reducer takes the partition shuffle assigned to it
     for (int i = 0; i < NUM_REDUCERS; i++) {
-        reducer_args[i].intermediate_data = &global_intermediate_results[i * chunk_size];
-        reducer_args[i].data_size = (i == NUM_REDUCERS - 1) ? 
-            (global_intermediate_count - i * chunk_size) : chunk_size;
+        const std::vector<int>& offset = shuffle_plan.partition_offset;
+        reducer_args[i].intermediate_data = &global_shuffled_results[offset[i]];
+        reducer_args[i].data_size = offset[i + 1] - offset[i];
         reducer_args[i].reducer_id = i;
         
         pthread_create(&reducer_threads[i], NULL, reducer, &reducer_args[i]);
     }
     
     // Wait for reducers to complete
-    sem_wait(&reducer_complete_sem);
+    metrics_sem_wait(&reducer_complete_sem);
     
     for (int i = 0; i < NUM_REDUCERS; i++) {
         pthread_join(reducer_threads[i], NULL);
     }
     
+    metrics_phase("reduce", now_seconds() - phase_start);
+    phase_start = now_seconds();
+    
     // Sort final results alphabetically
-    sort(global_final_results, 
-         global_final_results + global_final_count, 
+    sort(global_final_results.begin(), global_final_results.end(),
          [](const KeyValuePair& a, const KeyValuePair& b) {
              return strcmp(a.word, b.word) < 0;
          });
     
-    // Print final results
+    // Print final results after every summary line
+    log_flush();
     cout << "\nFinal Results (Sorted Alphabetically):\n";
-    for (int i = 0; i < global_final_count; i++) {
+    for (size_t i = 0; i < global_final_results.size(); i++) {
         cout << global_final_results[i].word << ": " 
              << global_final_results[i].count << endl;
     }
     
+    metrics_phase("output", now_seconds() - phase_start);
+    if (!metrics_finish()) cerr << "Error writing metrics\n";
+    
     // Free allocated memory
     for (int i = 0; i < input_size; i++) {
         free(input_data[i]);
     }
+    unmap_file(&input_file);
     
     // Cleanup
+    log_shutdown();
     pthread_mutex_destroy(&global_mutex);
-    pthread_mutex_destroy(&mapper_mutex);
-    pthread_mutex_destroy(&reducer_mutex);
     
     sem_destroy(&mapper_complete_sem);
     sem_destroy(&shuffle_complete_sem);
@@ -0,0 +1,110 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sched.h>
+#include <algorithm>
+#include <vector>
+
+// CPU and NUMA placement of worker threads. Workers are spread over the
+// NUMA nodes in turn, so both sockets of a dual-socket host get the same
+// number, and each worker is either pinned to one core or kept on its
+// node's cores. Threads allocate their buffers themselves once they run,
+// and Linux places pages on the node of the thread that first touches
+// them, so a pinned worker's combiner, arena and read buffers are
+// node-local without any NUMA library.
+
+enum PinMode { PIN_NONE, PIN_CORES, PIN_NODES };
+
+inline int parse_pin_mode(const char* name) {
+    if (strcmp(name, "cores") == 0) return PIN_CORES;
+    if (strcmp(name, "nodes") == 0) return PIN_NODES;
+    return -1;
+}
+
+// Parse a kernel CPU list such as "0-3,8-11"
+inline void parse_cpu_list(const char* text, std::vector<int>* cpus) {
+    const char* p = text;
+    while (*p != '\0' && *p != '\n') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p) break;
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+        }
+        for (long cpu = first; cpu <= last; cpu++) cpus->push_back((int)cpu);
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+// CPUs of each NUMA node that this process may run on. Without NUMA
+// information in sysfs, all allowed CPUs form one node.
+inline std::vector<std::vector<int> > numa_nodes(const cpu_set_t& allowed) {
+    std::vector<std::vector<int> > nodes;
+    const char* root = "/sys/devices/system/node";
+    DIR* dir = opendir(root);
+    std::vector<int> ids;
+    struct dirent* entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        int id;
+        char extra;
+        if (sscanf(entry->d_name, "node%d%c", &id, &extra) == 1) ids.push_back(id);
+    }
+    if (dir != NULL) closedir(dir);
+    std::sort(ids.begin(), ids.end());
+
+    for (size_t i = 0; i < ids.size(); i++) {
+        char path[128];
+        snprintf(path, sizeof(path), "%s/node%d/cpulist", root, ids[i]);
+        FILE* in = fopen(path, "r");
+        if (in == NULL) continue;
+        char line[4096];
+        std::vector<int> cpus, usable;
+        if (fgets(line, sizeof(line), in) != NULL) parse_cpu_list(line, &cpus);
+        fclose(in);
+        for (size_t c = 0; c < cpus.size(); c++) {
+            if (cpus[c] < CPU_SETSIZE && CPU_ISSET(cpus[c], &allowed)) usable.push_back(cpus[c]);
+        }
+        if (!usable.empty()) nodes.push_back(usable);
+    }
+
+    if (nodes.empty()) {
+        nodes.resize(1);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) nodes[0].push_back(cpu);
+        }
+    }
+    return nodes;
+}
+
+// CPU set of each of num_workers workers. Worker w runs on node w % nodes;
+// with PIN_CORES it gets the next core of that node, wrapping around when
+// there are more workers than cores. False if the allowed CPUs cannot be
+// read.
+inline bool plan_affinity(PinMode mode, int num_workers, std::vector<cpu_set_t>* sets,
+                          int* num_nodes) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return false;
+    std::vector<std::vector<int> > nodes = numa_nodes(allowed);
+    if (nodes[0].empty()) return false;
+    *num_nodes = (int)nodes.size();
+
+    sets->resize(num_workers);
+    for (int w = 0; w < num_workers; w++) {
+        const std::vector<int>& node = nodes[w % nodes.size()];
+        CPU_ZERO(&(*sets)[w]);
+        if (mode == PIN_CORES) {
+            CPU_SET(node[(w / nodes.size()) % node.size()], &(*sets)[w]);
+        } else {
+            for (size_t c = 0; c < node.size(); c++) CPU_SET(node[c], &(*sets)[w]);
+        }
+    }
+    return true;
+}
+
+#endif
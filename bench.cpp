@@ -0,0 +1,275 @@
+// Benchmark driver: generates Zipf corpora and runs the word count engine
+// over a matrix of input sizes, modes and thread counts. Each run is a
+// separate process, so its peak RSS is its own. One JSON object per run
+// is printed to stdout; progress goes to stderr.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "corpus.h"
+
+using namespace std;
+
+// Benchmark Options Struct
+struct BenchOptions {
+    const char* engine;
+    const char* dir;            // where corpora are written
+    std::vector<long> sizes_mb;
+    std::vector<long> threads;
+    std::vector<std::string> modes;     // batch, pipeline, stream
+    int vocabulary;
+    double skew;
+    uint64_t seed;
+    int repeat;
+    long memory_mb;             // budget for stream runs
+    bool keep;                  // keep generated corpora
+};
+
+// One engine run as measured by the driver and reported by --stats
+struct BenchResult {
+    double wall_seconds;
+    long peak_rss_kb;
+    std::string stats;          // the engine's JSON object
+};
+
+// Parse "1,2,4" into numbers
+std::vector<long> parse_list(const char* text) {
+    std::vector<long> values;
+    char* end;
+    for (const char* p = text; *p; p = *end ? end + 1 : end) {
+        values.push_back(strtol(p, &end, 10));
+        if (end == p) break;
+    }
+    return values;
+}
+
+std::vector<std::string> parse_names(const char* text) {
+    std::vector<std::string> names;
+    std::string name;
+    for (const char* p = text; ; p++) {
+        if (*p == ',' || *p == '\0') {
+            if (!name.empty()) names.push_back(name);
+            name.clear();
+            if (*p == '\0') break;
+        } else {
+            name += *p;
+        }
+    }
+    return names;
+}
+
+// Number field of a flat JSON object, or 0 if it is missing
+double json_number(const std::string& json, const char* key) {
+    std::string pattern = std::string("\"") + key + "\": ";
+    size_t pos = json.find(pattern);
+    if (pos == std::string::npos) return 0;
+    return strtod(json.c_str() + pos + pattern.size(), NULL);
+}
+
+// Write a corpus file unless one with the same parameters exists
+bool ensure_corpus(const char* path, const struct CorpusSpec& spec) {
+    struct stat st;
+    if (stat(path, &st) == 0 && (size_t)st.st_size >= spec.bytes) return true;
+
+    fprintf(stderr, "Generating %s\n", path);
+    FILE* out = fopen(path, "w");
+    if (out == NULL) return false;
+    bool ok = write_corpus(out, spec) >= 0;
+    return fclose(out) == 0 && ok;
+}
+
+// Run the engine once with its output discarded
+bool run_engine(const struct BenchOptions& options, const char* corpus,
+                const std::string& mode, long threads, struct BenchResult* result) {
+    char stats_path[PATH_MAX];
+    snprintf(stats_path, sizeof(stats_path), "%s/bench_stats_%d.json",
+             options.dir, (int)getpid());
+    unlink(stats_path);
+
+    std::string threads_arg = std::to_string(threads);
+    std::string memory_arg = std::to_string(options.memory_mb);
+    std::vector<const char*> args;
+    args.push_back(options.engine);
+    args.push_back("-t");
+    args.push_back(threads_arg.c_str());
+    args.push_back("-f");
+    args.push_back(corpus);
+    if (mode == "pipeline") args.push_back("-p");
+    if (mode == "stream") {
+        args.push_back("-m");
+        args.push_back(memory_arg.c_str());
+    }
+    args.push_back("-q");
+    args.push_back("--stats");
+    args.push_back(stats_path);
+    args.push_back(NULL);
+
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) dup2(null_fd, STDOUT_FILENO);
+        execv(options.engine, (char* const*)args.data());
+        perror(options.engine);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) return false;
+    result->wall_seconds = now_seconds() - start;
+    result->peak_rss_kb = usage.ru_maxrss;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) return false;
+
+    FILE* in = fopen(stats_path, "r");
+    if (in == NULL) return false;
+    char line[1024];
+    result->stats = fgets(line, sizeof(line), in) ? line : "";
+    fclose(in);
+    unlink(stats_path);
+    while (!result->stats.empty() && result->stats.back() == '\n') {
+        result->stats.pop_back();
+    }
+    return !result->stats.empty();
+}
+
+void print_result(const struct BenchOptions& options, const std::string& mode,
+                  long size_mb, long threads, int run,
+                  const struct BenchResult& result) {
+    const std::string& stats = result.stats;
+    double bytes = json_number(stats, "bytes");
+    double tokens = json_number(stats, "tokens");
+    printf("{\"mode\": \"%s\", \"threads\": %ld, \"size_mb\": %ld, "
+           "\"vocabulary\": %d, \"skew\": %.3f, \"seed\": %llu, \"run\": %d, "
+           "\"bytes\": %.0f, \"tokens\": %.0f, \"distinct\": %.0f, "
+           "\"wall_s\": %.6f, \"mb_per_s\": %.3f, \"tokens_per_s\": %.0f, "
+           "\"peak_rss_kb\": %ld, \"map_s\": %.6f, \"shuffle_s\": %.6f, "
+           "\"reduce_s\": %.6f, \"output_s\": %.6f, \"engine_total_s\": %.6f}\n",
+           mode.c_str(), threads, size_mb, options.vocabulary, options.skew,
+           (unsigned long long)options.seed, run, bytes, tokens,
+           json_number(stats, "distinct"), result.wall_seconds,
+           bytes / (1 << 20) / result.wall_seconds, tokens / result.wall_seconds,
+           result.peak_rss_kb, json_number(stats, "map_s"),
+           json_number(stats, "shuffle_s"), json_number(stats, "reduce_s"),
+           json_number(stats, "output_s"), json_number(stats, "total_s"));
+    fflush(stdout);
+}
+
+void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [--engine PATH] [--sizes MB,...] [--threads N,...]\n"
+            "       [--modes batch,pipeline,stream] [--vocab N] [--skew S]\n"
+            "       [--seed N] [--repeat N] [--memory MB] [--dir DIR] [--keep]\n"
+            "   or: %s --generate FILE [--size MB] [--vocab N] [--skew S] [--seed N]\n",
+            program, program);
+}
+
+int main(int argc, char** argv) {
+    struct BenchOptions options;
+    options.engine = "./p";
+    options.dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    options.sizes_mb = parse_list("16,64");
+    options.threads = parse_list("1,2,4,8");
+    options.modes = parse_names("batch");
+    options.vocabulary = 100000;
+    options.skew = 1.0;
+    options.seed = 1;
+    options.repeat = 3;
+    options.memory_mb = 64;
+    options.keep = false;
+    const char* generate = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--keep") == 0) {
+            options.keep = true;
+            continue;
+        }
+        if (value == NULL) {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+        if (strcmp(arg, "--engine") == 0) options.engine = value;
+        else if (strcmp(arg, "--dir") == 0) options.dir = value;
+        else if (strcmp(arg, "--sizes") == 0 || strcmp(arg, "--size") == 0) {
+            options.sizes_mb = parse_list(value);
+        }
+        else if (strcmp(arg, "--threads") == 0) options.threads = parse_list(value);
+        else if (strcmp(arg, "--modes") == 0) options.modes = parse_names(value);
+        else if (strcmp(arg, "--vocab") == 0) options.vocabulary = atoi(value);
+        else if (strcmp(arg, "--skew") == 0) options.skew = atof(value);
+        else if (strcmp(arg, "--seed") == 0) options.seed = strtoull(value, NULL, 10);
+        else if (strcmp(arg, "--repeat") == 0) options.repeat = atoi(value);
+        else if (strcmp(arg, "--memory") == 0) options.memory_mb = atol(value);
+        else if (strcmp(arg, "--generate") == 0) generate = value;
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.vocabulary <= 0 || options.sizes_mb.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Generate only
+    if (generate != NULL) {
+        struct CorpusSpec spec = {(size_t)options.sizes_mb[0] << 20,
+                                  options.vocabulary, options.skew, options.seed};
+        FILE* out = fopen(generate, "w");
+        long words = out ? write_corpus(out, spec) : -1;
+        if (out == NULL || fclose(out) != 0 || words < 0) {
+            perror(generate);
+            return 1;
+        }
+        fprintf(stderr, "Wrote %ld words to %s\n", words, generate);
+        return 0;
+    }
+
+    bool ok = true;
+    for (size_t s = 0; s < options.sizes_mb.size(); s++) {
+        long size_mb = options.sizes_mb[s];
+        struct CorpusSpec spec = {(size_t)size_mb << 20, options.vocabulary,
+                                  options.skew, options.seed};
+        char corpus[PATH_MAX];
+        snprintf(corpus, sizeof(corpus), "%s/bench_%ldmb_v%d_z%.2f_s%llu.txt",
+                 options.dir, size_mb, options.vocabulary, options.skew,
+                 (unsigned long long)options.seed);
+        if (!ensure_corpus(corpus, spec)) {
+            perror(corpus);
+            return 1;
+        }
+
+        for (size_t m = 0; m < options.modes.size(); m++) {
+            for (size_t t = 0; t < options.threads.size(); t++) {
+                for (int run = 0; run < options.repeat; run++) {
+                    fprintf(stderr, "%s %ld MB, %ld threads, run %d\n",
+                            options.modes[m].c_str(), size_mb,
+                            options.threads[t], run);
+                    struct BenchResult result;
+                    if (!run_engine(options, corpus, options.modes[m],
+                                    options.threads[t], &result)) {
+                        fprintf(stderr, "Engine run failed\n");
+                        ok = false;
+                        continue;
+                    }
+                    print_result(options, options.modes[m], size_mb,
+                                 options.threads[t], run, result);
+                }
+            }
+        }
+        if (!options.keep) unlink(corpus);
+    }
+    return ok ? 0 : 1;
+}
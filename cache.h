@@ -0,0 +1,161 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "common.h"
+
+// Incremental recompute cache: the partial counts of each input file,
+// stored under a cache directory and keyed by the file's path, size,
+// modification time and content hash. A file whose size and mtime match
+// its entry is not read at all. If only the mtime changed, the content
+// hash decides, and a match refreshes the entry instead of recounting.
+//
+// Entry layout: a CacheHeader, the file's absolute path, then one record
+// per distinct word (varint count, length byte, word bytes), and finally a
+// hash_bytes checksum of everything before it. Entries are replaced by
+// rename, so a reader never sees a partial one.
+
+const char CACHE_MAGIC[8] = {'W', 'C', 'C', 'A', 'C', 'H', 'E', '1'};
+
+struct CacheHeader {
+    char magic[8];
+    uint64_t size;              // input file size
+    int64_t mtime_ns;           // input file modification time
+    uint64_t content_hash;      // hash_bytes of the input file
+    uint64_t tokens;            // words mapped from the file
+    uint64_t num_records;
+    uint32_t path_length;
+    uint32_t reserved;
+};
+
+struct CacheEntry {
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t content_hash;
+    uint64_t tokens;
+    std::vector<KeyValuePair> records;  // the file's word counts
+};
+
+// Create the cache directory if it does not exist yet
+inline bool cache_init(const char* dir) {
+    struct stat st;
+    if (stat(dir, &st) == 0) return S_ISDIR(st.st_mode);
+    return mkdir(dir, 0755) == 0;
+}
+
+// Size and modification time of a file
+inline bool file_identity(const char* path, uint64_t* size, int64_t* mtime_ns) {
+    struct stat st;
+    if (stat(path, &st) < 0) return false;
+    *size = st.st_size;
+    *mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+// Entry file for an input path: DIR/<hash of the absolute path>.wcc
+inline std::string cache_entry_path(const char* dir, const char* input_path,
+                                    std::string* absolute) {
+    char resolved[PATH_MAX];
+    *absolute = realpath(input_path, resolved) ? resolved : input_path;
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.wcc",
+             (unsigned long long)hash_word(absolute->data(), absolute->size()));
+    return std::string(dir) + name;
+}
+
+// Read the entry for input_path, if there is an intact one. Words are
+// interned in arena.
+inline bool cache_load(const char* dir, const char* input_path,
+                       struct CacheEntry* entry, StringArena* arena) {
+    std::string absolute;
+    std::string path = cache_entry_path(dir, input_path, &absolute);
+    FILE* in = fopen(path.c_str(), "rb");
+    if (in == NULL) return false;
+    std::vector<char> data;
+    char chunk[1 << 16];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        data.insert(data.end(), chunk, chunk + n);
+    }
+    fclose(in);
+
+    // Header, path and checksum must all match
+    struct CacheHeader header;
+    if (data.size() < sizeof(header) + 8) return false;
+    memcpy(&header, data.data(), sizeof(header));
+    uint64_t checksum;
+    memcpy(&checksum, data.data() + data.size() - 8, 8);
+    if (memcmp(header.magic, CACHE_MAGIC, 8) != 0 ||
+        checksum != hash_bytes(data.data(), data.size() - 8) ||
+        header.path_length != absolute.size() ||
+        sizeof(header) + header.path_length > data.size() - 8 ||
+        memcmp(data.data() + sizeof(header), absolute.data(), absolute.size()) != 0) {
+        return false;
+    }
+
+    const char* p = data.data() + sizeof(header) + header.path_length;
+    const char* end = data.data() + data.size() - 8;
+    entry->records.clear();
+    for (uint64_t i = 0; i < header.num_records; i++) {
+        uint64_t count;
+        if (!get_varint(&p, end, &count) || p >= end) return false;
+        size_t length = (unsigned char)*p++;
+        if (length == 0 || length > (size_t)(end - p)) return false;
+        const char* word = arena->intern(p, length);
+        entry->records.push_back(KeyValuePair{word, hash_key(word, length), (int)count});
+        p += length;
+    }
+    entry->size = header.size;
+    entry->mtime_ns = header.mtime_ns;
+    entry->content_hash = header.content_hash;
+    entry->tokens = header.tokens;
+    return p == end;
+}
+
+// Write the entry for input_path, replacing any older one
+inline bool cache_store(const char* dir, const char* input_path,
+                        const struct CacheEntry& entry) {
+    std::string absolute;
+    std::string path = cache_entry_path(dir, input_path, &absolute);
+
+    struct CacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, 8);
+    header.size = entry.size;
+    header.mtime_ns = entry.mtime_ns;
+    header.content_hash = entry.content_hash;
+    header.tokens = entry.tokens;
+    header.num_records = entry.records.size();
+    header.path_length = (uint32_t)absolute.size();
+    header.reserved = 0;
+
+    std::vector<char> data((const char*)&header, (const char*)(&header + 1));
+    data.insert(data.end(), absolute.begin(), absolute.end());
+    for (size_t i = 0; i < entry.records.size(); i++) {
+        const KeyValuePair& kv = entry.records[i];
+        size_t length = strlen(kv.word);
+        put_varint(&data, (uint64_t)kv.count);
+        data.push_back((char)length);
+        data.insert(data.end(), kv.word, kv.word + length);
+    }
+    uint64_t checksum = hash_bytes(data.data(), data.size());
+    data.insert(data.end(), (const char*)&checksum, (const char*)(&checksum + 1));
+
+    // Write a temporary file, then move it into place
+    std::string temp = path + ".tmp." + std::to_string((long)getpid());
+    FILE* out = fopen(temp.c_str(), "wb");
+    if (out == NULL) return false;
+    bool ok = fwrite(data.data(), 1, data.size(), out) == data.size();
+    ok = fclose(out) == 0 && ok;
+    ok = ok && rename(temp.c_str(), path.c_str()) == 0;
+    if (!ok) unlink(temp.c_str());
+    return ok;
+}
+
+#endif
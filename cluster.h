@@ -0,0 +1,471 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <vector>
+#include "common.h"
+#include "input.h"
+#include "shuffle.h"
+#include "tokenize.h"
+#include "log.h"
+
+// Local cluster: one coordinator and N worker processes on the same host.
+// Control messages go over a Unix socket pair per worker; intermediate
+// data never does. Each worker combines its map tasks, then writes its
+// output, hash-partitioned, into a POSIX shared memory segment. Worker r
+// then reduces partition r by mapping every worker's segment and reading
+// its partition in place, and writes its totals, sorted, to a segment of
+// its own. The coordinator merges those into the final output.
+
+enum ClusterMessageType {
+    CLUSTER_MAP,                // coordinator: map bytes [begin, end)
+    CLUSTER_MAPPED,             // worker: task done, send another
+    CLUSTER_PUBLISH,            // coordinator: no tasks left, write your segment
+    CLUSTER_PUBLISHED,          // worker: map segment written
+    CLUSTER_REDUCE,             // coordinator: reduce your partition
+    CLUSTER_REDUCED,            // worker: output segment written
+    CLUSTER_EXIT,
+    CLUSTER_FAILED              // worker: the last request failed
+};
+
+struct ClusterMessage {
+    int32_t type;
+    int32_t reserved;
+    uint64_t begin;             // CLUSTER_MAP byte range
+    uint64_t end;
+    uint64_t words;             // CLUSTER_PUBLISHED: words mapped
+    uint64_t records;           // records written to the segment
+    uint64_t partials;          // CLUSTER_REDUCED: partial counts read
+};
+
+// Segment layout: this header, num_partitions + 1 offsets of the
+// partitions' records from the start of the segment, then the records.
+// A record is its hash, its count, its length as one byte, and the word
+// with its terminating NUL.
+struct SegmentHeader {
+    uint64_t size;
+    uint32_t num_partitions;
+    uint32_t reserved;
+};
+
+struct Segment {
+    const char* data;
+    size_t size;
+};
+
+struct ClusterWorker {
+    pid_t pid;
+    int socket;                 // coordinator's end of the control socket
+    int tasks;                  // map tasks done
+    size_t words;               // words mapped
+    size_t partials;            // records published after combining
+    size_t reduce_partials;     // records read by its reduce
+    size_t groups;              // final word groups of its partition
+};
+
+struct Cluster {
+    pid_t coordinator;          // names the shared memory segments
+    std::vector<ClusterWorker> workers;
+};
+
+inline void segment_name(char* name, size_t size, pid_t coordinator,
+                         const char* kind, int index) {
+    snprintf(name, size, "/wordcount-%d-%s-%d", (int)coordinator, kind, index);
+}
+
+// Write records, one vector per partition, to a new segment called name
+inline bool write_segment(const char* name,
+                          const std::vector<std::vector<KeyValuePair> >& partitions) {
+    size_t num_partitions = partitions.size();
+    size_t size = sizeof(SegmentHeader) + (num_partitions + 1) * sizeof(uint64_t);
+    for (size_t p = 0; p < num_partitions; p++) {
+        for (size_t i = 0; i < partitions[p].size(); i++) {
+            size += 9 + strlen(partitions[p][i].word) + 1;
+        }
+    }
+
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return false;
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return false;
+    }
+    void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return false;
+
+    char* data = (char*)mapped;
+    struct SegmentHeader header = {size, (uint32_t)num_partitions, 0};
+    memcpy(data, &header, sizeof(header));
+    uint64_t* offsets = (uint64_t*)(data + sizeof(header));
+    char* p = (char*)(offsets + num_partitions + 1);
+    for (size_t part = 0; part < num_partitions; part++) {
+        offsets[part] = p - data;
+        for (size_t i = 0; i < partitions[part].size(); i++) {
+            const KeyValuePair& kv = partitions[part][i];
+            size_t length = strlen(kv.word);
+            memcpy(p, &kv.hash, 4);
+            memcpy(p + 4, &kv.count, 4);
+            p[8] = (char)length;
+            memcpy(p + 9, kv.word, length + 1);
+            p += 9 + length + 1;
+        }
+    }
+    offsets[num_partitions] = p - data;
+    munmap(mapped, size);
+    return true;
+}
+
+// Map an existing segment read-only
+inline bool open_segment(const char* name, struct Segment* segment) {
+    segment->data = NULL;
+    segment->size = 0;
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return false;
+    struct SegmentHeader header;
+    bool ok = pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+    void* mapped = ok ? mmap(NULL, header.size, PROT_READ, MAP_SHARED, fd, 0)
+                      : MAP_FAILED;
+    close(fd);
+    if (mapped == MAP_FAILED) return false;
+    segment->data = (const char*)mapped;
+    segment->size = header.size;
+    return true;
+}
+
+inline void close_segment(struct Segment* segment) {
+    if (segment->data != NULL) munmap((void*)segment->data, segment->size);
+    segment->data = NULL;
+    segment->size = 0;
+}
+
+// Byte range of one partition's records
+inline void segment_partition(const struct Segment* segment, int partition,
+                              const char** begin, const char** end) {
+    const uint64_t* offsets =
+        (const uint64_t*)(segment->data + sizeof(struct SegmentHeader));
+    *begin = segment->data + offsets[partition];
+    *end = segment->data + offsets[partition + 1];
+}
+
+// Decode the record at p; kv.word points into the segment. Returns the
+// next record.
+inline const char* read_record(const char* p, KeyValuePair* kv) {
+    memcpy(&kv->hash, p, 4);
+    memcpy(&kv->count, p + 4, 4);
+    kv->word = p + 9;
+    return p + 9 + (unsigned char)p[8] + 1;
+}
+
+// Whole-message socket I/O; false once the other end is gone
+inline bool send_message(int fd, const struct ClusterMessage& message) {
+    const char* p = (const char*)&message;
+    size_t left = sizeof(message);
+    while (left > 0) {
+        ssize_t n = send(fd, p, left, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        left -= n;
+    }
+    return true;
+}
+
+inline bool receive_message(int fd, struct ClusterMessage* message) {
+    char* p = (char*)message;
+    size_t left = sizeof(*message);
+    while (left > 0) {
+        ssize_t n = recv(fd, p, left, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        left -= n;
+    }
+    return true;
+}
+
+inline struct ClusterMessage cluster_message(int type) {
+    struct ClusterMessage message;
+    memset(&message, 0, sizeof(message));
+    message.type = type;
+    return message;
+}
+
+// Worker Process: serve the coordinator's requests until told to exit
+inline int cluster_worker(int fd, int index, int num_workers, pid_t coordinator,
+                          const char* filename) {
+    struct MappedFile file;
+    if (!map_file(filename, &file)) return 1;
+    StringArena arena;
+    WordCountMap combiner(&arena);
+    size_t words = 0;
+    char name[64];
+
+    struct ClusterMessage request;
+    while (receive_message(fd, &request) && request.type != CLUSTER_EXIT) {
+        struct ClusterMessage reply = cluster_message(CLUSTER_FAILED);
+        if (request.type == CLUSTER_MAP && request.begin <= request.end &&
+            request.end <= file.size) {
+            // Map Phase: combine every task into the one table
+            words += tokenize_clean(file.data + request.begin, file.data + request.end,
+                                    [&](const char* word, size_t length) {
+                combiner.add(word, length, 1);
+            });
+            reply.type = CLUSTER_MAPPED;
+        } else if (request.type == CLUSTER_PUBLISH) {
+            // Shuffle Phase: one partition per worker process
+            std::vector<std::vector<KeyValuePair> > partitions(num_workers);
+            for (size_t i = 0; i < combiner.entries.size(); i++) {
+                const KeyValuePair& kv = combiner.entries[i];
+                partitions[partition_of(kv, num_workers)].push_back(kv);
+            }
+            segment_name(name, sizeof(name), coordinator, "map", index);
+            if (write_segment(name, partitions)) {
+                reply.type = CLUSTER_PUBLISHED;
+                reply.words = words;
+                reply.records = combiner.entries.size();
+            }
+            combiner.clear();
+        } else if (request.type == CLUSTER_REDUCE) {
+            // Reduce Phase: sum this partition of every map segment
+            std::vector<struct Segment> segments(num_workers);
+            bool ok = true;
+            for (int w = 0; w < num_workers && ok; w++) {
+                segment_name(name, sizeof(name), coordinator, "map", w);
+                ok = open_segment(name, &segments[w]);
+            }
+            WordCountMap totals;
+            size_t partials = 0;
+            for (int w = 0; w < num_workers && ok; w++) {
+                const char* p;
+                const char* end;
+                segment_partition(&segments[w], index, &p, &end);
+                while (p < end) {
+                    KeyValuePair kv;
+                    p = read_record(p, &kv);
+                    totals.add(kv);
+                    partials++;
+                }
+            }
+            std::vector<std::vector<KeyValuePair> > output(1);
+            output[0].swap(totals.entries);
+            std::sort(output[0].begin(), output[0].end(),
+                      [](const KeyValuePair& a, const KeyValuePair& b) {
+                          return strcmp(a.word, b.word) < 0;
+                      });
+            segment_name(name, sizeof(name), coordinator, "out", index);
+            if (ok && write_segment(name, output)) {
+                reply.type = CLUSTER_REDUCED;
+                reply.records = output[0].size();
+                reply.partials = partials;
+            }
+            for (int w = 0; w < num_workers; w++) close_segment(&segments[w]);
+        }
+        if (reply.type == CLUSTER_FAILED) {
+            log_printf(LOG_ERROR, "Worker process %d: request %d failed", index,
+                       request.type);
+        }
+        if (!send_message(fd, reply)) break;
+    }
+    unmap_file(&file);
+    return 0;
+}
+
+// Fork the worker processes. Call before starting any thread: a forked
+// child only gets the thread that forked it.
+inline bool cluster_start(struct Cluster* cluster, int num_workers,
+                          const char* filename) {
+    cluster->coordinator = getpid();
+    cluster->workers.clear();
+    fflush(stdout);
+    fflush(stderr);
+    for (int w = 0; w < num_workers; w++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) return false;
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(fds[0]);
+            close(fds[1]);
+            return false;
+        }
+        if (pid == 0) {
+            // Keep only this worker's end of its own socket
+            close(fds[0]);
+            for (size_t i = 0; i < cluster->workers.size(); i++) {
+                close(cluster->workers[i].socket);
+            }
+            int status = cluster_worker(fds[1], w, num_workers,
+                                        cluster->coordinator, filename);
+            close(fds[1]);
+            fflush(stdout);
+            _exit(status);
+        }
+        close(fds[1]);
+        struct ClusterWorker worker = {pid, fds[0], 0, 0, 0, 0, 0};
+        cluster->workers.push_back(worker);
+    }
+    return true;
+}
+
+// Hand out map tasks [bounds[t], bounds[t + 1]) to whichever worker asks
+// for one next, then have every worker publish its map segment
+inline bool cluster_map(struct Cluster* cluster, const std::vector<size_t>& bounds) {
+    size_t num_workers = cluster->workers.size();
+    size_t num_tasks = bounds.size() - 1;
+    size_t next = 0;
+    size_t busy = 0;
+    std::vector<struct pollfd> fds(num_workers);
+    for (size_t w = 0; w < num_workers; w++) {
+        fds[w].fd = cluster->workers[w].socket;
+        fds[w].events = POLLIN;
+        if (next < num_tasks) {
+            struct ClusterMessage task = cluster_message(CLUSTER_MAP);
+            task.begin = bounds[next];
+            task.end = bounds[next + 1];
+            if (!send_message(fds[w].fd, task)) return false;
+            next++;
+            busy++;
+        } else {
+            fds[w].fd = -1;
+        }
+    }
+    while (busy > 0) {
+        if (poll(fds.data(), num_workers, -1) < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        for (size_t w = 0; w < num_workers; w++) {
+            if (fds[w].fd < 0 || fds[w].revents == 0) continue;
+            struct ClusterMessage reply;
+            if (!receive_message(fds[w].fd, &reply) || reply.type != CLUSTER_MAPPED) {
+                return false;
+            }
+            cluster->workers[w].tasks++;
+            if (next < num_tasks) {
+                struct ClusterMessage task = cluster_message(CLUSTER_MAP);
+                task.begin = bounds[next];
+                task.end = bounds[next + 1];
+                if (!send_message(fds[w].fd, task)) return false;
+                next++;
+            } else {
+                fds[w].fd = -1;
+                busy--;
+            }
+        }
+    }
+    return true;
+}
+
+inline bool cluster_publish(struct Cluster* cluster) {
+    for (size_t w = 0; w < cluster->workers.size(); w++) {
+        if (!send_message(cluster->workers[w].socket, cluster_message(CLUSTER_PUBLISH))) {
+            return false;
+        }
+    }
+    for (size_t w = 0; w < cluster->workers.size(); w++) {
+        struct ClusterWorker* worker = &cluster->workers[w];
+        struct ClusterMessage reply;
+        if (!receive_message(worker->socket, &reply) ||
+            reply.type != CLUSTER_PUBLISHED) {
+            return false;
+        }
+        worker->words = reply.words;
+        worker->partials = reply.records;
+    }
+    return true;
+}
+
+inline bool cluster_reduce(struct Cluster* cluster) {
+    for (size_t w = 0; w < cluster->workers.size(); w++) {
+        if (!send_message(cluster->workers[w].socket, cluster_message(CLUSTER_REDUCE))) {
+            return false;
+        }
+    }
+    for (size_t w = 0; w < cluster->workers.size(); w++) {
+        struct ClusterWorker* worker = &cluster->workers[w];
+        struct ClusterMessage reply;
+        if (!receive_message(worker->socket, &reply) ||
+            reply.type != CLUSTER_REDUCED) {
+            return false;
+        }
+        worker->reduce_partials = reply.partials;
+        worker->groups = reply.records;
+    }
+    return true;
+}
+
+// k-way merge of the sorted output segments, calling visit(kv) for every
+// final word in alphabetical order. kv.word is only valid during the call.
+template <typename Visit>
+bool cluster_merge(struct Cluster* cluster, Visit visit) {
+    size_t num_workers = cluster->workers.size();
+    std::vector<struct Segment> segments(num_workers);
+    std::vector<std::pair<const char*, const char*> > heads(num_workers);
+    std::vector<KeyValuePair> current(num_workers);
+    std::vector<int> heap;
+    bool ok = true;
+    char name[64];
+    for (size_t w = 0; w < num_workers && ok; w++) {
+        segment_name(name, sizeof(name), cluster->coordinator, "out", (int)w);
+        ok = open_segment(name, &segments[w]);
+        if (!ok) break;
+        segment_partition(&segments[w], 0, &heads[w].first, &heads[w].second);
+        if (heads[w].first < heads[w].second) {
+            heads[w].first = read_record(heads[w].first, &current[w]);
+            heap.push_back((int)w);
+        }
+    }
+    auto later = [&](int a, int b) {
+        return strcmp(current[b].word, current[a].word) < 0;
+    };
+    std::make_heap(heap.begin(), heap.end(), later);
+    while (ok && !heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), later);
+        int w = heap.back();
+        visit(current[w]);
+        if (heads[w].first < heads[w].second) {
+            heads[w].first = read_record(heads[w].first, &current[w]);
+            std::push_heap(heap.begin(), heap.end(), later);
+        } else {
+            heap.pop_back();
+        }
+    }
+    for (size_t w = 0; w < num_workers; w++) close_segment(&segments[w]);
+    return ok;
+}
+
+// Stop the workers, wait for them, and remove every segment
+inline bool cluster_stop(struct Cluster* cluster) {
+    bool ok = true;
+    char name[64];
+    for (size_t w = 0; w < cluster->workers.size(); w++) {
+        send_message(cluster->workers[w].socket, cluster_message(CLUSTER_EXIT));
+        close(cluster->workers[w].socket);
+    }
+    for (size_t w = 0; w < cluster->workers.size(); w++) {
+        int status;
+        if (waitpid(cluster->workers[w].pid, &status, 0) < 0 ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            ok = false;
+        }
+        segment_name(name, sizeof(name), cluster->coordinator, "map", (int)w);
+        shm_unlink(name);
+        segment_name(name, sizeof(name), cluster->coordinator, "out", (int)w);
+        shm_unlink(name);
+    }
+    cluster->workers.clear();
+    return ok;
+}
+
+#endif
@@ -0,0 +1,295 @@
+#ifndef COMMON_H
+#define COMMON_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <utility>
+#include <vector>
+
+const int MAX_WORDS = 100000;
+const int MAX_WORD_LENGTH = 255;
+
+// Key-Value Pair Struct. The word text lives in a StringArena; records
+// only carry a pointer to it, so sorting and shuffling move 16 bytes.
+struct KeyValuePair {
+    const char* word;
+    uint32_t hash;              // hash_key of word
+    int count;
+};
+
+// Append-only storage for interned words. Words never move, so pointers
+// into the arena stay valid until it is reset or destroyed.
+struct StringArena {
+    static const size_t BLOCK_SIZE = 64 << 10;
+
+    std::vector<char*> blocks;
+    size_t used;                // bytes used in the last block
+    std::vector<char*> free_blocks;     // kept by recycle(), used before new ones
+    std::vector<char*> large_blocks;    // one per word longer than a block
+    size_t large_bytes;                 // bytes of large_blocks
+
+    StringArena() : used(BLOCK_SIZE), large_bytes(0) {}
+    StringArena(const StringArena&) = delete;
+    StringArena& operator=(const StringArena&) = delete;
+    ~StringArena() {
+        for (size_t i = 0; i < blocks.size(); i++) free(blocks[i]);
+        for (size_t i = 0; i < free_blocks.size(); i++) free(free_blocks[i]);
+        free_large();
+    }
+
+    // Copy length bytes of word plus a terminating NUL into the arena
+    const char* intern(const char* word, size_t length) {
+        if (length + 1 > BLOCK_SIZE) return intern_large(word, length);
+        if (used + length + 1 > BLOCK_SIZE) {
+            if (free_blocks.empty()) {
+                blocks.push_back((char*)malloc(BLOCK_SIZE));
+            } else {
+                blocks.push_back(free_blocks.back());
+                free_blocks.pop_back();
+            }
+            used = 0;
+        }
+        char* copy = blocks.back() + used;
+        memcpy(copy, word, length);
+        copy[length] = '\0';
+        used += length + 1;
+        return copy;
+    }
+
+    // A word longer than a block gets a block of its own, counted at its
+    // size and freed rather than reused
+    const char* intern_large(const char* word, size_t length) {
+        char* copy = (char*)malloc(length + 1);
+        memcpy(copy, word, length);
+        copy[length] = '\0';
+        large_blocks.push_back(copy);
+        large_bytes += length + 1;
+        return copy;
+    }
+
+    void free_large() {
+        for (size_t i = 0; i < large_blocks.size(); i++) free(large_blocks[i]);
+        large_blocks.clear();
+        large_bytes = 0;
+    }
+
+    // Forget all words but keep the first block for reuse
+    void reset() {
+        free_large();
+        for (size_t i = 1; i < blocks.size(); i++) free(blocks[i]);
+        if (blocks.size() > 1) blocks.resize(1);
+        used = blocks.empty() ? BLOCK_SIZE : 0;
+    }
+
+    // Forget all words and keep max_blocks blocks, the used ones first and
+    // then new ones, ready for the next words
+    void recycle(size_t max_blocks) {
+        free_large();
+        free_blocks.insert(free_blocks.end(), blocks.begin(), blocks.end());
+        blocks.clear();
+        used = BLOCK_SIZE;
+        while (free_blocks.size() > max_blocks) {
+            free(free_blocks.back());
+            free_blocks.pop_back();
+        }
+        while (free_blocks.size() < max_blocks) {
+            free_blocks.push_back((char*)malloc(BLOCK_SIZE));
+        }
+    }
+
+    // Exchange all words and blocks with another arena
+    void swap(StringArena& other) {
+        blocks.swap(other.blocks);
+        free_blocks.swap(other.free_blocks);
+        large_blocks.swap(other.large_blocks);
+        std::swap(used, other.used);
+        std::swap(large_bytes, other.large_bytes);
+    }
+
+    // Bytes holding words
+    size_t memory_usage() const {
+        size_t bytes = blocks.empty() ? 0 : (blocks.size() - 1) * BLOCK_SIZE + used;
+        return bytes + large_bytes;
+    }
+};
+
+// Monotonic wall-clock time, for phase timings
+inline double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Function to remove punctuation and convert to lowercase
+inline void clean_word(const char* input, char* output) {
+    int j = 0;
+    for (int i = 0; input[i] != '\0'; i++) {
+        if (isalnum(input[i])) {
+            output[j++] = tolower(input[i]);
+        }
+    }
+    output[j] = '\0';
+}
+
+// FNV-1a hash of a word
+inline uint64_t hash_word(const char* word, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)word[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// 32-bit key hash stored in KeyValuePair
+inline uint32_t hash_key(const char* word, size_t length) {
+    uint64_t hash = hash_word(word, length);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// Final mix of a 64-bit hash, so every output bit depends on every input
+// bit
+inline uint64_t mix_hash(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    return hash ^ (hash >> 33);
+}
+
+// Fast 64-bit hash of a byte string, eight bytes at a time
+inline uint64_t hash_bytes(const char* data, size_t size) {
+    const uint64_t multiplier = 0x9e3779b97f4a7c15ULL;
+    uint64_t hash = size * multiplier;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 29;
+    }
+    uint64_t tail = 0;
+    if (i < size) memcpy(&tail, data + i, size - i);
+    hash = (hash ^ tail) * multiplier;
+    return hash ^ (hash >> 32);
+}
+
+// LEB128 varints, for compact on-disk counts and lengths
+inline void put_varint(std::vector<char>* out, uint64_t value) {
+    while (value >= 0x80) {
+        out->push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    out->push_back((char)value);
+}
+
+inline bool get_varint(const char** p, const char* end, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*p)++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (byte < 0x80) return true;
+    }
+    return false;
+}
+
+// Combiner: open-addressing (linear probing) word -> count map owned by a
+// single thread, so no locking is needed while it is filled. New words are
+// interned into arena; maps that only merge existing records need none.
+struct WordCountMap {
+    struct Slot {
+        uint32_t hash;
+        int entry;              // index into entries, -1 when empty
+    };
+
+    std::vector<Slot> slots;
+    std::vector<KeyValuePair> entries;
+    StringArena* arena;
+
+    explicit WordCountMap(StringArena* arena = NULL)
+        : slots(1024, Slot{0, -1}), arena(arena) {}
+
+    // Count a word that is not interned yet
+    void add(const char* word, size_t length, int count) {
+        uint32_t hash = hash_key(word, length);
+        size_t i = find(word, hash);
+        if (slots[i].entry != -1) {
+            entries[slots[i].entry].count += count;
+            return;
+        }
+        insert(i, KeyValuePair{arena->intern(word, length), hash, count});
+    }
+
+    // Merge a record whose word is already interned
+    void add(const KeyValuePair& kv) {
+        size_t i = find(kv.word, kv.hash);
+        if (slots[i].entry != -1) {
+            entries[slots[i].entry].count += kv.count;
+            return;
+        }
+        insert(i, kv);
+    }
+
+    // Slot holding word, or the empty slot where it belongs
+    size_t find(const char* word, uint32_t hash) const {
+        size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+        while (slots[i].entry != -1) {
+            if (slots[i].hash == hash) {
+                const char* other = entries[slots[i].entry].word;
+                if (other == word || strcmp(other, word) == 0) return i;
+            }
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void insert(size_t i, const KeyValuePair& kv) {
+        slots[i].hash = kv.hash;
+        slots[i].entry = (int)entries.size();
+        entries.push_back(kv);
+
+        // Keep the load factor under 1/2
+        if (entries.size() * 2 > slots.size()) grow();
+    }
+
+    // Approximate heap footprint of the stored words, used to decide
+    // when to spill
+    size_t memory_usage() const {
+        return slots.size() * sizeof(Slot) +
+               entries.size() * sizeof(KeyValuePair) +
+               (arena ? arena->memory_usage() : 0);
+    }
+
+    // Drop all counts but keep the interned words, which records already
+    // handed out still point to
+    void clear_counts() {
+        slots.assign(1024, Slot{0, -1});
+        entries.clear();
+    }
+
+    // Drop all words, and their arena, but keep the storage for reuse
+    void clear() {
+        slots.assign(1024, Slot{0, -1});
+        entries.clear();
+        if (arena) arena->reset();
+    }
+
+    void grow() {
+        std::vector<Slot> old;
+        old.swap(slots);
+        slots.assign(old.size() * 2, Slot{0, -1});
+        size_t mask = slots.size() - 1;
+        for (size_t k = 0; k < old.size(); k++) {
+            if (old[k].entry == -1) continue;
+            size_t i = old[k].hash & mask;
+            while (slots[i].entry != -1) i = (i + 1) & mask;
+            slots[i] = old[k];
+        }
+    }
+};
+
+#endif
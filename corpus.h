@@ -0,0 +1,110 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+// Synthetic text for benchmarks: words drawn from a fixed vocabulary with
+// Zipf-distributed frequencies, so the same (size, vocabulary, skew, seed)
+// always gives the same file.
+struct CorpusSpec {
+    size_t bytes;               // approximate file size
+    int vocabulary;             // distinct words to draw from
+    double skew;                // Zipf exponent; 0 is uniform, ~1 is English
+    uint64_t seed;
+};
+
+// splitmix64: small, fast and identical on every platform
+inline uint64_t corpus_random(uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Word of vocabulary rank `rank`: a letter for the digit count, then the
+// rank in base 26, so every rank spells a different word. It is padded to
+// 2..12 letters so lengths vary like real text. Some occurrences are
+// capitalized or carry punctuation to exercise the normalizer; they still
+// clean to the same word.
+inline size_t corpus_word(int rank, uint64_t noise, char* out) {
+    size_t n = 1;
+    for (int r = rank; ; r /= 26) {
+        out[n++] = 'a' + r % 26;
+        if (r < 26) break;
+    }
+    out[0] = 'a' + (char)(n - 1);
+
+    size_t length = 2 + (size_t)(((uint64_t)rank * 0x9e3779b1u) >> 16) % 11;
+    for (uint64_t pad = (uint64_t)rank * 31 + 7; n < length; pad /= 26) {
+        out[n++] = 'a' + pad % 26;
+    }
+    if ((noise & 15) == 0) out[0] = out[0] - 'a' + 'A';
+    if ((noise & 63) == 1) out[n++] = ',';
+    if ((noise & 63) == 2) out[n++] = '.';
+    return n;
+}
+
+// Cumulative Zipf weights of ranks 0 .. vocabulary - 1, scaled to 2^32
+inline std::vector<uint64_t> corpus_cdf(const struct CorpusSpec& spec) {
+    std::vector<double> weights(spec.vocabulary);
+    double total = 0;
+    for (int i = 0; i < spec.vocabulary; i++) {
+        weights[i] = 1.0 / pow((double)(i + 1), spec.skew);
+        total += weights[i];
+    }
+    std::vector<uint64_t> cdf(spec.vocabulary);
+    double sum = 0;
+    for (int i = 0; i < spec.vocabulary; i++) {
+        sum += weights[i];
+        cdf[i] = (uint64_t)(sum / total * 4294967296.0);
+    }
+    cdf[spec.vocabulary - 1] = 1ULL << 32;
+    return cdf;
+}
+
+// Write a corpus to out. Returns the number of words written, or -1 on a
+// write error.
+inline long write_corpus(FILE* out, const struct CorpusSpec& spec) {
+    if (spec.vocabulary <= 0) return -1;
+    std::vector<uint64_t> cdf = corpus_cdf(spec);
+    uint64_t state = spec.seed;
+
+    long words = 0;
+    size_t written = 0;
+    size_t line = 0;
+    char buffer[1 << 16];
+    size_t used = 0;
+    while (written + used < spec.bytes) {
+        uint64_t r = corpus_random(&state);
+        int rank = (int)(std::upper_bound(cdf.begin(), cdf.end(), r & 0xffffffffULL) -
+                         cdf.begin());
+        if (rank >= spec.vocabulary) rank = spec.vocabulary - 1;
+
+        if (used + 64 > sizeof(buffer)) {
+            if (fwrite(buffer, 1, used, out) != used) return -1;
+            written += used;
+            used = 0;
+        }
+        size_t n = corpus_word(rank, r >> 32, buffer + used);
+        used += n;
+        line += n + 1;
+        words++;
+
+        // Lines of about 80 characters
+        if (line >= 80) {
+            buffer[used++] = '\n';
+            line = 0;
+        } else {
+            buffer[used++] = ' ';
+        }
+    }
+    if (used > 0 && fwrite(buffer, 1, used, out) != used) return -1;
+    return words;
+}
+
+#endif
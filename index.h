@@ -0,0 +1,160 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "input.h"
+
+// Result index: the final word counts as a sorted key dictionary that is
+// used straight from a read-only mapping, with nothing parsed at load
+// time. Point queries are a binary search; prefix queries are a binary
+// search for the first match followed by a scan.
+//
+// Layout: an IndexHeader, then num_words 64-bit offsets of the words in
+// the string area, then num_words 32-bit counts, then the string area of
+// NUL-terminated words in ascending order.
+
+const char INDEX_MAGIC[8] = {'W', 'C', 'I', 'N', 'D', 'E', 'X', '1'};
+
+struct IndexHeader {
+    char magic[8];
+    uint64_t num_words;
+    uint64_t offsets_offset;    // file offsets of the three arrays
+    uint64_t counts_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+// Collects final results, which must arrive in ascending word order, and
+// writes them as an index file
+struct IndexBuilder {
+    std::vector<uint64_t> offsets;
+    std::vector<uint32_t> counts;
+    std::vector<char> strings;
+
+    void add(const struct KeyValuePair& kv) {
+        offsets.push_back(strings.size());
+        counts.push_back((uint32_t)kv.count);
+        strings.insert(strings.end(), kv.word, kv.word + strlen(kv.word) + 1);
+    }
+
+    // Write to a temporary file, then move it into place
+    bool write(const char* path) {
+        struct IndexHeader header;
+        memcpy(header.magic, INDEX_MAGIC, 8);
+        header.num_words = offsets.size();
+        header.offsets_offset = sizeof(header);
+        header.counts_offset = header.offsets_offset + offsets.size() * sizeof(uint64_t);
+        header.strings_offset = header.counts_offset + counts.size() * sizeof(uint32_t);
+        header.strings_size = strings.size();
+
+        std::string temp = std::string(path) + ".tmp";
+        FILE* out = fopen(temp.c_str(), "wb");
+        if (out == NULL) return false;
+        bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+                  (offsets.empty() ||
+                   (fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), out) == offsets.size() &&
+                    fwrite(counts.data(), sizeof(uint32_t), counts.size(), out) == counts.size() &&
+                    fwrite(strings.data(), 1, strings.size(), out) == strings.size()));
+        ok = fclose(out) == 0 && ok;
+        ok = ok && rename(temp.c_str(), path) == 0;
+        if (!ok) unlink(temp.c_str());
+        return ok;
+    }
+};
+
+// An index opened for queries
+struct ResultIndex {
+    struct MappedFile file;
+    size_t num_words;
+    const uint64_t* offsets;
+    const uint32_t* counts;
+    const char* strings;
+    size_t strings_size;
+};
+
+// Map an index file and check that its arrays fit inside it, in order and
+// without overlapping. Sizes are compared by subtraction, so a damaged
+// header cannot wrap around and pass.
+inline bool index_open(const char* path, struct ResultIndex* index) {
+    if (!map_file(path, &index->file)) return false;
+    struct IndexHeader header;
+    const struct MappedFile& file = index->file;
+    bool ok = file.size >= sizeof(header);
+    if (ok) memcpy(&header, file.data, sizeof(header));
+    ok = ok && memcmp(header.magic, INDEX_MAGIC, 8) == 0 &&
+         header.offsets_offset >= sizeof(header) &&
+         header.offsets_offset % sizeof(uint64_t) == 0 &&
+         header.counts_offset % sizeof(uint32_t) == 0 &&
+         header.offsets_offset <= header.counts_offset &&
+         header.num_words <= (header.counts_offset - header.offsets_offset) / sizeof(uint64_t) &&
+         header.counts_offset <= header.strings_offset &&
+         header.num_words <= (header.strings_offset - header.counts_offset) / sizeof(uint32_t) &&
+         header.strings_offset <= file.size &&
+         header.strings_size <= file.size - header.strings_offset &&
+         (header.strings_size == 0 || file.data[header.strings_offset + header.strings_size - 1] == '\0');
+    if (!ok) {
+        unmap_file(&index->file);
+        return false;
+    }
+    index->num_words = header.num_words;
+    index->offsets = (const uint64_t*)(file.data + header.offsets_offset);
+    index->counts = (const uint32_t*)(file.data + header.counts_offset);
+    index->strings = file.data + header.strings_offset;
+    index->strings_size = header.strings_size;
+    return true;
+}
+
+inline void index_close(struct ResultIndex* index) {
+    unmap_file(&index->file);
+}
+
+// Word i. Offsets are checked here rather than at open, so opening stays
+// constant time; a damaged one reads as the empty word. The string area
+// ends with a NUL, so any offset inside it gives a terminated word.
+inline const char* index_word(const struct ResultIndex* index, size_t i) {
+    if (index->offsets[i] >= index->strings_size) return "";
+    return index->strings + index->offsets[i];
+}
+
+// Position of the first word not below key
+inline size_t index_lower_bound(const struct ResultIndex* index, const char* key) {
+    size_t low = 0, high = index->num_words;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strcmp(index_word(index, mid), key) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Count of word, or 0 if it does not occur
+inline uint32_t index_lookup(const struct ResultIndex* index, const char* word) {
+    size_t i = index_lower_bound(index, word);
+    if (i < index->num_words && strcmp(index_word(index, i), word) == 0) {
+        return index->counts[i];
+    }
+    return 0;
+}
+
+// Call visit(word, count) for every word starting with prefix, in order;
+// stops early once visit returns false
+template <typename Visit>
+void index_prefix(const struct ResultIndex* index, const char* prefix, Visit visit) {
+    size_t length = strlen(prefix);
+    for (size_t i = index_lower_bound(index, prefix); i < index->num_words; i++) {
+        const char* word = index_word(index, i);
+        if (strncmp(word, prefix, length) != 0) break;
+        if (!visit(word, index->counts[i])) break;
+    }
+}
+
+#endif
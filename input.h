@@ -0,0 +1,202 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stddef.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Read-only memory mapping of an input file
+struct MappedFile {
+    const char* data;
+    size_t size;
+};
+
+// Map a whole file into memory. An empty file maps to {NULL, 0}.
+inline bool map_file(const char* filename, struct MappedFile* file) {
+    file->data = NULL;
+    file->size = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+
+    if (st.st_size > 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        file->data = (const char*)data;
+        file->size = st.st_size;
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+    return true;
+}
+
+inline void unmap_file(struct MappedFile* file) {
+    if (file->data != NULL) munmap((void*)file->data, file->size);
+    file->data = NULL;
+    file->size = 0;
+}
+
+// Split [0, size) into num_ranges byte ranges whose boundaries fall on
+// whitespace, so no token straddles two ranges. bounds must hold
+// num_ranges + 1 offsets; range i is [bounds[i], bounds[i + 1]).
+inline void split_on_whitespace(const char* data, size_t size, int num_ranges,
+                                size_t* bounds) {
+    bounds[0] = 0;
+    for (int i = 1; i < num_ranges; i++) {
+        size_t pos = size * i / num_ranges;
+        if (pos < bounds[i - 1]) pos = bounds[i - 1];
+        while (pos < size && !isspace((unsigned char)data[pos])) pos++;
+        bounds[i] = pos;
+    }
+    bounds[num_ranges] = size;
+}
+
+// Split a file of the given size into num_ranges byte ranges that start
+// after whitespace, reading only a small window around each boundary
+inline void split_file_on_whitespace(int fd, size_t size, int num_ranges,
+                                     size_t* bounds) {
+    bounds[0] = 0;
+    for (int i = 1; i < num_ranges; i++) {
+        size_t pos = size * i / num_ranges;
+        if (pos < bounds[i - 1]) pos = bounds[i - 1];
+        char window[4096];
+        while (pos < size) {
+            ssize_t n = pread(fd, window, sizeof(window), pos);
+            if (n <= 0) {
+                pos = size;
+                break;
+            }
+            ssize_t k = 0;
+            while (k < n && !isspace((unsigned char)window[k])) k++;
+            pos += k;
+            if (k < n) break;
+        }
+        bounds[i] = pos;
+    }
+    bounds[num_ranges] = size;
+}
+
+// One input file of a multi-file job
+struct InputFile {
+    std::string path;
+    size_t size;
+};
+
+// Append the regular files at path to files: path itself, or every file
+// below it, in name order, if it is a directory. Symbolic links below path
+// are followed to files but not to directories, as find does, so a linked
+// tree is not counted twice and a link to a parent cannot loop. A broken
+// link below path is skipped like any other entry that is not a file.
+inline bool list_input_files(const char* path, std::vector<InputFile>* files,
+                             bool top = true) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        struct stat link;
+        return !top && lstat(path, &link) == 0 && S_ISLNK(link.st_mode);
+    }
+    if (!top && S_ISDIR(st.st_mode)) {
+        struct stat link;
+        if (lstat(path, &link) < 0) return false;
+        if (S_ISLNK(link.st_mode)) return true;
+    }
+    if (S_ISREG(st.st_mode)) {
+        files->push_back(InputFile{path, (size_t)st.st_size});
+        return true;
+    }
+    if (!S_ISDIR(st.st_mode)) return true;
+
+    DIR* dir = opendir(path);
+    if (dir == NULL) return false;
+    std::vector<std::string> names;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        names.push_back(entry->d_name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    bool ok = true;
+    std::string prefix = path;
+    if (prefix.empty() || prefix[prefix.size() - 1] != '/') prefix += '/';
+    for (size_t i = 0; i < names.size(); i++) {
+        ok = list_input_files((prefix + names[i]).c_str(), files, false) && ok;
+    }
+    return ok;
+}
+
+// A byte range of one input file read by a map task
+struct InputRange {
+    int file;
+    size_t begin;
+    size_t end;
+};
+
+// Cut files into map tasks of about task_bytes each. Files larger than
+// that are split into whitespace-aligned byte ranges, one task each;
+// smaller files are batched whole into shared tasks. Task t reads
+// ranges[task_offsets[t] .. task_offsets[t + 1]). There is always at
+// least one task.
+inline bool plan_input_tasks(const std::vector<InputFile>& files, size_t task_bytes,
+                             std::vector<InputRange>* ranges,
+                             std::vector<size_t>* task_offsets) {
+    ranges->clear();
+    task_offsets->assign(1, 0);
+    size_t batch_bytes = 0;
+    for (size_t f = 0; f < files.size(); f++) {
+        size_t size = files[f].size;
+        if (size == 0) continue;
+        if (size < task_bytes) {
+            // Batch small files until the task is full
+            if (batch_bytes > 0 && batch_bytes + size > task_bytes) {
+                task_offsets->push_back(ranges->size());
+                batch_bytes = 0;
+            }
+            ranges->push_back(InputRange{(int)f, 0, size});
+            batch_bytes += size;
+            continue;
+        }
+
+        // A large file gets tasks of its own
+        if (batch_bytes > 0) {
+            task_offsets->push_back(ranges->size());
+            batch_bytes = 0;
+        }
+        int fd = open(files[f].path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        int num_ranges = (int)(size / task_bytes);
+        std::vector<size_t> bounds(num_ranges + 1);
+        split_file_on_whitespace(fd, size, num_ranges, bounds.data());
+        close(fd);
+        for (int r = 0; r < num_ranges; r++) {
+            if (bounds[r] == bounds[r + 1]) continue;
+            ranges->push_back(InputRange{(int)f, bounds[r], bounds[r + 1]});
+            task_offsets->push_back(ranges->size());
+        }
+    }
+    if (batch_bytes > 0 || task_offsets->size() == 1) {
+        task_offsets->push_back(ranges->size());
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,323 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+#include <vector>
+#include "common.h"
+#include "shuffle.h"
+#include "pool.h"
+
+// Generic MapReduce job over the worker pool.
+//
+//   map(task, worker, emit)    emits (key, value) pairs for input task `task`
+//                              by calling emit(key, value), or
+//                              emit(key, hash, value) if it already has
+//                              the key's KeyTraits hash
+//   combine(into, value)       folds value into into; must be associative
+//                              and commutative, it runs both map-side and
+//                              reduce-side
+//   reduce(key, value, part)   receives each key's final value once, from
+//                              the task that owns partition `part`
+//
+// All three are template parameters, so they are inlined into the map,
+// combine and reduce loops; the pool only sees one void* per task.
+
+// Key handling. Integral keys hash with one multiply and compare with ==;
+// string keys are interned in the emitting worker's arena.
+template <typename Key, typename Enable = void>
+struct KeyTraits;
+
+template <typename Key>
+struct KeyTraits<Key, typename std::enable_if<std::is_integral<Key>::value>::type> {
+    static const bool needs_arena = false;
+
+    static uint32_t hash(Key key) {
+        return (uint32_t)(((uint64_t)key * 0x9e3779b97f4a7c15ULL) >> 32);
+    }
+    static bool equal(Key a, Key b) {
+        return a == b;
+    }
+    static Key store(Key key, StringArena*) {
+        return key;
+    }
+};
+
+template <>
+struct KeyTraits<const char*> {
+    static const bool needs_arena = true;
+
+    static uint32_t hash(const char* key) {
+        return hash_key(key, strlen(key));
+    }
+    static bool equal(const char* a, const char* b) {
+        return a == b || strcmp(a, b) == 0;
+    }
+    static const char* store(const char* key, StringArena* arena) {
+        return arena->intern(key, strlen(key));
+    }
+};
+
+// Record moved through the shuffle
+template <typename Key, typename Value>
+struct JobRecord {
+    Key key;
+    uint32_t hash;              // KeyTraits<Key>::hash of key
+    Value value;
+};
+
+// Open-addressing (linear probing) key -> value table, same layout as
+// WordCountMap but for any key and combine function
+template <typename Key, typename Value, typename CombineFn>
+struct KeyTable {
+    typedef KeyTraits<Key> Traits;
+    typedef JobRecord<Key, Value> Record;
+
+    struct Slot {
+        uint32_t hash;
+        int entry;              // index into entries, -1 when empty
+    };
+
+    std::vector<Slot> slots;
+    std::vector<Record> entries;
+    StringArena* arena;         // where new keys are stored, if they need it
+    const CombineFn* combine;
+
+    KeyTable(StringArena* arena, const CombineFn* combine)
+        : slots(1024, Slot{0, -1}), arena(arena), combine(combine) {}
+
+    // Fold a value in; a new key is copied into the arena first
+    void add(const Key& key, uint32_t hash, const Value& value) {
+        size_t i = find(key, hash);
+        if (slots[i].entry != -1) {
+            (*combine)(entries[slots[i].entry].value, value);
+            return;
+        }
+        insert(i, Record{Traits::store(key, arena), hash, value});
+    }
+
+    // Fold a record whose key is already stored
+    void merge(const Record& record) {
+        size_t i = find(record.key, record.hash);
+        if (slots[i].entry != -1) {
+            (*combine)(entries[slots[i].entry].value, record.value);
+            return;
+        }
+        insert(i, record);
+    }
+
+    size_t find(const Key& key, uint32_t hash) const {
+        size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+        while (slots[i].entry != -1) {
+            if (slots[i].hash == hash &&
+                Traits::equal(entries[slots[i].entry].key, key)) {
+                return i;
+            }
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void insert(size_t i, const Record& record) {
+        slots[i].hash = record.hash;
+        slots[i].entry = (int)entries.size();
+        entries.push_back(record);
+
+        // Keep the load factor under 1/2
+        if (entries.size() * 2 > slots.size()) grow();
+    }
+
+    void grow() {
+        std::vector<Slot> old;
+        old.swap(slots);
+        slots.assign(old.size() * 2, Slot{0, -1});
+        size_t mask = slots.size() - 1;
+        for (size_t k = 0; k < old.size(); k++) {
+            if (old[k].entry == -1) continue;
+            size_t i = old[k].hash & mask;
+            while (slots[i].entry != -1) i = (i + 1) & mask;
+            slots[i] = old[k];
+        }
+    }
+};
+
+// Common combine functions
+struct SumCombine {
+    template <typename Value>
+    void operator()(Value& into, const Value& value) const { into += value; }
+};
+
+struct MaxCombine {
+    template <typename Value>
+    void operator()(Value& into, const Value& value) const {
+        if (into < value) into = value;
+    }
+};
+
+struct MinCombine {
+    template <typename Value>
+    void operator()(Value& into, const Value& value) const {
+        if (value < into) into = value;
+    }
+};
+
+template <typename MapFn, typename CombineFn, typename ReduceFn,
+          typename Key, typename Value>
+struct Job {
+    typedef KeyTraits<Key> Traits;
+    typedef JobRecord<Key, Value> Record;
+    typedef KeyTable<Key, Value, CombineFn> Table;
+
+    // Handed to map(); adds pairs to the running worker's table
+    struct Emitter {
+        Table* table;
+
+        void operator()(const Key& key, const Value& value) {
+            table->add(key, Traits::hash(key), value);
+        }
+        void operator()(const Key& key, uint32_t hash, const Value& value) {
+            table->add(key, hash, value);
+        }
+    };
+
+    MapFn map_fn;
+    CombineFn combine_fn;
+    ReduceFn reduce_fn;
+    struct WorkerPool* pool;
+    int num_partitions;
+    int max_workers;            // workers the job may use at once, 0 for all
+
+    // Keys of every record point into these; they live as long as the job,
+    // unless the caller lends one arena per worker in lent_arenas
+    const std::vector<StringArena*>* lent_arenas;
+    std::vector<StringArena*> arenas;
+    std::vector<Table*> tables;
+
+    // Filled in by run(), for reporting
+    std::vector<Record> records;            // map output, after the combiner
+    std::vector<size_t> worker_records;     // records each worker produced
+    std::vector<int> partition_offset;      // shuffled partition bounds
+    std::vector<size_t> partition_keys;     // distinct keys per partition
+    double map_seconds;                     // map and combine
+    double shuffle_seconds;                 // publish and partition
+    double reduce_seconds;
+
+    Job(MapFn map_fn, CombineFn combine_fn, ReduceFn reduce_fn,
+        struct WorkerPool* pool, int num_partitions)
+        : map_fn(map_fn), combine_fn(combine_fn), reduce_fn(reduce_fn),
+          pool(pool), num_partitions(num_partitions), max_workers(0),
+          lent_arenas(NULL), map_seconds(0),
+          shuffle_seconds(0), reduce_seconds(0) {}
+
+    Job(const Job&) = delete;
+    Job& operator=(const Job&) = delete;
+    Job(Job&&) = default;
+
+    ~Job() {
+        for (size_t i = 0; i < tables.size(); i++) delete tables[i];
+        for (size_t i = 0; i < arenas.size(); i++) delete arenas[i];
+    }
+
+    static void map_task(void* args, int task, int worker) {
+        Job* job = (Job*)args;
+        Emitter emit = {job->tables[worker]};
+        job->map_fn(task, worker, emit);
+    }
+
+    static void publish_task(void* args, int worker, int) {
+        Job* job = (Job*)args;
+        size_t offset = 0;
+        for (int w = 0; w < worker; w++) offset += job->worker_records[w];
+        const std::vector<Record>& entries = job->tables[worker]->entries;
+        std::copy(entries.begin(), entries.end(), job->records.begin() + offset);
+        delete job->tables[worker];
+        job->tables[worker] = NULL;
+    }
+
+    static void shuffle_count_task(void* args, int slice, int) {
+        shuffle_count((ShufflePlan<Record>*)args, slice);
+    }
+
+    static void shuffle_scatter_task(void* args, int slice, int) {
+        shuffle_scatter((ShufflePlan<Record>*)args, slice);
+    }
+
+    static void reduce_task(void* args, int partition, int) {
+        Job* job = (Job*)args;
+        int begin = job->partition_offset[partition];
+        int end = job->partition_offset[partition + 1];
+
+        // Every record of this partition's keys is here, so the totals
+        // are final once the loop ends
+        Table totals(NULL, &job->combine_fn);
+        for (int i = begin; i < end; i++) totals.merge(job->records[i]);
+        for (size_t i = 0; i < totals.entries.size(); i++) {
+            job->reduce_fn(totals.entries[i].key, totals.entries[i].value, partition);
+        }
+        job->partition_keys[partition] = totals.entries.size();
+    }
+
+    // Run map over tasks 0 .. num_tasks - 1, then shuffle and reduce
+    void run(int num_tasks) {
+        int num_workers = pool->num_workers;
+        for (int w = 0; w < num_workers; w++) {
+            StringArena* arena = NULL;
+            if (Traits::needs_arena && lent_arenas != NULL) {
+                arena = (*lent_arenas)[w];
+            } else if (Traits::needs_arena) {
+                arena = new StringArena();
+                arenas.push_back(arena);
+            }
+            tables.push_back(new Table(arena, &combine_fn));
+        }
+
+        // Map Phase: pairs are combined in per-worker tables
+        double start = now_seconds();
+        pool_run(pool, num_tasks, map_task, this, max_workers);
+        double mapped = now_seconds();
+        map_seconds = mapped - start;
+
+        // Publish every worker's table in parallel
+        worker_records.resize(num_workers);
+        size_t total = 0;
+        for (int w = 0; w < num_workers; w++) {
+            worker_records[w] = tables[w]->entries.size();
+            total += worker_records[w];
+        }
+        records.resize(total);
+        pool_run(pool, num_workers, publish_task, this, max_workers);
+
+        // Shuffle Phase: hash-partition records into disjoint key sets
+        std::vector<Record> shuffled(total);
+        ShufflePlan<Record> plan;
+        shuffle_init(&plan, records.data(), (int)total, shuffled.data(),
+                     num_workers, num_partitions);
+        shuffle_balance(&plan);
+        pool_run(pool, plan.num_slices, shuffle_count_task, &plan, max_workers);
+        shuffle_prefix_sum(&plan);
+        pool_run(pool, plan.num_slices, shuffle_scatter_task, &plan, max_workers);
+        records.swap(shuffled);
+        partition_offset = plan.partition_offset;
+        double shuffled_at = now_seconds();
+        shuffle_seconds = shuffled_at - mapped;
+
+        // Reduce Phase: one task per partition
+        partition_keys.assign(num_partitions, 0);
+        pool_run(pool, num_partitions, reduce_task, this, max_workers);
+        reduce_seconds = now_seconds() - shuffled_at;
+    }
+};
+
+// Build a Job, deducing the functor types (lambdas included)
+template <typename Key, typename Value, typename MapFn, typename CombineFn,
+          typename ReduceFn>
+inline Job<MapFn, CombineFn, ReduceFn, Key, Value>
+make_job(MapFn map_fn, CombineFn combine_fn, ReduceFn reduce_fn,
+         struct WorkerPool* pool, int num_partitions) {
+    return Job<MapFn, CombineFn, ReduceFn, Key, Value>(
+        map_fn, combine_fn, reduce_fn, pool, num_partitions);
+}
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+// Asynchronous leveled logger. Each thread formats its messages into its
+// own single-producer ring; a background thread drains every ring in
+// batches and writes each batch with one call. Logging never takes a lock
+// or does I/O on the calling thread, and messages below the current level
+// cost one branch.
+//
+// ERROR and WARN go to stderr, everything else to stdout. Messages from
+// one thread come out in order; messages from different threads come out
+// in the order they were logged, give or take one drain batch.
+
+enum LogLevel {
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,                   // phase summaries (default)
+    LOG_DEBUG,                  // per-partition and per-task detail
+    LOG_TRACE                   // every word mapped and reduced
+};
+
+const size_t LOG_MESSAGE_SIZE = 320;   // longer messages are truncated
+const size_t LOG_RING_SLOTS = 128;     // per thread, a power of two
+
+struct LogMessage {
+    uint64_t sequence;          // global order of the message
+    int level;
+    char text[LOG_MESSAGE_SIZE];
+};
+
+struct LogRing {
+    LogMessage slots[LOG_RING_SLOTS];
+    alignas(64) std::atomic<size_t> head;   // next slot to drain (drain thread)
+    alignas(64) std::atomic<size_t> tail;   // next slot to fill (owner)
+};
+
+struct Logger {
+    pthread_mutex_t mutex;      // guards rings and the wakeup condition
+    pthread_cond_t wake;
+    pthread_cond_t drained;
+    std::vector<LogRing*> rings;
+    pthread_t thread;
+    bool running;
+    bool stop;
+    std::atomic<uint64_t> next_sequence;    // messages started
+    std::atomic<uint64_t> written;          // messages written out
+    unsigned generation;        // log_shutdown() calls, which free the rings
+};
+
+inline int log_level = LOG_INFO;
+inline struct Logger logger = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, {}, pthread_t(), false, false, {0}, {0}, 0
+};
+inline thread_local LogRing* log_local = NULL;
+inline thread_local unsigned log_local_generation = 0;
+
+inline bool log_enabled(int level) {
+    return level <= log_level;
+}
+
+// "error", "warn", "info", "debug" or "trace"; -1 if unknown
+inline int log_parse_level(const char* name) {
+    const char* names[] = {"error", "warn", "info", "debug", "trace"};
+    for (int i = 0; i <= LOG_TRACE; i++) {
+        if (strcmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// The calling thread's ring, registered on first use. A ring from before
+// the last log_shutdown() has been freed, so it is replaced.
+inline LogRing* log_ring() {
+    if (log_local == NULL || log_local_generation != logger.generation) {
+        LogRing* ring = new LogRing();
+        ring->head = 0;
+        ring->tail = 0;
+        pthread_mutex_lock(&logger.mutex);
+        logger.rings.push_back(ring);
+        pthread_mutex_unlock(&logger.mutex);
+        log_local = ring;
+        log_local_generation = logger.generation;
+    }
+    return log_local;
+}
+
+// Write one batch of messages, oldest first
+inline void log_write_batch(std::vector<LogMessage*>& batch) {
+    std::sort(batch.begin(), batch.end(), [](LogMessage* a, LogMessage* b) {
+        return a->sequence < b->sequence;
+    });
+    std::vector<char> out[2];   // stdout, stderr
+    for (size_t i = 0; i < batch.size(); i++) {
+        std::vector<char>& buffer = out[batch[i]->level <= LOG_WARN];
+        buffer.insert(buffer.end(), batch[i]->text,
+                      batch[i]->text + strlen(batch[i]->text));
+        buffer.push_back('\n');
+    }
+    if (!out[0].empty()) {
+        fwrite(out[0].data(), 1, out[0].size(), stdout);
+        fflush(stdout);
+    }
+    if (!out[1].empty()) {
+        fwrite(out[1].data(), 1, out[1].size(), stderr);
+    }
+}
+
+// Drain every ring once; returns the number of messages written
+inline size_t log_drain() {
+    pthread_mutex_lock(&logger.mutex);
+    std::vector<LogRing*> rings = logger.rings;
+    pthread_mutex_unlock(&logger.mutex);
+
+    std::vector<LogMessage*> batch;
+    std::vector<std::pair<LogRing*, size_t> > taken;
+    for (size_t r = 0; r < rings.size(); r++) {
+        size_t head = rings[r]->head.load(std::memory_order_relaxed);
+        size_t tail = rings[r]->tail.load(std::memory_order_acquire);
+        for (size_t i = head; i < tail; i++) {
+            batch.push_back(&rings[r]->slots[i & (LOG_RING_SLOTS - 1)]);
+        }
+        taken.push_back(std::make_pair(rings[r], tail));
+    }
+    if (batch.empty()) return 0;
+
+    log_write_batch(batch);
+
+    // Hand the slots back only after they are written
+    for (size_t i = 0; i < taken.size(); i++) {
+        taken[i].first->head.store(taken[i].second, std::memory_order_release);
+    }
+    logger.written.fetch_add(batch.size());
+    return batch.size();
+}
+
+inline void* log_thread(void*) {
+    pthread_mutex_lock(&logger.mutex);
+    while (1) {
+        bool stop = logger.stop;
+        pthread_mutex_unlock(&logger.mutex);
+        size_t drained = log_drain();
+        pthread_mutex_lock(&logger.mutex);
+        pthread_cond_broadcast(&logger.drained);
+        if (drained > 0) continue;
+        if (stop) break;
+
+        // Sleep until a ring fills up, a flush, or 10 ms at most
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 10 * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (!logger.stop) {
+            pthread_cond_timedwait(&logger.wake, &logger.mutex, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&logger.mutex);
+    return NULL;
+}
+
+inline void log_wake() {
+    pthread_mutex_lock(&logger.mutex);
+    pthread_cond_signal(&logger.wake);
+    pthread_mutex_unlock(&logger.mutex);
+}
+
+__attribute__((format(printf, 2, 3)))
+inline void log_printf(int level, const char* format, ...) {
+    if (!log_enabled(level)) return;
+
+    va_list args;
+    va_start(args, format);
+    if (!logger.running) {
+        // No drain thread (yet): write directly
+        vfprintf(level <= LOG_WARN ? stderr : stdout, format, args);
+        fputc('\n', level <= LOG_WARN ? stderr : stdout);
+        va_end(args);
+        return;
+    }
+
+    LogRing* ring = log_ring();
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail - ring->head.load(std::memory_order_acquire) == LOG_RING_SLOTS) {
+        // Full: wait for the drain thread rather than lose the message
+        log_wake();
+        while (tail - ring->head.load(std::memory_order_acquire) == LOG_RING_SLOTS) {
+            sched_yield();
+        }
+    }
+    LogMessage* message = &ring->slots[tail & (LOG_RING_SLOTS - 1)];
+    message->sequence = logger.next_sequence.fetch_add(1, std::memory_order_relaxed);
+    message->level = level;
+    vsnprintf(message->text, LOG_MESSAGE_SIZE, format, args);
+    va_end(args);
+    ring->tail.store(tail + 1, std::memory_order_release);
+
+    // Half full: do not wait for the next timed drain
+    if (tail + 1 - ring->head.load(std::memory_order_relaxed) == LOG_RING_SLOTS / 2) {
+        log_wake();
+    }
+}
+
+// Start the drain thread
+inline void log_init(int level) {
+    log_level = level;
+    logger.stop = false;
+    logger.running = pthread_create(&logger.thread, NULL, log_thread, NULL) == 0;
+}
+
+// Wait until every message logged so far has been written
+inline void log_flush() {
+    if (!logger.running) {
+        fflush(stdout);
+        return;
+    }
+    uint64_t target = logger.next_sequence.load();
+    pthread_mutex_lock(&logger.mutex);
+    while (logger.written.load() < target) {
+        pthread_cond_signal(&logger.wake);
+        pthread_cond_wait(&logger.drained, &logger.mutex);
+    }
+    pthread_mutex_unlock(&logger.mutex);
+}
+
+// Write everything still queued, stop the drain thread and free the
+// rings. Later messages are written directly.
+inline void log_shutdown() {
+    if (!logger.running) return;
+    pthread_mutex_lock(&logger.mutex);
+    logger.stop = true;
+    pthread_cond_signal(&logger.wake);
+    pthread_mutex_unlock(&logger.mutex);
+    pthread_join(logger.thread, NULL);
+    logger.running = false;
+
+    pthread_mutex_lock(&logger.mutex);
+    for (size_t i = 0; i < logger.rings.size(); i++) delete logger.rings[i];
+    logger.rings.clear();
+    logger.generation++;
+    pthread_mutex_unlock(&logger.mutex);
+}
+
+#endif
@@ -0,0 +1,101 @@
+// Lookup tool for result indexes written by the engine's --index option.
+// Words are cleaned the way the engine cleans them, so "The," finds "the";
+// a query of several words, for an --ngram index, is cleaned word by word.
+// Each answer is printed as "word: count"; a word that does not occur
+// prints a count of 0.
+#include <stdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "common.h"
+#include "index.h"
+
+using namespace std;
+
+void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s INDEX WORD...             count of each word\n"
+            "       %s INDEX --prefix P [--limit N]  words starting with P\n"
+            "       %s INDEX                     words from stdin, one per line\n",
+            program, program, program);
+}
+
+// Clean each whitespace-separated word of query and join them with single
+// spaces
+std::string clean_query(const char* query) {
+    std::string result;
+    char word[MAX_WORD_LENGTH];
+    char clean[MAX_WORD_LENGTH];
+    const char* p = query;
+    while (*p != '\0') {
+        while (isspace((unsigned char)*p)) p++;
+        size_t length = 0;
+        while (*p != '\0' && !isspace((unsigned char)*p)) {
+            if (length < sizeof(word) - 1) word[length++] = *p;
+            p++;
+        }
+        word[length] = '\0';
+        clean_word(word, clean);
+        if (clean[0] == '\0') continue;
+        if (!result.empty()) result += ' ';
+        result += clean;
+    }
+    return result;
+}
+
+void point_query(const struct ResultIndex* index, const char* query) {
+    std::string clean = clean_query(query);
+    printf("%s: %u\n", clean.c_str(), index_lookup(index, clean.c_str()));
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    struct ResultIndex index;
+    if (!index_open(argv[1], &index)) {
+        fprintf(stderr, "%s: not a readable result index\n", argv[1]);
+        return 1;
+    }
+
+    const char* prefix = NULL;
+    long limit = -1;
+    std::vector<const char*> words;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--prefix") == 0 && i + 1 < argc) {
+            prefix = argv[++i];
+        } else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc) {
+            limit = atol(argv[++i]);
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            usage(argv[0]);
+            index_close(&index);
+            return 1;
+        } else {
+            words.push_back(argv[i]);
+        }
+    }
+
+    if (prefix != NULL) {
+        std::string clean = clean_query(prefix);
+        long shown = 0;
+        index_prefix(&index, clean.c_str(), [&](const char* match, uint32_t count) {
+            if (limit >= 0 && shown >= limit) return false;
+            printf("%s: %u\n", match, count);
+            shown++;
+            return true;
+        });
+    }
+    for (size_t i = 0; i < words.size(); i++) point_query(&index, words[i]);
+    if (prefix == NULL && words.empty()) {
+        char line[4096];
+        while (fgets(line, sizeof(line), stdin) != NULL) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] != '\0') point_query(&index, line);
+        }
+    }
+
+    index_close(&index);
+    return 0;
+}
@@ -0,0 +1,172 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <algorithm>
+#include <vector>
+#include "pool.h"
+
+// Parallel multiway merge of sorted runs. The key space is cut into slices
+// at splitter keys sampled from all runs; every slice is found in each run
+// by binary search, so each slice knows where its output goes and all
+// slices merge at once. Output is the plain concatenation of the slices.
+template <typename Record, typename Less>
+struct MergePlan {
+    std::vector<const Record*> runs;    // sorted runs to merge
+    std::vector<size_t> run_size;
+    Record* output;
+    Less less;
+    int num_slices;
+    std::vector<Record> splitters;      // num_slices - 1 keys
+    std::vector<size_t> bounds;         // [slice][run] start index, row-major
+    std::vector<size_t> slice_offset;   // where each slice's output begins
+
+    explicit MergePlan(Less less) : output(NULL), less(less), num_slices(0) {}
+};
+
+// Samples per slice taken from the runs when choosing splitters
+const int MERGE_SAMPLES_PER_SLICE = 16;
+const int MERGE_SLICES_PER_WORKER = 4;
+
+template <typename Record, typename Less>
+void merge_init(MergePlan<Record, Less>* plan,
+                std::vector<std::vector<Record> >& runs, Record* output,
+                int num_slices) {
+    plan->output = output;
+    plan->runs.clear();
+    plan->run_size.clear();
+    size_t total = 0;
+    for (size_t r = 0; r < runs.size(); r++) {
+        plan->runs.push_back(runs[r].data());
+        plan->run_size.push_back(runs[r].size());
+        total += runs[r].size();
+    }
+    if (total < (size_t)num_slices * MERGE_SAMPLES_PER_SLICE) num_slices = 1;
+    plan->num_slices = num_slices;
+
+    // Evenly spaced samples of every run, in proportion to its size
+    std::vector<Record> samples;
+    size_t wanted = (size_t)num_slices * MERGE_SAMPLES_PER_SLICE;
+    for (size_t r = 0; r < runs.size() && num_slices > 1; r++) {
+        if (runs[r].empty()) continue;
+        size_t n = runs[r].size() * wanted / total + 1;
+        for (size_t i = 0; i < n; i++) {
+            samples.push_back(runs[r][runs[r].size() * i / n]);
+        }
+    }
+    std::sort(samples.begin(), samples.end(), plan->less);
+    plan->splitters.clear();
+    for (int s = 1; s < num_slices; s++) {
+        plan->splitters.push_back(samples[samples.size() * s / num_slices]);
+    }
+    plan->bounds.assign((num_slices + 1) * runs.size(), 0);
+    plan->slice_offset.assign(num_slices + 1, 0);
+}
+
+// Find where slice `slice` begins in every run
+template <typename Record, typename Less>
+void merge_bounds(MergePlan<Record, Less>* plan, int slice) {
+    size_t num_runs = plan->runs.size();
+    for (size_t r = 0; r < num_runs; r++) {
+        size_t begin;
+        if (slice == 0) {
+            begin = 0;
+        } else if (slice == plan->num_slices) {
+            begin = plan->run_size[r];
+        } else {
+            begin = std::lower_bound(plan->runs[r], plan->runs[r] + plan->run_size[r],
+                                     plan->splitters[slice - 1], plan->less) -
+                    plan->runs[r];
+        }
+        plan->bounds[slice * num_runs + r] = begin;
+    }
+}
+
+// Output offset of every slice, once all bounds are known
+template <typename Record, typename Less>
+void merge_prefix_sum(MergePlan<Record, Less>* plan) {
+    size_t num_runs = plan->runs.size();
+    for (int s = 0; s < plan->num_slices; s++) {
+        size_t size = 0;
+        for (size_t r = 0; r < num_runs; r++) {
+            size += plan->bounds[(s + 1) * num_runs + r] - plan->bounds[s * num_runs + r];
+        }
+        plan->slice_offset[s + 1] = plan->slice_offset[s] + size;
+    }
+}
+
+// k-way merge of one slice of every run into its place in the output
+template <typename Record, typename Less>
+void merge_slice(MergePlan<Record, Less>* plan, int slice) {
+    size_t num_runs = plan->runs.size();
+    std::vector<std::pair<size_t, size_t> > heads;  // (position, end) per run
+    std::vector<int> heap;                          // runs by their head
+    for (size_t r = 0; r < num_runs; r++) {
+        size_t begin = plan->bounds[slice * num_runs + r];
+        size_t end = plan->bounds[(slice + 1) * num_runs + r];
+        heads.push_back(std::make_pair(begin, end));
+        if (begin < end) heap.push_back((int)r);
+    }
+    auto later = [&](int a, int b) {
+        return plan->less(plan->runs[b][heads[b].first], plan->runs[a][heads[a].first]);
+    };
+    std::make_heap(heap.begin(), heap.end(), later);
+
+    Record* out = plan->output + plan->slice_offset[slice];
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), later);
+        int r = heap.back();
+        *out++ = plan->runs[r][heads[r].first++];
+        if (heads[r].first < heads[r].second) {
+            std::push_heap(heap.begin(), heap.end(), later);
+        } else {
+            heap.pop_back();
+        }
+    }
+}
+
+template <typename Record, typename Less>
+struct SortRunsArgs {
+    std::vector<std::vector<Record> >* runs;
+    Less less;
+};
+
+template <typename Record, typename Less>
+void sort_run_task(void* args, int run, int) {
+    SortRunsArgs<Record, Less>* sort_args = (SortRunsArgs<Record, Less>*)args;
+    std::vector<Record>& records = (*sort_args->runs)[run];
+    std::sort(records.begin(), records.end(), sort_args->less);
+}
+
+template <typename Record, typename Less>
+void merge_bounds_task(void* args, int slice, int) {
+    merge_bounds((MergePlan<Record, Less>*)args, slice);
+}
+
+template <typename Record, typename Less>
+void merge_slice_task(void* args, int slice, int) {
+    merge_slice((MergePlan<Record, Less>*)args, slice);
+}
+
+// Sort every run in parallel, then merge them all into output, which must
+// have room for every record. At most max_workers workers take part, or
+// all of them if it is 0.
+template <typename Record, typename Less>
+void parallel_sort_merge(struct WorkerPool* pool,
+                         std::vector<std::vector<Record> >& runs, Record* output,
+                         Less less, int max_workers = 0) {
+    int workers = max_workers > 0 ? std::min(max_workers, pool->num_workers)
+                                  : pool->num_workers;
+    SortRunsArgs<Record, Less> sort_args = {&runs, less};
+    pool_run(pool, (int)runs.size(), sort_run_task<Record, Less>, &sort_args,
+             max_workers);
+
+    MergePlan<Record, Less> plan(less);
+    merge_init(&plan, runs, output, workers * MERGE_SLICES_PER_WORKER);
+    pool_run(pool, plan.num_slices + 1, merge_bounds_task<Record, Less>, &plan,
+             max_workers);
+    merge_prefix_sum(&plan);
+    pool_run(pool, plan.num_slices, merge_slice_task<Record, Less>, &plan,
+             max_workers);
+}
+
+#endif
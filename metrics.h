@@ -0,0 +1,306 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+// Per-thread instrumentation. Every thread that records anything gets its
+// own cache-line-aligned block of counters, written only by that thread,
+// so recording is a load and a store with no shared cache lines. Readers
+// (the periodic dumper, the exit dump) load the counters relaxed.
+//
+// Everything is off unless metrics_enable() is called; each recording
+// call then costs one predictable branch. Build with -DNO_METRICS to
+// compile the calls out entirely.
+
+enum MetricCounter {
+    METRIC_TOKENS,              // words produced by the tokenizer
+    METRIC_BYTES,               // input bytes scanned
+    METRIC_TASKS,               // pool tasks run
+    METRIC_STEALS,              // tasks taken from another worker's queue
+    METRIC_LOCK_WAITS,          // contended mutex acquisitions
+    METRIC_LOCK_WAIT_NS,        // time spent waiting for them
+    METRIC_SEM_WAITS,           // semaphore waits
+    METRIC_SEM_WAIT_NS,
+    METRIC_QUEUE_PUSHES,        // batches pushed to pipeline queues
+    METRIC_QUEUE_FULL_WAITS,    // pushes that found the queue full
+    METRIC_QUEUE_POPS,
+    METRIC_QUEUE_DEPTH_SUM,     // queue depth seen by each pop
+    METRIC_SPILLS,              // sorted runs written to disk
+    NUM_METRIC_COUNTERS
+};
+
+const char* const METRIC_NAMES[NUM_METRIC_COUNTERS] = {
+    "tokens", "bytes", "tasks", "steals", "lock_waits", "lock_wait_ns",
+    "sem_waits", "sem_wait_ns", "queue_pushes", "queue_full_waits",
+    "queue_pops", "queue_depth_sum", "spills"
+};
+
+// Wait-time histogram buckets: bucket i counts waits of [2^i, 2^(i+1)) ns
+const int METRIC_WAIT_BUCKETS = 32;
+
+struct alignas(64) ThreadMetrics {
+    std::atomic<uint64_t> counters[NUM_METRIC_COUNTERS];
+    std::atomic<uint64_t> wait_histogram[METRIC_WAIT_BUCKETS];
+    std::atomic<uint64_t> queue_depth_max;
+    char name[32];
+};
+
+struct MetricsRegistry {
+    pthread_mutex_t mutex;
+    std::vector<ThreadMetrics*> threads;
+    std::vector<std::pair<std::string, double> > phases;
+    const char* path;           // where dumps go
+    double interval;            // seconds between periodic dumps, 0 for none
+    double start;
+    pthread_t dumper;
+    bool dumper_running;
+    pthread_mutex_t stop_mutex;
+    pthread_cond_t stop_cond;
+    bool stop;
+    unsigned generation;        // metrics_finish() calls, which free threads
+};
+
+#ifdef NO_METRICS
+const bool metrics_enabled = false;
+#else
+inline bool metrics_enabled = false;
+#endif
+inline struct MetricsRegistry metrics_registry = {
+    PTHREAD_MUTEX_INITIALIZER, {}, {}, NULL, 0, 0, pthread_t(), false,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false, 0
+};
+inline thread_local ThreadMetrics* metrics_local = NULL;
+inline thread_local unsigned metrics_local_generation = 0;
+
+inline uint64_t metrics_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// This thread's counters, registered on first use. Counters from before
+// the last metrics_finish() have been freed, so they are replaced.
+inline ThreadMetrics* metrics_thread() {
+    if (metrics_local == NULL || metrics_local_generation != metrics_registry.generation) {
+        ThreadMetrics* metrics = new ThreadMetrics();
+        for (int i = 0; i < NUM_METRIC_COUNTERS; i++) metrics->counters[i] = 0;
+        for (int i = 0; i < METRIC_WAIT_BUCKETS; i++) metrics->wait_histogram[i] = 0;
+        metrics->queue_depth_max = 0;
+        metrics->name[0] = '\0';
+        pthread_mutex_lock(&metrics_registry.mutex);
+        snprintf(metrics->name, sizeof(metrics->name), "thread %zu",
+                 metrics_registry.threads.size());
+        metrics_registry.threads.push_back(metrics);
+        pthread_mutex_unlock(&metrics_registry.mutex);
+        metrics_local = metrics;
+        metrics_local_generation = metrics_registry.generation;
+    }
+    return metrics_local;
+}
+
+// Single writer: a relaxed load and store, no locked instruction
+inline void metrics_bump(std::atomic<uint64_t>& counter, uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+}
+
+inline void metrics_add(MetricCounter counter, uint64_t n) {
+    if (!metrics_enabled) return;
+    metrics_bump(metrics_thread()->counters[counter], n);
+}
+
+// Name the calling thread in dumps, e.g. "worker 3"
+inline void metrics_name_thread(const char* name) {
+    if (!metrics_enabled) return;
+    snprintf(metrics_thread()->name, sizeof(metrics_thread()->name), "%s", name);
+}
+
+inline void metrics_record_wait(MetricCounter count, MetricCounter total,
+                                uint64_t ns) {
+    ThreadMetrics* metrics = metrics_thread();
+    metrics_bump(metrics->counters[count], 1);
+    metrics_bump(metrics->counters[total], ns);
+    int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+    if (bucket >= METRIC_WAIT_BUCKETS) bucket = METRIC_WAIT_BUCKETS - 1;
+    metrics_bump(metrics->wait_histogram[bucket], 1);
+}
+
+// pthread_mutex_lock that records how long it waited when contended
+inline void metrics_lock(pthread_mutex_t* mutex) {
+    if (!metrics_enabled) {
+        pthread_mutex_lock(mutex);
+        return;
+    }
+    if (pthread_mutex_trylock(mutex) == 0) return;
+    uint64_t start = metrics_now_ns();
+    pthread_mutex_lock(mutex);
+    metrics_record_wait(METRIC_LOCK_WAITS, METRIC_LOCK_WAIT_NS,
+                        metrics_now_ns() - start);
+}
+
+// sem_wait that records how long it waited
+inline void metrics_sem_wait(sem_t* sem) {
+    if (!metrics_enabled) {
+        sem_wait(sem);
+        return;
+    }
+    uint64_t start = metrics_now_ns();
+    sem_wait(sem);
+    metrics_record_wait(METRIC_SEM_WAITS, METRIC_SEM_WAIT_NS,
+                        metrics_now_ns() - start);
+}
+
+// A consumer popped from a queue that held depth values
+inline void metrics_queue_depth(size_t depth) {
+    if (!metrics_enabled) return;
+    ThreadMetrics* metrics = metrics_thread();
+    metrics_bump(metrics->counters[METRIC_QUEUE_POPS], 1);
+    metrics_bump(metrics->counters[METRIC_QUEUE_DEPTH_SUM], depth);
+    if (depth > metrics->queue_depth_max.load(std::memory_order_relaxed)) {
+        metrics->queue_depth_max.store(depth, std::memory_order_relaxed);
+    }
+}
+
+// Wall time of one phase, recorded by the thread that drives the phases
+inline void metrics_phase(const char* name, double seconds) {
+    if (!metrics_enabled) return;
+    pthread_mutex_lock(&metrics_registry.mutex);
+    metrics_registry.phases.push_back(std::make_pair(std::string(name), seconds));
+    pthread_mutex_unlock(&metrics_registry.mutex);
+}
+
+inline void metrics_write_counters(FILE* out, const uint64_t* counters) {
+    for (int i = 0; i < NUM_METRIC_COUNTERS; i++) {
+        fprintf(out, "%s\"%s\": %llu", i ? ", " : "", METRIC_NAMES[i],
+                (unsigned long long)counters[i]);
+    }
+}
+
+// Write a JSON summary of every thread's counters, their totals and the
+// phase times to the dump path. The file is replaced atomically, so a
+// reader never sees half a dump.
+inline bool metrics_dump() {
+    if (!metrics_enabled || metrics_registry.path == NULL) return true;
+    std::string temp = std::string(metrics_registry.path) + ".tmp";
+    FILE* out = fopen(temp.c_str(), "w");
+    if (out == NULL) return false;
+
+    pthread_mutex_lock(&metrics_registry.mutex);
+    fprintf(out, "{\"elapsed_s\": %.6f, \"threads\": [",
+            (metrics_now_ns() * 1e-9) - metrics_registry.start);
+    uint64_t totals[NUM_METRIC_COUNTERS] = {0};
+    uint64_t histogram[METRIC_WAIT_BUCKETS] = {0};
+    uint64_t depth_max = 0;
+    for (size_t t = 0; t < metrics_registry.threads.size(); t++) {
+        ThreadMetrics* metrics = metrics_registry.threads[t];
+        uint64_t counters[NUM_METRIC_COUNTERS];
+        for (int i = 0; i < NUM_METRIC_COUNTERS; i++) {
+            counters[i] = metrics->counters[i].load(std::memory_order_relaxed);
+            totals[i] += counters[i];
+        }
+        fprintf(out, "%s\n  {\"name\": \"%s\", ", t ? "," : "", metrics->name);
+        metrics_write_counters(out, counters);
+        fprintf(out, ", \"wait_histogram_ns_log2\": [");
+        for (int i = 0; i < METRIC_WAIT_BUCKETS; i++) {
+            uint64_t n = metrics->wait_histogram[i].load(std::memory_order_relaxed);
+            histogram[i] += n;
+            fprintf(out, "%s%llu", i ? ", " : "", (unsigned long long)n);
+        }
+        uint64_t depth = metrics->queue_depth_max.load(std::memory_order_relaxed);
+        if (depth > depth_max) depth_max = depth;
+        fprintf(out, "], \"queue_depth_max\": %llu}", (unsigned long long)depth);
+    }
+    fprintf(out, "\n], \"totals\": {");
+    metrics_write_counters(out, totals);
+    fprintf(out, ", \"queue_depth_max\": %llu, \"wait_histogram_ns_log2\": [",
+            (unsigned long long)depth_max);
+    for (int i = 0; i < METRIC_WAIT_BUCKETS; i++) {
+        fprintf(out, "%s%llu", i ? ", " : "", (unsigned long long)histogram[i]);
+    }
+    fprintf(out, "]}, \"phases\": [");
+    for (size_t i = 0; i < metrics_registry.phases.size(); i++) {
+        fprintf(out, "%s{\"name\": \"%s\", \"seconds\": %.6f}", i ? ", " : "",
+                metrics_registry.phases[i].first.c_str(),
+                metrics_registry.phases[i].second);
+    }
+    fprintf(out, "]}\n");
+    pthread_mutex_unlock(&metrics_registry.mutex);
+
+    bool ok = fclose(out) == 0;
+    return ok && rename(temp.c_str(), metrics_registry.path) == 0;
+}
+
+inline void* metrics_dumper(void*) {
+    pthread_mutex_lock(&metrics_registry.stop_mutex);
+    while (!metrics_registry.stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        double next = deadline.tv_sec + deadline.tv_nsec * 1e-9 +
+                      metrics_registry.interval;
+        deadline.tv_sec = (time_t)next;
+        deadline.tv_nsec = (long)((next - (double)deadline.tv_sec) * 1e9);
+        pthread_cond_timedwait(&metrics_registry.stop_cond,
+                               &metrics_registry.stop_mutex, &deadline);
+        if (metrics_registry.stop) break;
+        pthread_mutex_unlock(&metrics_registry.stop_mutex);
+        metrics_dump();
+        pthread_mutex_lock(&metrics_registry.stop_mutex);
+    }
+    pthread_mutex_unlock(&metrics_registry.stop_mutex);
+    return NULL;
+}
+
+// Turn recording on; dumps go to path, every interval seconds if interval
+// is positive and always at metrics_finish()
+inline void metrics_enable(const char* path, double interval) {
+#ifndef NO_METRICS
+    metrics_enabled = true;
+    metrics_registry.path = path;
+    metrics_registry.interval = interval;
+    metrics_registry.start = metrics_now_ns() * 1e-9;
+    if (interval > 0) {
+        metrics_registry.dumper_running =
+            pthread_create(&metrics_registry.dumper, NULL, metrics_dumper, NULL) == 0;
+    }
+#else
+    (void)path;
+    (void)interval;
+#endif
+}
+
+// Stop the periodic dumper, write the final summary and free every
+// thread's counters. Recording stops here, so call it once the other
+// threads are idle.
+inline bool metrics_finish() {
+    if (!metrics_enabled) return true;
+    if (metrics_registry.dumper_running) {
+        pthread_mutex_lock(&metrics_registry.stop_mutex);
+        metrics_registry.stop = true;
+        pthread_cond_signal(&metrics_registry.stop_cond);
+        pthread_mutex_unlock(&metrics_registry.stop_mutex);
+        pthread_join(metrics_registry.dumper, NULL);
+        metrics_registry.dumper_running = false;
+    }
+    bool ok = metrics_dump();
+
+#ifndef NO_METRICS
+    metrics_enabled = false;
+#endif
+    pthread_mutex_lock(&metrics_registry.mutex);
+    for (size_t t = 0; t < metrics_registry.threads.size(); t++) {
+        delete metrics_registry.threads[t];
+    }
+    metrics_registry.threads.clear();
+    metrics_registry.generation++;
+    pthread_mutex_unlock(&metrics_registry.mutex);
+    return ok;
+}
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef NGRAM_H
+#define NGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include "common.h"
+#include "job.h"
+#include "tokenize.h"
+
+// N-gram counting without phrase strings. A window of the last n cleaned
+// words slides over the input, and a polynomial hash of the window is
+// updated as each word enters and the oldest leaves. Counting is keyed on
+// that 64-bit hash plus a span of the mapped input, from the first word
+// to the last. Equal hashes are verified against the spans' text, so a
+// collision never merges two phrases, and the phrase text is only built
+// for the final output.
+
+const int MAX_NGRAM = 8;
+const uint64_t NGRAM_HASH_BASE = 0x100000001b3ULL;
+
+// One n-gram occurrence, or the first one seen of a counted n-gram
+struct NgramKey {
+    uint64_t hash;              // mixed rolling hash of the n cleaned words
+    const char* text;           // raw span in the input, first word to last
+    uint32_t length;
+};
+
+// Cleaned words of a span joined by single spaces: the phrase as printed
+inline void ngram_text(const char* text, size_t length, std::string* out) {
+    out->clear();
+    tokenize_clean(text, text + length, [out](const char* word, size_t n) {
+        if (!out->empty()) out->push_back(' ');
+        out->append(word, n);
+    });
+}
+
+// Same phrase: identical bytes, or the same words after cleaning, such as
+// "The cat" and "the cat,"
+inline bool ngram_equal(const NgramKey& a, const NgramKey& b) {
+    if (a.hash != b.hash) return false;
+    if (a.length == b.length &&
+        (a.text == b.text || memcmp(a.text, b.text, a.length) == 0)) {
+        return true;
+    }
+    static thread_local std::string left, right;
+    ngram_text(a.text, a.length, &left);
+    ngram_text(b.text, b.length, &right);
+    return left == right;
+}
+
+template <>
+struct KeyTraits<NgramKey> {
+    static const bool needs_arena = false;
+
+    static uint32_t hash(const NgramKey& key) {
+        return (uint32_t)(key.hash ^ (key.hash >> 32));
+    }
+    static bool equal(const NgramKey& a, const NgramKey& b) {
+        return ngram_equal(a, b);
+    }
+    static NgramKey store(const NgramKey& key, StringArena*) {
+        return key;
+    }
+};
+
+// Word of the sliding window
+struct NgramWord {
+    const char* begin;
+    uint64_t hash;              // hash_word of the cleaned word
+};
+
+// Call emit(key) for every n-gram whose first word starts in [begin, end).
+// Words after end are read, up to limit, only to finish those n-grams, so
+// an n-gram that crosses a task boundary is counted once, by the task it
+// starts in. Words are cleaned as in word mode and ones that clean to
+// nothing are skipped. Returns the number of whitespace-separated tokens
+// that start in [begin, end).
+template <typename Emit>
+inline size_t scan_ngrams(const char* begin, const char* end, const char* limit,
+                          int n, Emit emit) {
+    struct NgramWord window[MAX_NGRAM];
+    uint64_t leaving = 1;       // weight of the oldest word: base^(n - 1)
+    for (int i = 1; i < n; i++) leaving *= NGRAM_HASH_BASE;
+
+    uint64_t rolling = 0;
+    size_t words = 0;           // non-empty words pushed so far
+    size_t tokens = 0;
+    const char* p = begin;
+    while (p < limit) {
+        while (p < limit && (*p == ' ' || (unsigned)(*p - '\t') < 5)) p++;
+        if (p == limit) break;
+        const char* start = p;
+        if (start >= end) {
+            // Stop once the next n-gram would start past the range
+            size_t first = words + 1 >= (size_t)n ? words + 1 - n : 0;
+            if (first >= words || window[first % n].begin >= end) break;
+        } else {
+            tokens++;
+        }
+
+        // Hash the cleaned word as tokenize_clean would produce it
+        uint64_t hash = 14695981039346656037ULL;
+        int length = 0;
+        for (; p < limit && *p != ' ' && (unsigned)(*p - '\t') >= 5; p++) {
+            unsigned char c = *p;
+            bool upper = (unsigned)(c - 'A') < 26;
+            if (!upper && (unsigned)(c - 'a') >= 26 && (unsigned)(c - '0') >= 10) continue;
+            if (length == MAX_WORD_LENGTH - 1) continue;
+            hash ^= upper ? c + 32 : c;
+            hash *= 1099511628211ULL;
+            length++;
+        }
+        if (length == 0) continue;
+
+        // The new word enters, the oldest leaves
+        struct NgramWord& slot = window[words % n];
+        if (words >= (size_t)n) rolling -= slot.hash * leaving;
+        rolling = rolling * NGRAM_HASH_BASE + hash;
+        slot.begin = start;
+        slot.hash = hash;
+        words++;
+        if (words >= (size_t)n) {
+            const char* first = window[words % n].begin;
+            emit(NgramKey{mix_hash(rolling), first, (uint32_t)(p - first)});
+        }
+    }
+    return tokens;
+}
+
+#endif
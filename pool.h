@@ -0,0 +1,227 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include "metrics.h"
+
+// Task body: runs task number `task` of the current batch on worker `worker`
+typedef void (*TaskFunction)(void* args, int task, int worker);
+
+// Per-worker deque of task numbers. The owner pops from the back, idle
+// workers steal from the front. Each queue has cache lines of its own, so
+// a worker taking its tasks does not disturb its neighbours' queues.
+struct alignas(64) WorkerQueue {
+    pthread_mutex_t mutex;
+    std::deque<int> tasks;
+};
+
+// One pool_run call: its tasks, dealt out over one deque per worker
+struct PoolBatch {
+    TaskFunction function;
+    void* args;
+    int max_workers;            // workers that may run its tasks at once
+    int running;                // workers taking its tasks now (pool mutex)
+    struct WorkerQueue* queues;
+
+    // Every worker decrements these once per task; keep them off the line
+    // that function and args are read from
+    alignas(64) std::atomic<int> queued;        // tasks not taken yet
+    std::atomic<int> remaining;                 // tasks not finished yet
+};
+
+// Persistent worker pool. Threads are created once and reused for every
+// phase; pool_run() hands them a batch of tasks and waits for all of them.
+// Several threads may call pool_run() at once: workers then take one task
+// of each unfinished batch in turn, so concurrent jobs share the workers
+// fairly, and a batch can be limited to a number of workers.
+struct WorkerPool {
+    int num_workers;
+    pthread_t* threads;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;   // a batch was posted or has room, or stop was set
+    pthread_cond_t done_cond;   // a batch finished
+    std::vector<struct PoolBatch*> batches;     // posted and not finished
+    std::atomic<int> num_batches;               // batches.size(), read unlocked
+    bool stop;
+};
+
+struct WorkerArgs {
+    struct WorkerPool* pool;
+    int worker;
+};
+
+// Next task of a batch for a worker: its own newest task, else the oldest
+// task of the first other worker that has one. Returns -1 when every queue
+// of the batch is empty.
+inline int pool_take(struct PoolBatch* batch, int num_workers, int worker) {
+    for (int k = 0; k < num_workers; k++) {
+        int victim = (worker + k) % num_workers;
+        struct WorkerQueue* queue = &batch->queues[victim];
+        metrics_lock(&queue->mutex);
+        int task = -1;
+        if (!queue->tasks.empty()) {
+            if (k == 0) {
+                task = queue->tasks.back();
+                queue->tasks.pop_back();
+            } else {
+                task = queue->tasks.front();
+                queue->tasks.pop_front();
+            }
+        }
+        pthread_mutex_unlock(&queue->mutex);
+        if (task != -1) {
+            if (k != 0) metrics_add(METRIC_STEALS, 1);
+            batch->queued.fetch_sub(1);
+            return task;
+        }
+    }
+    return -1;
+}
+
+// Next batch, in turn after the last one this worker ran, that has tasks
+// left and room under its worker limit; NULL if none. Pool mutex held.
+inline struct PoolBatch* pool_next_batch(struct WorkerPool* pool, size_t* turn) {
+    size_t count = pool->batches.size();
+    for (size_t k = 0; k < count; k++) {
+        struct PoolBatch* batch = pool->batches[(*turn + k) % count];
+        if (batch->queued.load() > 0 && batch->running < batch->max_workers) {
+            *turn = (*turn + k + 1) % count;
+            return batch;
+        }
+    }
+    return NULL;
+}
+
+inline void* pool_worker(void* args) {
+    struct WorkerArgs* worker_args = (struct WorkerArgs*)args;
+    struct WorkerPool* pool = worker_args->pool;
+    int worker = worker_args->worker;
+    delete worker_args;
+
+    char name[32];
+    snprintf(name, sizeof(name), "worker %d", worker);
+    metrics_name_thread(name);
+
+    size_t turn = 0;
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        struct PoolBatch* batch = pool_next_batch(pool, &turn);
+        if (batch == NULL) {
+            if (pool->stop) break;
+            pthread_cond_wait(&pool->work_cond, &pool->mutex);
+            continue;
+        }
+        batch->running++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        // Drain the batch while it is the only one; otherwise run one task
+        // and let the next batch have its turn
+        int task;
+        while ((task = pool_take(batch, pool->num_workers, worker)) != -1) {
+            batch->function(batch->args, task, worker);
+            metrics_add(METRIC_TASKS, 1);
+            batch->remaining.fetch_sub(1);
+            if (pool->num_batches.load() > 1) break;
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        bool was_full = batch->running == batch->max_workers;
+        batch->running--;
+        if (batch->remaining.load() == 0 && batch->running == 0) {
+            pthread_cond_broadcast(&pool->done_cond);
+        } else if (was_full && batch->queued.load() > 0) {
+            pthread_cond_broadcast(&pool->work_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+// Start num_workers threads, worker w restricted to (*affinity)[w] if
+// affinity is given. Threads start on their CPUs, so even their stacks
+// are allocated there.
+inline void pool_init(struct WorkerPool* pool, int num_workers,
+                      const std::vector<cpu_set_t>* affinity = NULL) {
+    pool->num_workers = num_workers;
+    pool->threads = new pthread_t[num_workers];
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->num_batches = 0;
+    pool->stop = false;
+    for (int i = 0; i < num_workers; i++) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (affinity != NULL) {
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &(*affinity)[i]);
+        }
+        pthread_create(&pool->threads[i], &attr, pool_worker,
+                       new WorkerArgs{pool, i});
+        pthread_attr_destroy(&attr);
+    }
+}
+
+// Run function(args, task, worker) for task = 0 .. num_tasks - 1 and wait
+// until every task has finished. Tasks are dealt out to the workers in
+// contiguous blocks; workers that run dry steal from the others. At most
+// max_workers workers run the batch at once, or all of them if it is 0.
+inline void pool_run(struct WorkerPool* pool, int num_tasks,
+                     TaskFunction function, void* args, int max_workers = 0) {
+    if (num_tasks <= 0) return;
+
+    struct PoolBatch batch;
+    batch.function = function;
+    batch.args = args;
+    batch.max_workers = max_workers > 0 && max_workers < pool->num_workers ?
+                        max_workers : pool->num_workers;
+    batch.running = 0;
+    batch.queues = new WorkerQueue[pool->num_workers];
+    batch.queued = num_tasks;
+    batch.remaining = num_tasks;
+    for (int w = 0; w < pool->num_workers; w++) {
+        struct WorkerQueue* queue = &batch.queues[w];
+        pthread_mutex_init(&queue->mutex, NULL);
+        int begin = (int)((long)num_tasks * w / pool->num_workers);
+        int end = (int)((long)num_tasks * (w + 1) / pool->num_workers);
+        for (int task = begin; task < end; task++) queue->tasks.push_back(task);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->batches.push_back(&batch);
+    pool->num_batches = (int)pool->batches.size();
+    pthread_cond_broadcast(&pool->work_cond);
+    while (batch.remaining.load() > 0 || batch.running > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+    pool->batches.erase(std::find(pool->batches.begin(), pool->batches.end(), &batch));
+    pool->num_batches = (int)pool->batches.size();
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int w = 0; w < pool->num_workers; w++) {
+        pthread_mutex_destroy(&batch.queues[w].mutex);
+    }
+    delete[] batch.queues;
+}
+
+// Stop and join the workers
+inline void pool_destroy(struct WorkerPool* pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    delete[] pool->threads;
+}
+
+#endif
@@ -2,302 +2,1632 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <signal.h>
+#include <poll.h>
 #include <iostream>
+#include <iomanip>
 #include <algorithm>
+#include <thread>
+#include "common.h"
+#include "shuffle.h"
+#include "job.h"
+#include "input.h"
+#include "tokenize.h"
+#include "spill.h"
+#include "pool.h"
+#include "queue.h"
+#include "metrics.h"
+#include "log.h"
+#include "topk.h"
+#include "merge.h"
+#include "cluster.h"
+#include "cache.h"
+#include "readahead.h"
+#include "index.h"
+#include "ngram.h"
+#include "sketch.h"
+#include "affinity.h"
+#include "server.h"
+#include "window.h"
 
 using namespace std;
 
-const int MAX_WORDS = 100000;
-const int MAX_WORD_LENGTH = 255;
-const int NUM_MAPPERS = 4;
-const int NUM_REDUCERS = 2;
+// Task sizes: input is cut into many small tasks so idle workers can steal
+const size_t MAP_TASK_BYTES = 1 << 20;      // mapped-file bytes per map task
+const int MAP_TASK_WORDS = 4096;            // manual-input words per map task
+const size_t MAP_TASK_PARTIALS = 1 << 16;   // cached partial counts per map task
+const size_t STREAM_TASK_BYTES = 16 << 20;  // file bytes per streaming task
+const int TASKS_PER_WORKER = 4;             // minimum tasks per phase and worker
+const int PARTITIONS_PER_WORKER = 4;        // reduce tasks per worker
+const size_t PIPELINE_QUEUE_SLOTS = 256;    // batches buffered per reducer
+const int WORKERS_PER_PIPELINE_REDUCER = 4;
+const int READAHEAD_THREADS = 2;            // I/O threads for multi-file input
+const int READAHEAD_TASKS_PER_WORKER = 2;   // tasks loaded ahead per worker
+const size_t APPROX_TOP_WORDS = 20;         // --approx output without --top
+const size_t HEAVY_HITTERS_PER_TOP_WORD = 8;    // candidates kept per worker
+const size_t MIN_HEAVY_HITTERS = 256;
+const int SERVER_SESSIONS = 4;              // --serve clients served at once
+const size_t WINDOW_BATCH_BYTES = 1 << 20;  // most --window input per micro-batch
+const int WINDOW_BATCH_MS = 100;            // longest input waits to be mapped
+const size_t WINDOW_TASK_BYTES = 64 << 10;  // micro-batch bytes per map task
+const int TAIL_POLL_MS = 100;               // how often a followed file is checked
 
-// Key-Value Pair Struct
-struct KeyValuePair {
-    char word[MAX_WORD_LENGTH];
-    int count;
+// Per-worker state, reused by every task the worker runs. Workers update
+// their counters after every task, so each state has cache lines of its
+// own.
+struct alignas(64) WorkerState {
+    StringArena arena;          // word text of every record this worker made
+    WordCountMap combiner;
+    size_t words;
+    int tasks;
+    size_t partials;            // partial counts handed on after combining
+    char* buffer;               // streaming read buffer
+    std::vector<char> input;    // read-ahead data of the current task
+    int spills;
+    bool ok;
+    
+    WorkerState() : combiner(&arena), words(0), tasks(0), partials(0),
+                    buffer(NULL),
+                    spills(0), ok(true) {}
+};
+
+// Map Phase Arguments Struct
+struct MapArgs {
+    char** input_data;          // manual input words, or NULL for a file
+    int input_size;
+    const char* text;           // mapped file
+    const KeyValuePair* partials;   // cached partial counts, or NULL
+    struct ReadAhead* reader;   // multi-file input, or NULL
+    std::vector<size_t> bounds; // byte (or partial) range of each map task
 };
 
-// Mapper Arguments Struct
-struct MapperArgs {
-    char** input_data;
-    int data_size;
-    int mapper_id;
+// Streaming Phase Arguments Struct
+struct StreamArgs {
+    int fd;
+    std::vector<size_t> bounds; // byte range of each map task
+    size_t memory_budget;       // combiner bytes per worker before a spill
+    struct SpillRuns* runs;
+    std::vector<std::string> outputs;   // sorted totals of each partition
+    std::vector<bool> reduced;          // per partition: merge succeeded
+    std::vector<TopK> tops;             // per partition, in --top mode
+    StringArena* top_arenas;            // words kept by tops
 };
 
-// Reducer Arguments Struct
-struct ReducerArgs {
-    struct KeyValuePair* intermediate_data;
-    int data_size;
+// Pipelined Reducer State: one thread per partition that folds batches of
+// partial counts in as map tasks push them
+struct alignas(64) PipelineReducer {
+    MpscQueue<std::vector<KeyValuePair>*> queue;
+    WordCountMap totals;
+    pthread_t thread;
     int reducer_id;
+    size_t records;
+    int batches;
+    TopK top;                   // best of totals, in --top mode
+};
+
+// Pipelined Map Phase Arguments Struct
+struct PipelineArgs {
+    struct MapArgs* map_args;
+    struct PipelineReducer* reducers;
+    int num_reducers;
+};
+
+// One reducer's output. Reducers append to theirs in parallel, so each
+// sits on cache lines of its own.
+struct alignas(64) PartitionResults {
+    std::vector<KeyValuePair> records;
+};
+
+// Run Statistics: what --stats writes once the job is done
+struct RunStats {
+    const char* mode;
+    size_t bytes;               // input size
+    size_t tokens;              // words mapped in earlier runs (--cache)
+    size_t distinct;            // final word groups
+    double map_seconds;
+    double shuffle_seconds;
+    double reduce_seconds;
+    double output_seconds;      // sort and print
+    double total_seconds;
 };
 
 // Synchronization primitives
 pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
-sem_t mapper_sem;
-sem_t reducer_sem;
 
 // Global shared resources
-struct KeyValuePair global_intermediate_results[MAX_WORDS];
-int global_intermediate_count = 0;
-struct KeyValuePair global_final_results[MAX_WORDS];
-int global_final_count = 0;
+struct WorkerPool pool;
+int num_workers;
+int num_partitions;
+struct WorkerState* workers;
+struct RunStats run_stats;
+bool quiet = false;             // count only, do not print the words
+size_t top_k = 0;               // print only the k most frequent words
+std::vector<PartitionResults> global_partition_results;
+std::vector<KeyValuePair> global_final_results;
+std::vector<TopK> global_top_parts;     // per reducer, in --top mode
+const char* index_path = NULL;          // --index output, if any
+int ngram_size = 0;                     // --ngram: count phrases of n words
+bool approximate = false;               // --approx: fixed-memory estimates
+double sketch_epsilon = 1e-4;           // --epsilon: count error per token
+double sketch_delta = 0.01;             // --delta: chance of exceeding it
+int hll_precision = 14;                 // --hll-precision: log2 registers
+struct WordSketch* sketches;            // per worker, in --approx mode
+struct IndexBuilder result_index;       // final results, in word order
+struct Server server;                   // --serve mode
+volatile sig_atomic_t window_stop = 0;  // --window: SIGINT or SIGTERM seen
 
-// Function to remove punctuation and convert to lowercase
-void clean_word(const char* input, char* output) {
-    int j = 0;
-    for (int i = 0; input[i] != '\0'; i++) {
-        if (isalnum(input[i])) {
-            output[j++] = tolower(input[i]);
+// Map Function: Tokenize and clean the words of one task, calling
+// emit(word, length) for each; no lock is held while mapping
+template <typename Emit>
+void map_words(struct MapArgs* map_args, int task, struct WorkerState* state,
+               Emit emit) {
+    int worker = (int)(state - workers);
+    bool trace = log_enabled(LOG_TRACE);
+    auto traced_emit = [&](const char* word, size_t length) {
+        if (trace) log_printf(LOG_TRACE, "Worker %d mapped word: %s", worker, word);
+        emit(word, length);
+    };
+    
+    if (map_args->reader != NULL) {
+        // Tokenize whichever task the read-ahead threads loaded next
+        if (!readahead_take(map_args->reader, &state->input)) state->ok = false;
+        size_t tokens = tokenize_clean(state->input.data(),
+                                       state->input.data() + state->input.size(),
+                                       traced_emit);
+        state->words += tokens;
+        metrics_add(METRIC_TOKENS, tokens);
+    } else if (map_args->input_data == NULL) {
+        // Tokenize this task's byte range of the mapped file in place
+        size_t tokens = tokenize_clean(map_args->text + map_args->bounds[task],
+                                       map_args->text + map_args->bounds[task + 1],
+                                       traced_emit);
+        state->words += tokens;
+        metrics_add(METRIC_TOKENS, tokens);
+        metrics_add(METRIC_BYTES, map_args->bounds[task + 1] - map_args->bounds[task]);
+    } else {
+        // Process each word in this task's chunk of the input data
+        int begin = task * MAP_TASK_WORDS;
+        int end = min(begin + MAP_TASK_WORDS, map_args->input_size);
+        for (int i = begin; i < end; i++) {
+            char clean[MAX_WORD_LENGTH];
+            clean_word(map_args->input_data[i], clean);
+            state->words++;
+            
+            size_t length = strlen(clean);
+            if (length == 0) continue; // Skip empty strings after cleaning
+            
+            traced_emit((const char*)clean, length);
         }
+        metrics_add(METRIC_TOKENS, max(0, end - begin));
     }
-    output[j] = '\0';
+    state->tasks++;
+    log_printf(LOG_DEBUG, "Worker %d finished map task %d", worker, task);
 }
 
+// Print what the shuffle and each reducer of a finished job did
+template <typename WordCountJob>
+void print_job_summary(const WordCountJob& job) {
+    int largest = 0;
+    for (int r = 0; r < num_partitions; r++) {
+        largest = max(largest, job.partition_offset[r + 1] - job.partition_offset[r]);
+    }
+    log_printf(LOG_INFO, "Shuffle phase completed. Partitioned %zu partial "
+               "counts into %d partitions, largest %.2fx the mean",
+               job.records.size(), num_partitions,
+               job.records.empty() ? 0.0 : largest * (double)num_partitions / job.records.size());
+    for (int r = 0; r < num_partitions; r++) {
+        log_printf(LOG_INFO, "Reducer %d completed. Reduced %d partial counts "
+                   "to %zu final word groups", r,
+                   job.partition_offset[r + 1] - job.partition_offset[r],
+                   job.partition_keys[r]);
+    }
+}
 
-// Map Function: Tokenize and count word occurrences
-void* mapper(void* args) {
-    struct MapperArgs* map_args = (struct MapperArgs*)args;
-    
-    pthread_mutex_lock(&global_mutex);
-    cout << "Mapper " << map_args->mapper_id << " processing " 
-         << map_args->data_size << " words\n";
+// Print how much of the map phase each worker did
+void print_map_summary(bool streaming) {
+    for (int w = 0; w < num_workers; w++) {
+        log_printf(LOG_INFO, "Worker %d completed. Mapped %zu words in %d "
+                   "tasks into %zu %s", w, workers[w].words, workers[w].tasks,
+                   streaming ? (size_t)workers[w].spills : workers[w].partials,
+                   streaming ? "spills" : "partial counts");
+    }
+}
+
+// Add a finished job's phase times and key counts to run_stats and print
+// what its phases did
+template <typename AnyJob>
+void summarize_job(const AnyJob& job, bool mapped_text) {
+    run_stats.map_seconds += job.map_seconds;
+    run_stats.shuffle_seconds += job.shuffle_seconds;
+    run_stats.reduce_seconds += job.reduce_seconds;
+    if (mapped_text) {
+        for (int w = 0; w < num_workers; w++) {
+            workers[w].partials = job.worker_records[w];
+        }
+        print_map_summary(false);
+    }
+    print_job_summary(job);
+    for (int r = 0; r < num_partitions; r++) {
+        run_stats.distinct += job.partition_keys[r];
+    }
+}
+
+// Word count as a generic job: one (word, 1) pair per word, or one
+// (word, count) pair per cached partial count, summed by the combiners and
+// reducers. Result words live in the job's arenas.
+template <typename Reduce>
+auto make_word_count_job(struct MapArgs* map_args, Reduce reduce) {
+    return make_job<const char*, int>(
+        [map_args](int task, int worker, auto& emit) {
+            if (map_args->partials != NULL) {
+                for (size_t i = map_args->bounds[task]; i < map_args->bounds[task + 1]; i++) {
+                    const KeyValuePair& kv = map_args->partials[i];
+                    emit(kv.word, kv.hash, kv.count);
+                }
+                return;
+            }
+            map_words(map_args, task, &workers[worker],
+                      [&](const char* word, size_t length) {
+                emit(word, hash_key(word, length), 1);
+            });
+        },
+        SumCombine(), reduce, &pool, num_partitions);
+}
+
+// Cache Function: append the partial counts of one input file to
+// partials. They come from the file's cache entry if the file is
+// unchanged; otherwise the file is counted by a job of its own and the
+// entry is rewritten. Words live in arena.
+bool load_or_count(const char* cache_dir, const char* path,
+                   const struct MappedFile* file, StringArena* arena,
+                   std::vector<KeyValuePair>* partials) {
+    uint64_t size;
+    int64_t mtime_ns;
+    if (!file_identity(path, &size, &mtime_ns)) return false;
+    struct CacheEntry entry;
+    bool cached = cache_load(cache_dir, path, &entry, arena) && entry.size == size;
+    if (cached && entry.mtime_ns != mtime_ns) {
+        // Touched, but maybe not changed: the content decides
+        cached = entry.content_hash == hash_bytes(file->data, file->size);
+        entry.mtime_ns = mtime_ns;
+        if (cached && !cache_store(cache_dir, path, entry)) return false;
+    }
     
-    // Process each word in the input data
-    for (int i = 0; i < map_args->data_size; i++) {
-        char clean[MAX_WORD_LENGTH];
-        clean_word(map_args->input_data[i], clean);
-        
-        if (strlen(clean) == 0) continue; // Skip empty strings after cleaning
+    if (cached) {
+        log_printf(LOG_INFO, "Cache hit: %s (%zu partial counts)", path,
+                   entry.records.size());
+        run_stats.tokens += entry.tokens;
+    } else {
+        struct MapArgs map_args;
+        map_args.input_data = NULL;
+        map_args.input_size = 0;
+        map_args.text = file->data;
+        map_args.partials = NULL;
+        map_args.reader = NULL;
+        int num_tasks = max((size_t)num_workers * TASKS_PER_WORKER,
+                            file->size / MAP_TASK_BYTES + 1);
+        map_args.bounds.resize(num_tasks + 1);
+        split_on_whitespace(file->data, file->size, num_tasks, map_args.bounds.data());
         
-        struct KeyValuePair kv;
-        strncpy(kv.word, clean, MAX_WORD_LENGTH);
-        kv.count = 1;
+        // Reducers own their partitions, so each fills its own vector
+        std::vector<std::vector<KeyValuePair> > counts(num_partitions);
+        auto job = make_word_count_job(&map_args,
+                                       [&counts](const char* word, int count, int partition) {
+            counts[partition].push_back(KeyValuePair{word, 0, count});
+        });
+        size_t words = 0;
+        for (int w = 0; w < num_workers; w++) words -= workers[w].words;
+        job.run(num_tasks);
+        run_stats.map_seconds += job.map_seconds;
+        run_stats.shuffle_seconds += job.shuffle_seconds;
+        run_stats.reduce_seconds += job.reduce_seconds;
+        for (int w = 0; w < num_workers; w++) {
+            words += workers[w].words;
+            workers[w].partials += job.worker_records[w];
+        }
+        print_map_summary(false);
         
-        // Add to global intermediate results
-        cout << "Mapper " << map_args->mapper_id << " mapped word: " 
-             << kv.word << endl;
-        global_intermediate_results[global_intermediate_count++] = kv;
+        // Copy the words out of the job's arenas before it goes away
+        entry.records.clear();
+        for (int r = 0; r < num_partitions; r++) {
+            for (size_t i = 0; i < counts[r].size(); i++) {
+                size_t length = strlen(counts[r][i].word);
+                const char* word = arena->intern(counts[r][i].word, length);
+                entry.records.push_back(KeyValuePair{word, hash_key(word, length),
+                                                     counts[r][i].count});
+            }
+        }
+        entry.size = size;
+        entry.mtime_ns = mtime_ns;
+        entry.content_hash = hash_bytes(file->data, file->size);
+        entry.tokens = words;
+        if (!cache_store(cache_dir, path, entry)) return false;
+        log_printf(LOG_INFO, "Cache miss: %s, counted %zu words into %zu partial "
+                   "counts", path, words, entry.records.size());
     }
+    partials->insert(partials->end(), entry.records.begin(), entry.records.end());
+    return true;
+}
+
+// Streaming Map Function: read a byte range in fixed-size chunks and spill
+// sorted runs whenever the worker's combiner exceeds its memory budget
+void stream_map_task(void* args, int task, int worker) {
+    struct StreamArgs* stream_args = (struct StreamArgs*)args;
+    struct WorkerState* state = &workers[worker];
     
-    cout << "Mapper " << map_args->mapper_id << " completed. "
-         << "Mapped " << global_intermediate_count << " words\n";
+    if (state->buffer == NULL) state->buffer = (char*)malloc(STREAM_CHUNK_SIZE);
+    if (state->buffer == NULL) {
+        state->ok = false;
+        return;
+    }
     
+    size_t words = state->words;
+    state->ok = stream_tokens(stream_args->fd, stream_args->bounds[task],
+                              stream_args->bounds[task + 1], state->buffer,
+                              STREAM_CHUNK_SIZE, &state->words,
+                              [&](const char* word, size_t length) {
+        state->combiner.add(word, length, 1);
+        if (state->combiner.memory_usage() > stream_args->memory_budget) {
+            state->ok = spill_combiner(state->combiner, stream_args->runs) &&
+                        state->ok;
+            state->spills++;
+            metrics_add(METRIC_SPILLS, 1);
+        }
+    }) && state->ok;
+    state->tasks++;
+    metrics_add(METRIC_TOKENS, state->words - words);
+    metrics_add(METRIC_BYTES, stream_args->bounds[task + 1] - stream_args->bounds[task]);
+}
+
+// Spill what is left in one worker's combiner and release its buffer
+void stream_flush_task(void* args, int task, int) {
+    struct StreamArgs* stream_args = (struct StreamArgs*)args;
+    struct WorkerState* state = &workers[task];
+    
+    if (state->ok && !state->combiner.entries.empty()) {
+        state->ok = spill_combiner(state->combiner, stream_args->runs);
+        state->spills++;
+        metrics_add(METRIC_SPILLS, 1);
+    }
+    free(state->buffer);
+    state->buffer = NULL;
+}
+
+// Streaming Reduce Function: k-way merge one partition's runs into one
+// sorted run of final counts
+void stream_reduce_task(void* args, int partition, int) {
+    struct StreamArgs* stream_args = (struct StreamArgs*)args;
+    const std::vector<std::string>& files = stream_args->runs->files[partition];
+    
+    // In --top mode only the partition's best words are kept, in memory
+    long groups = 0;
+    struct RunWriter writer;
+    bool ok = top_k > 0 || writer.open(stream_args->outputs[partition]);
+    if (ok) {
+        ok = merge_runs(files, [&](const KeyValuePair& kv) {
+            if (log_enabled(LOG_TRACE)) {
+                log_printf(LOG_TRACE, "Reducer %d reduced word: %s (%d)",
+                           partition, kv.word, kv.count);
+            }
+            if (top_k > 0) {
+                stream_args->tops[partition].offer(kv);
+            } else {
+                ok = writer.write(kv) && ok;
+            }
+            groups++;
+        }) && ok;
+        if (top_k == 0) ok = writer.close() && ok;
+    }
+    
+    // reduced is a vector<bool>: neighbouring flags share a word
+    metrics_lock(&global_mutex);
+    stream_args->reduced[partition] = ok;
+    run_stats.distinct += groups;
     pthread_mutex_unlock(&global_mutex);
+    log_printf(LOG_INFO, "Reducer %d completed. Merged %zu runs into %ld "
+               "final word groups", partition, files.size(), groups);
+}
+
+// Print the --top words, most frequent first
+void print_top(const std::vector<KeyValuePair>& top) {
+    log_flush();
+    if (quiet) return;
+    cout << "\nTop " << top_k << " Words ("
+         << (approximate ? "approximate count" : "by count") << "):\n";
+    for (size_t i = 0; i < top.size(); i++) {
+        cout << top[i].word << ": " << top[i].count << "\n";
+    }
+}
+
+// Sort every reducer's output in parallel, merge them into the final
+// results with a parallel multiway merge, and print them
+void print_sorted_results() {
+    size_t total = 0;
+    std::vector<std::vector<KeyValuePair> > runs(global_partition_results.size());
+    for (size_t r = 0; r < global_partition_results.size(); r++) {
+        runs[r].swap(global_partition_results[r].records);
+        total += runs[r].size();
+    }
+    global_final_results.resize(total);
+    parallel_sort_merge(&pool, runs, global_final_results.data(),
+                        [](const KeyValuePair& a, const KeyValuePair& b) {
+                            return strcmp(a.word, b.word) < 0;
+                        });
+    
+    if (index_path != NULL) {
+        for (size_t i = 0; i < global_final_results.size(); i++) {
+            result_index.add(global_final_results[i]);
+        }
+    }
+    
+    // Print final results after every summary line
+    log_flush();
+    if (quiet) return;
+    cout << "\nFinal Results (Sorted Alphabetically):\n";
+    for (size_t i = 0; i < global_final_results.size(); i++) {
+        cout << global_final_results[i].word << ": "
+             << global_final_results[i].count << "\n";
+    }
+}
+
+// N-gram count as a generic job keyed on rolling hashes of the word
+// window. Keys are spans of the mapped file, so no phrase is built while
+// counting; each reducer writes the text of its final n-grams into its own
+// arena in phrases.
+void run_ngrams(struct MapArgs* map_args, int num_tasks, StringArena* phrases) {
+    const char* limit = map_args->text + map_args->bounds[num_tasks];
+    auto job = make_job<NgramKey, int>(
+        [map_args, limit](int task, int worker, auto& emit) {
+            struct WorkerState* state = &workers[worker];
+            size_t begin = map_args->bounds[task], end = map_args->bounds[task + 1];
+            size_t tokens = scan_ngrams(map_args->text + begin, map_args->text + end,
+                                        limit, ngram_size,
+                                        [&](const NgramKey& key) { emit(key, 1); });
+            state->words += tokens;
+            state->tasks++;
+            metrics_add(METRIC_TOKENS, tokens);
+            metrics_add(METRIC_BYTES, end - begin);
+        },
+        SumCombine(),
+        [phrases](const NgramKey& key, int count, int partition) {
+            // A phrase that cannot make the --top cut is never built
+            if (top_k > 0 && global_top_parts[partition].heap.size() == top_k &&
+                count < global_top_parts[partition].heap.front().count) {
+                return;
+            }
+            static thread_local std::string phrase;
+            ngram_text(key.text, key.length, &phrase);
+            const char* text = phrases[partition].intern(phrase.data(), phrase.size());
+            KeyValuePair kv = {text, hash_key(text, phrase.size()), count};
+            if (log_enabled(LOG_TRACE)) {
+                log_printf(LOG_TRACE, "Reducer %d reduced n-gram: %s (%d)",
+                           partition, text, count);
+            }
+            if (top_k > 0) {
+                global_top_parts[partition].offer(kv);
+            } else {
+                global_partition_results[partition].records.push_back(kv);
+            }
+        },
+        &pool, num_partitions);
+    job.run(num_tasks);
+    summarize_job(job, true);
+}
+
+// Approximate Map Function: combine one task's words, then fold each
+// distinct word into the worker's sketch. Only the sketch outlives the
+// task, so memory does not grow with the vocabulary.
+void approx_map_task(void* args, int task, int worker) {
+    struct MapArgs* map_args = (struct MapArgs*)args;
+    struct WorkerState* state = &workers[worker];
+    map_words(map_args, task, state, [&](const char* word, size_t length) {
+        state->combiner.add(word, length, 1);
+    });
+    for (size_t i = 0; i < state->combiner.entries.size(); i++) {
+        const KeyValuePair& kv = state->combiner.entries[i];
+        sketches[worker].add(kv.word, strlen(kv.word), kv.hash, kv.count);
+    }
+    state->partials += state->combiner.entries.size();
+    state->combiner.clear();
+}
+
+// Fold one slice of every worker's sketch arrays into worker 0's
+void sketch_merge_task(void*, int slice, int) {
+    struct WordSketch& into = sketches[0];
+    size_t counters = into.counts.counters.size();
+    size_t registers = into.distinct.registers.size();
+    for (int w = 1; w < num_workers; w++) {
+        into.counts.merge(sketches[w].counts, counters * slice / num_partitions,
+                          counters * (slice + 1) / num_partitions);
+        into.distinct.merge(sketches[w].distinct, registers * slice / num_partitions,
+                            registers * (slice + 1) / num_partitions);
+    }
+}
+
+// Approximate word count: every worker keeps a fixed-size sketch, the
+// sketches are merged slice by slice in parallel, and the heavy-hitter
+// candidates of all workers are ranked by their merged estimates into the
+// --top heap
+void run_approximate(struct MapArgs* map_args, int num_tasks) {
+    sketches = new WordSketch[num_workers];
+    size_t candidates = max(top_k * HEAVY_HITTERS_PER_TOP_WORD, MIN_HEAVY_HITTERS);
+    for (int w = 0; w < num_workers; w++) {
+        sketches[w].init(sketch_epsilon, sketch_delta, hll_precision, candidates);
+    }
+    log_printf(LOG_INFO, "Sketch per worker: %d x %zu counters, %zu registers, "
+               "%zu KB, and up to %zu candidates", sketches[0].counts.depth,
+               sketches[0].counts.width, sketches[0].distinct.registers.size(),
+               sketches[0].memory_usage() >> 10, 2 * candidates);
+    
+    double start = now_seconds();
+    pool_run(&pool, num_tasks, approx_map_task, map_args);
+    double mapped = now_seconds();
+    run_stats.map_seconds = mapped - start;
+    print_map_summary(false);
+    
+    // Reduce Phase: merge the arrays, then estimate each candidate once
+    pool_run(&pool, num_partitions, sketch_merge_task, NULL);
+    const struct WordSketch& merged = sketches[0];
+    WordCountMap seen;
+    TopK top;
+    top.k = top_k;
+    for (int w = 0; w < num_workers; w++) {
+        const std::vector<KeyValuePair>& words = sketches[w].heavy.words.entries;
+        for (size_t i = 0; i < words.size(); i++) {
+            size_t slot = seen.find(words[i].word, words[i].hash);
+            if (seen.slots[slot].entry != -1) continue;
+            seen.insert(slot, words[i]);
+            uint64_t hash = mix_hash(hash_word(words[i].word, strlen(words[i].word)));
+            top.offer(KeyValuePair{words[i].word, words[i].hash,
+                                   (int)merged.counts.estimate(hash)});
+        }
+    }
+    global_top_parts.assign(1, top);
+    run_stats.distinct = (size_t)llround(merged.distinct.estimate());
+    log_printf(LOG_INFO, "Merged %d sketches and ranked %zu heavy-hitter "
+               "candidates", num_workers, seen.entries.size());
+    run_stats.reduce_seconds = now_seconds() - mapped;
+}
+
+// Print the error bounds of the --approx estimates
+void print_estimates() {
+    uint64_t total = 0;
+    for (int w = 0; w < num_workers; w++) total += sketches[w].total;
+    const struct WordSketch& merged = sketches[0];
+    cout << "\nEach count is at most " << (uint64_t)ceil(sketch_epsilon * total)
+         << " over the true count, with probability " << 100 * (1 - sketch_delta) << "%\n";
+    cout << "Distinct words: about " << run_stats.distinct << " (relative standard error "
+         << 100 * merged.distinct.relative_error() << "%)\n";
+}
+
+// Pipelined Map Function: map one task, then hand its partial counts to
+// the reducers right away instead of keeping them until the phase ends
+void pipeline_map_task(void* args, int task, int worker) {
+    struct PipelineArgs* pipeline_args = (struct PipelineArgs*)args;
+    struct WorkerState* state = &workers[worker];
+    map_words(pipeline_args->map_args, task, state,
+              [&](const char* word, size_t length) {
+        state->combiner.add(word, length, 1);
+    });
+    
+    std::vector<std::vector<KeyValuePair>*> batches(pipeline_args->num_reducers, NULL);
+    for (size_t i = 0; i < state->combiner.entries.size(); i++) {
+        const KeyValuePair& kv = state->combiner.entries[i];
+        int r = partition_of(kv, pipeline_args->num_reducers);
+        if (batches[r] == NULL) batches[r] = new std::vector<KeyValuePair>();
+        batches[r]->push_back(kv);
+    }
+    for (int r = 0; r < pipeline_args->num_reducers; r++) {
+        if (batches[r] != NULL) pipeline_args->reducers[r].queue.push(batches[r]);
+    }
+    state->partials += state->combiner.entries.size();
     
-    sem_post(&mapper_sem);
+    // The words stay in the worker's arena for the reducers to read
+    state->combiner.clear_counts();
+}
+
+// Pipelined Reduce Function: fold batches until every map task is done
+void* pipeline_reducer(void* args) {
+    struct PipelineReducer* reducer = (struct PipelineReducer*)args;
+    char name[32];
+    snprintf(name, sizeof(name), "reducer %d", reducer->reducer_id);
+    metrics_name_thread(name);
+    
+    std::vector<KeyValuePair>* batch;
+    while (reducer->queue.pop(&batch)) {
+        for (size_t i = 0; i < batch->size(); i++) {
+            reducer->totals.add((*batch)[i]);
+        }
+        log_printf(LOG_DEBUG, "Reducer %d folded a batch of %zu partial counts",
+                   reducer->reducer_id, batch->size());
+        reducer->records += batch->size();
+        reducer->batches++;
+        delete batch;
+    }
+    
+    // Words live in the mappers' arenas, so the heap need not copy them
+    if (top_k > 0) {
+        for (size_t i = 0; i < reducer->totals.entries.size(); i++) {
+            reducer->top.offer(reducer->totals.entries[i]);
+        }
+    }
     return NULL;
 }
 
-// Shuffle Phase: Group by key
-void shuffle() {
-    pthread_mutex_lock(&global_mutex);
+// Map and reduce at the same time: reducers fold each map task's output as
+// it arrives, so only the final output waits for both phases
+void run_pipelined(struct MapArgs* map_args, int num_tasks) {
+    int num_reducers = max(1, num_workers / WORKERS_PER_PIPELINE_REDUCER);
+    struct PipelineReducer* reducers = new PipelineReducer[num_reducers];
+    for (int r = 0; r < num_reducers; r++) {
+        reducers[r].queue.init(PIPELINE_QUEUE_SLOTS);
+        reducers[r].reducer_id = r;
+        reducers[r].records = 0;
+        reducers[r].batches = 0;
+        reducers[r].top.k = top_k;
+        pthread_create(&reducers[r].thread, NULL, pipeline_reducer, &reducers[r]);
+    }
     
-    // Sort intermediate results by word
-    sort(global_intermediate_results, 
-         global_intermediate_results + global_intermediate_count, 
-         [](const KeyValuePair& a, const KeyValuePair& b) {
-             return strcmp(a.word, b.word) < 0;
-         });
+    struct PipelineArgs pipeline_args;
+    pipeline_args.map_args = map_args;
+    pipeline_args.reducers = reducers;
+    pipeline_args.num_reducers = num_reducers;
+    double start = now_seconds();
+    pool_run(&pool, num_tasks, pipeline_map_task, &pipeline_args);
+    double mapped = now_seconds();
+    run_stats.map_seconds = mapped - start;
+    print_map_summary(false);
     
-    // Print shuffled and grouped results before reduction
-    cout << "After Shuffle: ";
-    for (int i = 0; i < global_intermediate_count - 1; i++) {
-        cout << "(\"" << global_intermediate_results[i].word << "\", [1";
-        
-        // Check for subsequent identical words to show multiple 1's
-        int duplicates = 0;
-        for (int j = i + 1; j < global_intermediate_count; j++) {
-            if (strcmp(global_intermediate_results[i].word, 
-                       global_intermediate_results[j].word) == 0) {
-                cout << ", 1";
-                duplicates++; 
-        }
-        cout << "]) ";
-    }
-    cout << endl;
-    
-    // Group and aggregate counts
-    for (int i = 0; i < global_intermediate_count - 1; i++) {
-        if (strcmp(global_intermediate_results[i].word, 
-                   global_intermediate_results[i+1].word) == 0) {
-            global_intermediate_results[i].count += 
-                global_intermediate_results[i+1].count;
-            
-            // Shift remaining elements
-            for (int j = i+1; j < global_intermediate_count - 1; j++) {
-                global_intermediate_results[j] = global_intermediate_results[j+1];
+    // Every push has happened; let the reducers drain and finish
+    for (int r = 0; r < num_reducers; r++) {
+        reducers[r].queue.close();
+    }
+    for (int r = 0; r < num_reducers; r++) {
+        pthread_join(reducers[r].thread, NULL);
+        std::vector<KeyValuePair>& entries = reducers[r].totals.entries;
+        log_printf(LOG_INFO, "Reducer %d completed. Folded %d batches of %zu "
+                   "partial counts into %zu final word groups", r,
+                   reducers[r].batches, reducers[r].records, entries.size());
+        run_stats.distinct += entries.size();
+        if (top_k > 0) {
+            global_top_parts.push_back(reducers[r].top);
+        } else {
+            global_partition_results.push_back(PartitionResults{std::move(entries)});
+        }
+        reducers[r].queue.destroy();
+    }
+    delete[] reducers;
+    
+    // Reducers ran alongside the mappers; only the drain is left to time
+    run_stats.reduce_seconds = now_seconds() - mapped;
+}
+
+// Out-of-core word count: memory is bounded by memory_budget plus one read
+// buffer per worker, whatever the size of the input
+int run_streaming(const char* filename, size_t memory_budget) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        cerr << "Error opening file\n";
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    
+    run_stats.bytes = st.st_size;
+    
+    struct SpillRuns runs;
+    if (!open_spill_runs(&runs, num_partitions)) {
+        cerr << "Error creating spill directory\n";
+        close(fd);
+        return 1;
+    }
+    
+    // Split the budget between the workers' read buffers and combiners
+    struct StreamArgs stream_args;
+    size_t buffers = num_workers * STREAM_CHUNK_SIZE;
+    stream_args.fd = fd;
+    stream_args.runs = &runs;
+    stream_args.top_arenas = NULL;
+    stream_args.memory_budget = memory_budget > buffers ?
+        (memory_budget - buffers) / num_workers : 0;
+    if (stream_args.memory_budget < (1 << 20)) stream_args.memory_budget = 1 << 20;
+    
+    int num_tasks = max((size_t)num_workers * TASKS_PER_WORKER,
+                        st.st_size / STREAM_TASK_BYTES + 1);
+    stream_args.bounds.resize(num_tasks + 1);
+    split_file_on_whitespace(fd, st.st_size, num_tasks, stream_args.bounds.data());
+    double start = now_seconds();
+    pool_run(&pool, num_tasks, stream_map_task, &stream_args);
+    pool_run(&pool, num_workers, stream_flush_task, &stream_args);
+    double mapped = now_seconds();
+    run_stats.map_seconds = mapped - start;
+    close(fd);
+    print_map_summary(true);
+    
+    bool ok = true;
+    for (int w = 0; w < num_workers; w++) ok = workers[w].ok && ok;
+    
+    // Runs are already partitioned by key hash, so each reducer merges
+    // only its own partition's runs
+    if (ok) {
+        for (int r = 0; r < num_partitions; r++) {
+            stream_args.outputs.push_back(next_run_path(&runs, "final"));
+        }
+        stream_args.reduced.assign(num_partitions, false);
+        if (top_k > 0) {
+            stream_args.tops.resize(num_partitions);
+            stream_args.top_arenas = new StringArena[num_partitions];
+            for (int r = 0; r < num_partitions; r++) {
+                stream_args.tops[r].k = top_k;
+                stream_args.tops[r].arena = &stream_args.top_arenas[r];
             }
-            global_intermediate_count--;
-            i--; // Recheck this index
+        }
+        pool_run(&pool, num_partitions, stream_reduce_task, &stream_args);
+        for (int r = 0; r < num_partitions; r++) {
+            ok = stream_args.reduced[r] && ok;
         }
     }
+    double reduced = now_seconds();
+    run_stats.reduce_seconds = reduced - mapped;
     
-    cout << "Shuffle phase completed. Grouped into " 
-         << global_intermediate_count << " unique words\n";
+    // Partitions hold disjoint, sorted keys: merge them while printing
+    if (ok && top_k > 0) {
+        print_top(merge_top_k(&pool, stream_args.tops));
+    } else if (ok) {
+        log_flush();
+        if (!quiet) cout << "\nFinal Results (Sorted Alphabetically):\n";
+        ok = merge_runs(stream_args.outputs, [](const KeyValuePair& kv) {
+            if (index_path != NULL) result_index.add(kv);
+            if (!quiet) cout << kv.word << ": " << kv.count << "\n";
+        });
+    }
+    run_stats.output_seconds = now_seconds() - reduced;
+    delete[] stream_args.top_arenas;
     
-    pthread_mutex_unlock(&global_mutex);
+    for (size_t i = 0; i < stream_args.outputs.size(); i++) {
+        unlink(stream_args.outputs[i].c_str());
+    }
+    close_spill_runs(&runs);
+    
+    if (!ok) {
+        cerr << "Error writing or reading spill files\n";
+        return 1;
+    }
+    return 0;
 }
 
-// Reduce Function: Aggregate word counts
-void* reducer(void* args) {
-    struct ReducerArgs* reduce_args = (struct ReducerArgs*)args;
+// Totals of a --window run, for its summary line
+struct WindowRun {
+    long windows;               // printed so far
+    size_t tokens;              // in closed panes
+    size_t evicted;             // pane words taken out of the totals
+    size_t peak;                // most distinct words in one window
+};
+
+// Windowed Map Function: tokenize one task's bytes of a micro-batch into
+// the worker's combiner
+void window_map_task(void* args, int task, int worker) {
+    struct WorkerState* state = &workers[worker];
+    map_words((struct MapArgs*)args, task, state, [&](const char* word, size_t length) {
+        state->combiner.add(word, length, 1);
+    });
+}
+
+// Map [data, data + size), whole tokens only, into the current pane. The
+// combiners are folded into the pane and emptied, so workers hold no
+// words between micro-batches.
+void window_map(struct WindowState* window, const char* data, size_t size) {
+    if (size == 0) return;
+    struct MapArgs map_args;
+    map_args.input_data = NULL;
+    map_args.input_size = 0;
+    map_args.text = data;
+    map_args.partials = NULL;
+    map_args.reader = NULL;
+    int num_tasks = (int)min((size_t)num_workers * TASKS_PER_WORKER,
+                             size / WINDOW_TASK_BYTES + 1);
+    map_args.bounds.resize(num_tasks + 1);
+    split_on_whitespace(data, size, num_tasks, map_args.bounds.data());
     
-    pthread_mutex_lock(&global_mutex);
-    cout << "Reducer " << reduce_args->reducer_id << " processing " 
-         << reduce_args->data_size << " word groups\n";
+    size_t words = 0;
+    for (int w = 0; w < num_workers; w++) words -= workers[w].words;
+    pool_run(&pool, num_tasks, window_map_task, &map_args);
+    for (int w = 0; w < num_workers; w++) {
+        words += workers[w].words;
+        window->fold(workers[w].combiner.entries);
+        workers[w].partials += workers[w].combiner.entries.size();
+        workers[w].combiner.clear();
+    }
+    window->current()->tokens += words;
+}
+
+// Print the window that ends with the current pane: every word, or the
+// --top words, with its count in the window
+void print_window(struct WindowState* window, long number) {
+    struct WindowPane* pane = window->current();
+    char range[96];
+    if (window->spec.unit == WINDOW_TOKENS) {
+        snprintf(range, sizeof(range), "tokens %.0f-%.0f", window->first() + 1, pane->last);
+    } else {
+        snprintf(range, sizeof(range), "seconds %.3f-%.3f", window->first(), pane->last);
+    }
+    std::vector<KeyValuePair> words;
+    if (!quiet) {
+        const std::vector<KeyValuePair>& totals = window->counts.totals.entries;
+        TopK top;
+        top.k = top_k;
+        for (size_t i = 0; i < totals.size(); i++) {
+            if (totals[i].count == 0) continue;
+            if (top_k > 0) top.offer(totals[i]);
+            else words.push_back(totals[i]);
+        }
+        if (top_k > 0) {
+            words = top.sorted();
+        } else {
+            std::sort(words.begin(), words.end(), [](const KeyValuePair& a, const KeyValuePair& b) {
+                return strcmp(a.word, b.word) < 0;
+            });
+        }
+    }
     
-    // Aggregate counts for each unique word
-    for (int i = 0; i < reduce_args->data_size; i++) {
-        cout << "Reducer " << reduce_args->reducer_id 
-             << " reducing word: " << reduce_args->intermediate_data[i].word 
-             << endl;
+    log_flush();
+    cout << "\nWindow " << number << " (" << range << ", "
+         << window->counts.live << " distinct words):\n";
+    for (size_t i = 0; i < words.size(); i++) {
+        cout << words[i].word << ": " << words[i].count << "\n";
+    }
+    cout.flush();
+}
+
+// Close the current pane at last, print the window that ends with it and,
+// unless the input has ended, open the next pane
+void close_pane(struct WindowState* window, double last, struct WindowRun* run,
+                bool reopen) {
+    run->tokens += window->current()->tokens;
+    window->close(last);
+    print_window(window, ++run->windows);
+    run->peak = max(run->peak, window->counts.live);
+    if (reopen) run->evicted += window->open(last);
+}
+
+// Map whole tokens into the current pane. With token windows the data is
+// cut where the pane fills up, and the pane is closed, as often as the
+// data fills panes.
+void window_feed(struct WindowState* window, const char* data, size_t size,
+                 struct WindowRun* run) {
+    while (size > 0) {
+        size_t cut = size, passed = 0;
+        if (window->spec.unit == WINDOW_TOKENS) {
+            size_t want = (size_t)window->spec.slide - window->current()->tokens;
+            cut = skip_tokens(data, size, want, &passed);
+        }
+        window_map(window, data, cut);
+        data += cut;
+        size -= cut;
+        if (window->spec.unit == WINDOW_TOKENS &&
+            window->current()->tokens == (size_t)window->spec.slide) {
+            close_pane(window, run->tokens + window->current()->tokens, run, true);
+        }
+    }
+}
+
+void stop_window(int) {
+    window_stop = 1;
+}
+
+// Windowed Mode: count stdin, or a file followed as it grows, in
+// micro-batches and print every window as it closes. Memory is bounded by
+// the panes of one window plus one micro-batch; no input waits longer than
+// WINDOW_BATCH_MS to be mapped. Runs until the input ends or a signal.
+int run_windowed(const char* filename, const struct WindowSpec* spec) {
+    int fd = filename != NULL ? open(filename, O_RDONLY) : STDIN_FILENO;
+    if (fd < 0) {
+        cerr << "Error opening file\n";
+        return 1;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_window;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    
+    struct WindowState window;
+    window.init(spec);
+    bool by_time = spec->unit == WINDOW_SECONDS;
+    std::vector<char> buffer(WINDOW_BATCH_BYTES);
+    size_t filled = 0;
+    off_t offset = 0;           // of a followed file
+    double start = now_seconds();
+    double batch_deadline = 0;  // when the buffered input must be mapped
+    struct WindowRun run = {0, 0, 0, 0};
+    bool eof = false, ok = true;
+    window.open(0);
+    
+    while (!eof && ok && !window_stop) {
+        // Wait for input until the pane or the micro-batch is due
+        double now = now_seconds();
+        double deadline = by_time ? start + window.next * spec->slide : -1;
+        if (filled > 0 && (deadline < 0 || batch_deadline < deadline)) deadline = batch_deadline;
+        int timeout = deadline < 0 ? -1 : max(0, (int)ceil((deadline - now) * 1000));
         
-        int found = 0;
-        for (int j = 0; j < global_final_count; j++) {
-            if (strcmp(global_final_results[j].word, 
-                       reduce_args->intermediate_data[i].word) == 0) {
-                global_final_results[j].count += 
-                    reduce_args->intermediate_data[i].count;
-                found = 1;
-                cout<<"Found"<<endl;
-                break;
+        ssize_t n = 0;
+        if (filename == NULL) {
+            struct pollfd ready = {fd, POLLIN, 0};
+            if (poll(&ready, 1, timeout) > 0) {
+                n = read(fd, buffer.data() + filled, buffer.size() - filled);
+                eof = n == 0;
+                ok = n >= 0 || errno == EINTR;
+            }
+        } else {
+            n = read(fd, buffer.data() + filled, buffer.size() - filled);
+            ok = n >= 0 || errno == EINTR;
+            struct stat st;
+            if (n == 0 && fstat(fd, &st) == 0 && st.st_size < offset) {
+                log_printf(LOG_WARN, "%s was truncated, reading it from the start", filename);
+                lseek(fd, 0, SEEK_SET);
+                offset = 0;
+            } else if (n == 0) {
+                poll(NULL, 0, timeout < 0 ? TAIL_POLL_MS : min(timeout, TAIL_POLL_MS));
             }
         }
+        if (n > 0) {
+            if (filled == 0) batch_deadline = now_seconds() + WINDOW_BATCH_MS / 1000.0;
+            filled += n;
+            offset += n;
+            run_stats.bytes += n;
+        }
+        
+        // Time panes that have ended get the whole tokens that arrived in
+        // them, then close; a token cut by the boundary goes to the next
+        now = now_seconds();
+        while (by_time && now >= start + window.next * spec->slide) {
+            size_t whole = whole_tokens(buffer.data(), filled);
+            window_feed(&window, buffer.data(), whole, &run);
+            memmove(buffer.data(), buffer.data() + whole, filled - whole);
+            filled -= whole;
+            close_pane(&window, window.next * spec->slide, &run, true);
+        }
         
-        if (!found) {
-            global_final_results[global_final_count++] = 
-                reduce_args->intermediate_data[i];
-                cout<<"not found"<<endl;
+        // Micro-batch: map what is buffered once it is full or due
+        if (filled == buffer.size() || (filled > 0 && now >= batch_deadline) || eof) {
+            size_t whole = eof ? filled : whole_tokens(buffer.data(), filled);
+            if (whole == 0 && filled == buffer.size()) whole = filled;
+            window_feed(&window, buffer.data(), whole, &run);
+            memmove(buffer.data(), buffer.data() + whole, filled - whole);
+            filled -= whole;
+            batch_deadline = now + WINDOW_BATCH_MS / 1000.0;
         }
     }
+    if (filename != NULL) close(fd);
     
-    cout << "Reducer " << reduce_args->reducer_id << " completed. "
-         << "Reduced to " << global_final_count << " final word groups\n";
+    // The input ended: the last pane closes with what it has
+    window_feed(&window, buffer.data(), filled, &run);
+    if (window.current()->tokens > 0) {
+        close_pane(&window, by_time ? now_seconds() - start
+                                    : run.tokens + window.current()->tokens, &run, false);
+    }
+    log_printf(LOG_INFO, "Windowed stream ended: %zu tokens in %ld windows, at most "
+               "%zu distinct words in a window, %zu pane words evicted",
+               run.tokens, run.windows, run.peak, run.evicted);
+    run_stats.map_seconds = now_seconds() - start;
+    if (!ok) {
+        cerr << "Error reading input\n";
+        return 1;
+    }
+    return 0;
+}
+
+// Multi-process word count: the worker processes map, combine and reduce,
+// exchanging partitions through shared memory; this process hands out the
+// map tasks and merges the reducers' sorted outputs
+int run_cluster(struct Cluster* cluster, const struct MappedFile* input) {
+    // Map Phase: tasks go to whichever process asks for one first
+    double start = now_seconds();
+    int num_tasks = max((size_t)num_workers * TASKS_PER_WORKER,
+                        input->size / MAP_TASK_BYTES + 1);
+    std::vector<size_t> bounds(num_tasks + 1);
+    split_on_whitespace(input->data, input->size, num_tasks, bounds.data());
+    bool ok = cluster_map(cluster, bounds);
+    double mapped = now_seconds();
+    run_stats.map_seconds = mapped - start;
     
-    pthread_mutex_unlock(&global_mutex);
+    // Shuffle Phase: every process writes its partitions to shared memory
+    ok = ok && cluster_publish(cluster);
+    double published = now_seconds();
+    run_stats.shuffle_seconds = published - mapped;
+    if (ok) {
+        for (int w = 0; w < num_workers; w++) {
+            workers[w].words = cluster->workers[w].words;
+            workers[w].tasks = cluster->workers[w].tasks;
+            workers[w].partials = cluster->workers[w].partials;
+        }
+        print_map_summary(false);
+    }
     
-    sem_post(&reducer_sem);
-    return NULL;
+    // Reduce Phase: process r reads partition r of every segment
+    ok = ok && cluster_reduce(cluster);
+    double reduced = now_seconds();
+    run_stats.reduce_seconds = reduced - published;
+    for (int r = 0; r < num_workers && ok; r++) {
+        log_printf(LOG_INFO, "Reducer %d completed. Reduced %zu partial counts "
+                   "to %zu final word groups", r, cluster->workers[r].reduce_partials,
+                   cluster->workers[r].groups);
+        run_stats.distinct += cluster->workers[r].groups;
+    }
+    
+    // Merge the sorted outputs straight out of shared memory
+    TopK top;
+    StringArena top_arena;
+    top.k = top_k;
+    top.arena = &top_arena;
+    if (ok && top_k == 0 && !quiet) {
+        log_flush();
+        cout << "\nFinal Results (Sorted Alphabetically):\n";
+    }
+    if (ok && (top_k > 0 || !quiet || index_path != NULL)) {
+        ok = cluster_merge(cluster, [&](const KeyValuePair& kv) {
+            if (top_k > 0) {
+                top.offer(kv);
+                return;
+            }
+            if (index_path != NULL) result_index.add(kv);
+            if (!quiet) cout << kv.word << ": " << kv.count << "\n";
+        });
+    }
+    if (ok && top_k > 0) print_top(top.sorted());
+    run_stats.output_seconds = now_seconds() - reduced;
+    
+    if (!cluster_stop(cluster) || !ok) {
+        cerr << "Error in worker processes\n";
+        return 1;
+    }
+    return 0;
+}
+
+// Write run_stats as one JSON object, for benchmarks
+bool write_stats(const char* path) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL) return false;
+    size_t tokens = run_stats.tokens;
+    for (int w = 0; w < num_workers; w++) tokens += workers[w].words;
+    fprintf(out,
+            "{\"mode\": \"%s\", \"threads\": %d, \"bytes\": %zu, "
+            "\"tokens\": %zu, \"distinct\": %zu, \"map_s\": %.6f, "
+            "\"shuffle_s\": %.6f, \"reduce_s\": %.6f, \"output_s\": %.6f, "
+            "\"total_s\": %.6f}\n",
+            run_stats.mode, num_workers, run_stats.bytes, tokens,
+            run_stats.distinct, run_stats.map_seconds, run_stats.shuffle_seconds,
+            run_stats.reduce_seconds, run_stats.output_seconds,
+            run_stats.total_seconds);
+    return fclose(out) == 0;
 }
 
-int main() {
-    // Initialize semaphores
-    sem_init(&mapper_sem, 0, 0);
-    sem_init(&reducer_sem, 0, 0);
+// Record the phase times and write the --stats and --metrics summaries,
+// and the --index file
+void report_run(const char* stats_path) {
+    metrics_phase("map", run_stats.map_seconds);
+    metrics_phase("shuffle", run_stats.shuffle_seconds);
+    metrics_phase("reduce", run_stats.reduce_seconds);
+    metrics_phase("output", run_stats.output_seconds);
+    metrics_phase("total", run_stats.total_seconds);
+    if (stats_path != NULL && !write_stats(stats_path)) {
+        cerr << "Error writing stats\n";
+    }
+    if (!metrics_finish()) {
+        cerr << "Error writing metrics\n";
+    }
+    if (index_path != NULL && !result_index.write(index_path)) {
+        cerr << "Error writing index\n";
+    }
+}
+
+// Start the persistent workers, spread over the NUMA nodes if pin_mode
+// says so
+bool start_pool(int pin_mode) {
+    std::vector<cpu_set_t> affinity;
+    int num_nodes = 0;
+    if (pin_mode != PIN_NONE &&
+        !plan_affinity((PinMode)pin_mode, num_workers, &affinity, &num_nodes)) {
+        return false;
+    }
+    if (pin_mode != PIN_NONE) {
+        log_printf(LOG_INFO, "Pinned %d workers to %s on %d NUMA nodes", num_workers,
+                   pin_mode == PIN_CORES ? "cores" : "their nodes' cores", num_nodes);
+    }
+    pool_init(&pool, num_workers, pin_mode != PIN_NONE ? &affinity : NULL);
+    return true;
+}
+
+// SIGINT and SIGTERM stop the server like SHUTDOWN does
+void stop_server(int) {
+    server.stop = true;
+}
+
+// Server Mode: keep the pool and the sessions' arenas resident and run
+// jobs submitted over the socket until SHUTDOWN or a signal
+int run_server(const char* socket_path, int sessions) {
+    server.config.sessions = sessions;
+    server.config.partitions_per_worker = PARTITIONS_PER_WORKER;
+    server.config.tasks_per_worker = TASKS_PER_WORKER;
+    server.config.task_bytes = MAP_TASK_BYTES;
+    if (!server_init(&server, &pool, socket_path)) {
+        log_printf(LOG_ERROR, "Cannot listen on %s: %s", socket_path, strerror(errno));
+        return 1;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_server;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    
+    log_printf(LOG_INFO, "Serving on %s with %d workers and %d sessions", socket_path,
+               num_workers, sessions);
+    server_run(&server);
+    log_printf(LOG_INFO, "Server stopped after %ld jobs", server.jobs_done);
+    server_destroy(&server, socket_path);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    // Worker count: -t N / --threads N, else one per hardware thread.
+    // -p / --pipeline overlaps the map and reduce phases.
+    // -f / --file PATH skips the menu and counts PATH, a file or every file
+    // below a directory; repeat it for more. With -m / --memory MB a single
+    // file is streamed with that budget. -q / --quiet does not print the
+    // words, --stats FILE writes phase timings as JSON. --metrics FILE
+    // turns on per-thread counters and dumps them there at exit, and every
+    // --metrics-interval seconds if given. -v / --verbose raises the log
+    // level one step (debug, then trace); --log-level LEVEL sets it.
+    // --top K prints only the K most frequent words, by descending count.
+    // --processes N counts a file with N worker processes instead of
+    // threads, exchanging intermediate data through shared memory.
+    // --cache DIR keeps each input file's partial counts in DIR and reuses
+    // them while the file is unchanged. --index FILE also writes the final
+    // counts as a result index for lookup. --ngram N counts phrases of N
+    // consecutive words instead of single words. --approx estimates the top
+    // words and the number of distinct words in fixed memory; --epsilon,
+    // --delta and --hll-precision set its error bounds. --pin cores|nodes
+    // spreads the workers over the NUMA nodes and pins each to a core or
+    // to its node. --serve SOCKET runs as a job server on that Unix socket
+    // instead, serving --sessions clients at once. --window LEN counts
+    // stdin, or the -f file followed as it grows, in windows of LEN tokens,
+    // or seconds with an "s" or "ms" suffix, printing each as it closes;
+    // --slide LEN makes them overlap.
+    num_workers = 0;
+    bool pipeline = false;
+    std::vector<const char*> file_args;
+    const char* stats_path = NULL;
+    const char* metrics_path = NULL;
+    double metrics_interval = 0;
+    int level = LOG_INFO;
+    size_t budget_mb = 0;
+    int num_processes = 0;
+    const char* cache_dir = NULL;
+    int pin_mode = PIN_NONE;
+    const char* serve_path = NULL;
+    int sessions = SERVER_SESSIONS;
+    struct WindowSpec window = {WINDOW_TOKENS, 0, 0};
+    int slide_unit = -1;
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threads") == 0) &&
+            i + 1 < argc) {
+            num_workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--pipeline") == 0) {
+            pipeline = true;
+        } else if ((strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--file") == 0) &&
+                   i + 1 < argc) {
+            file_args.push_back(argv[++i]);
+        } else if ((strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--memory") == 0) &&
+                   i + 1 < argc) {
+            budget_mb = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--quiet") == 0) {
+            quiet = true;
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            stats_path = argv[++i];
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc) {
+            metrics_interval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            top_k = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--processes") == 0 && i + 1 < argc) {
+            num_processes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--index") == 0 && i + 1 < argc) {
+            index_path = argv[++i];
+        } else if (strcmp(argv[i], "--approx") == 0) {
+            approximate = true;
+        } else if (strcmp(argv[i], "--epsilon") == 0 && i + 1 < argc &&
+                   atof(argv[i + 1]) > 0 && atof(argv[i + 1]) < 1) {
+            sketch_epsilon = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--delta") == 0 && i + 1 < argc &&
+                   atof(argv[i + 1]) > 0 && atof(argv[i + 1]) < 1) {
+            sketch_delta = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--hll-precision") == 0 && i + 1 < argc &&
+                   atoi(argv[i + 1]) >= 4 && atoi(argv[i + 1]) <= 18) {
+            hll_precision = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pin") == 0 && i + 1 < argc &&
+                   parse_pin_mode(argv[i + 1]) >= 0) {
+            pin_mode = parse_pin_mode(argv[++i]);
+        } else if (strcmp(argv[i], "--ngram") == 0 && i + 1 < argc &&
+                   atoi(argv[i + 1]) >= 2 && atoi(argv[i + 1]) <= MAX_NGRAM) {
+            ngram_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_path = argv[++i];
+        } else if (strcmp(argv[i], "--sessions") == 0 && i + 1 < argc &&
+                   atoi(argv[i + 1]) > 0) {
+            sessions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc &&
+                   parse_window_length(argv[i + 1], &window.unit, &window.size)) {
+            i++;
+        } else if (strcmp(argv[i], "--slide") == 0 && i + 1 < argc &&
+                   parse_window_length(argv[i + 1], &slide_unit, &window.slide)) {
+            i++;
+        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+            level = min(level + 1, (int)LOG_TRACE);
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc &&
+                   log_parse_level(argv[i + 1]) >= 0) {
+            level = log_parse_level(argv[++i]);
+        } else {
+            cerr << "Usage: " << argv[0] << " [-t|--threads N] [-p|--pipeline]"
+                 << " [-f|--file PATH]... [-m|--memory MB] [-q|--quiet]"
+                 << " [--stats FILE] [--metrics FILE [--metrics-interval SEC]]"
+                 << " [-v|--verbose] [--log-level error|warn|info|debug|trace]"
+                 << " [--top K] [--processes N] [--cache DIR]"
+                 << " [--index FILE] [--ngram N]"
+                 << " [--approx [--epsilon E] [--delta D] [--hll-precision P]]"
+                 << " [--pin cores|nodes] [--serve SOCKET [--sessions N]]"
+                 << " [--window LEN [--slide LEN]]\n";
+            return 1;
+        }
+    }
+    if (index_path != NULL && top_k > 0) {
+        cerr << "--index needs the full results, not --top\n";
+        return 1;
+    }
+    if (pin_mode != PIN_NONE && num_processes > 0) {
+        cerr << "--pin places worker threads, not --processes\n";
+        return 1;
+    }
+    if (approximate && (pipeline || num_processes > 0 || cache_dir != NULL ||
+                        ngram_size > 0 || index_path != NULL || budget_mb > 0)) {
+        cerr << "--approx runs in batch mode, without --cache, --ngram or --index\n";
+        return 1;
+    }
+    if (serve_path != NULL && (!file_args.empty() || pipeline || budget_mb > 0 ||
+                               num_processes > 0 || cache_dir != NULL ||
+                               index_path != NULL || ngram_size > 0 || approximate ||
+                               top_k > 0 || quiet || stats_path != NULL)) {
+        cerr << "--serve takes its inputs and options from the submitted jobs\n";
+        return 1;
+    }
+    if (window.size == 0 && window.slide > 0) {
+        cerr << "--slide needs --window\n";
+        return 1;
+    }
+    if (window.slide == 0) {
+        window.slide = window.size;
+        slide_unit = window.unit;
+    }
+    if (window.size > 0 && (slide_unit != window.unit || window_panes(&window) == 0)) {
+        cerr << "--window must be a multiple of --slide, in the same unit, "
+             << "and at most " << MAX_WINDOW_PANES << " slides long\n";
+        return 1;
+    }
+    if (window.size > 0 && (file_args.size() > 1 || pipeline || budget_mb > 0 ||
+                            num_processes > 0 || cache_dir != NULL || index_path != NULL ||
+                            ngram_size > 0 || approximate || serve_path != NULL)) {
+        cerr << "--window counts stdin or one followed file on its own\n";
+        return 1;
+    }
+    if (approximate && top_k == 0) top_k = APPROX_TOP_WORDS;
+    if (num_workers <= 0) num_workers = (int)std::thread::hardware_concurrency();
+    if (num_workers <= 0) num_workers = 4;
+    num_partitions = num_workers * PARTITIONS_PER_WORKER;
+    
+    if (serve_path != NULL) {
+        if (metrics_path != NULL) metrics_enable(metrics_path, metrics_interval);
+        log_init(level);
+        if (!start_pool(pin_mode)) {
+            cerr << "Error reading the CPUs this process may use\n";
+            return 1;
+        }
+        int status = run_server(serve_path, sessions);
+        if (!metrics_finish()) {
+            cerr << "Error writing metrics\n";
+        }
+        pool_destroy(&pool);
+        log_shutdown();
+        return status;
+    }
+    
+    if (window.size > 0) {
+        if (metrics_path != NULL) metrics_enable(metrics_path, metrics_interval);
+        log_init(level);
+        workers = new WorkerState[num_workers];
+        if (!start_pool(pin_mode)) {
+            cerr << "Error reading the CPUs this process may use\n";
+            return 1;
+        }
+        run_stats.mode = "window";
+        double start = now_seconds();
+        int status = run_windowed(file_args.empty() ? NULL : file_args[0], &window);
+        run_stats.total_seconds = now_seconds() - start;
+        if (status == 0) report_run(stats_path);
+        delete[] workers;
+        pool_destroy(&pool);
+        log_shutdown();
+        pthread_mutex_destroy(&global_mutex);
+        return status;
+    }
     
     // User input for words
     char* input_data[MAX_WORDS];
     int input_size = 0;
+    struct MappedFile input_file = {NULL, 0};
     int input_choice;
+    char filename[PATH_MAX];
+    std::vector<InputFile> input_files;
+    
+    if (!file_args.empty()) {
+        input_choice = budget_mb > 0 ? 3 : 2;
+        snprintf(filename, sizeof(filename), "%s", file_args[0]);
+    } else {
+        cout << "Choose input method:\n";
+        cout << "1. Enter words manually\n";
+        cout << "2. Read words from file\n";
+        cout << "3. Stream a large file with bounded memory\n";
+        cout << "Enter choice (1, 2 or 3): ";
+        cin >> input_choice;
+    }
     
-    cout << "Choose input method:\n";
-    cout << "1. Enter words manually\n";
-    cout << "2. Read words from file\n";
-    cout << "Enter choice (1 or 2): ";
-    cin >> input_choice;
-
     if (input_choice == 1) {
         cout << "Enter words (type 'END' to finish):\n";
         char buffer[MAX_WORD_LENGTH];
-        while (1) {
-            cin >> buffer;
+        while (cin >> setw(MAX_WORD_LENGTH) >> buffer) {
             if (strcmp(buffer, "END") == 0) break;
+            if (input_size == MAX_WORDS) {
+                cerr << "Too many words for manual input; "
+                     << "use streaming mode (3)\n";
+                return 1;
+            }
             input_data[input_size] = (char*)malloc(MAX_WORD_LENGTH * sizeof(char));
             strncpy(input_data[input_size++], buffer, MAX_WORD_LENGTH);
         }
     } else if (input_choice == 2) {
-        char filename[100];
-        cout << "Enter file name: ";
-        cin >> filename;
+        if (file_args.empty()) {
+            cout << "Enter file or directory name: ";
+            cin >> filename;
+            file_args.push_back(filename);
+        }
         
-        FILE* file = fopen(filename, "r");
-        if (!file) {
+        bool listed = true;
+        for (size_t i = 0; i < file_args.size(); i++) {
+            listed = list_input_files(file_args[i], &input_files) && listed;
+        }
+        if (!listed || input_files.empty()) {
             cerr << "Error opening file\n";
             return 1;
         }
-
-        char buffer[MAX_WORD_LENGTH];
-        while (fscanf(file, "%s", buffer) != EOF) {
-            input_data[input_size] = (char*)malloc(MAX_WORD_LENGTH * sizeof(char));
-            strncpy(input_data[input_size++], buffer, MAX_WORD_LENGTH);
+        
+        // Map a single file; map tasks tokenize their byte ranges in place.
+        // Many files are read ahead of the mappers instead.
+        if (input_files.size() == 1) {
+            snprintf(filename, sizeof(filename), "%s", input_files[0].path.c_str());
+            if (!map_file(filename, &input_file)) {
+                cerr << "Error opening file\n";
+                return 1;
+            }
+        }
+    } else if (input_choice == 3) {
+        if (file_args.empty()) {
+            cout << "Enter file name: ";
+            cin >> filename;
+            cout << "Enter memory budget in MB: ";
+            cin >> budget_mb;
+        }
+        struct stat st;
+        if (file_args.size() > 1 || stat(filename, &st) < 0 || !S_ISREG(st.st_mode)) {
+            cerr << "Streaming takes a single file\n";
+            return 1;
         }
-        fclose(file);
     } else {
         cout << "Invalid choice. Exiting.\n";
         return 1;
     }
     
-    // Mapper threads
-    pthread_t mapper_threads[NUM_MAPPERS];
-    struct MapperArgs mapper_args[NUM_MAPPERS];
-    
-    // Distribute input data across mappers
-    int chunk_size = input_size / NUM_MAPPERS;
-    for (int i = 0; i < NUM_MAPPERS; i++) {
-        mapper_args[i].input_data = &input_data[i * chunk_size];
-        mapper_args[i].data_size = (i == NUM_MAPPERS - 1) ? 
-            (input_size - i * chunk_size) : chunk_size;
-        mapper_args[i].mapper_id = i;
-        
-        pthread_create(&mapper_threads[i], NULL, mapper, &mapper_args[i]);
+    // Worker processes are forked before this process starts any thread
+    struct Cluster cluster;
+    if (num_processes > 0) {
+        if (input_choice != 2 || pipeline || input_files.size() > 1) {
+            cerr << "--processes needs a single input file in batch mode\n";
+            return 1;
+        }
+        if (!cluster_start(&cluster, num_processes, filename)) {
+            cerr << "Error starting worker processes\n";
+            return 1;
+        }
+        num_workers = num_processes;
     }
-    
-    // Wait for mappers to complete
-    for (int i = 0; i < NUM_MAPPERS; i++) {
-        pthread_join(mapper_threads[i], NULL);
-        sem_wait(&mapper_sem);
+    if (cache_dir != NULL && (input_choice != 2 || pipeline || num_processes > 0)) {
+        cerr << "--cache needs file input in batch mode\n";
+        return 1;
+    }
+    if (ngram_size > 0 && (input_choice != 2 || pipeline || num_processes > 0 ||
+                           cache_dir != NULL || input_files.size() > 1)) {
+        cerr << "--ngram needs a single input file in batch mode\n";
+        return 1;
+    }
+    if (cache_dir != NULL && !cache_init(cache_dir)) {
+        cerr << "Error creating cache directory\n";
+        return 1;
     }
     
-    // Shuffle Phase
-    shuffle();
+    if (metrics_path != NULL) metrics_enable(metrics_path, metrics_interval);
+    log_init(level);
+    workers = new WorkerState[num_workers];
+    double start = now_seconds();
     
-    // Reducer threads
-    pthread_t reducer_threads[NUM_REDUCERS];
-    struct ReducerArgs reducer_args[NUM_REDUCERS];
+    if (num_processes > 0) {
+        run_stats.mode = "cluster";
+        run_stats.bytes = input_file.size;
+        int status = run_cluster(&cluster, &input_file);
+        run_stats.total_seconds = now_seconds() - start;
+        if (status == 0) report_run(stats_path);
+        unmap_file(&input_file);
+        delete[] workers;
+        log_shutdown();
+        pthread_mutex_destroy(&global_mutex);
+        return status;
+    }
     
-    // Distribute intermediate results across reducers
-    chunk_size = global_intermediate_count / NUM_REDUCERS;
-    for (int i = 0; i < NUM_REDUCERS; i++) {
-        reducer_args[i].intermediate_data = &global_intermediate_results[i * chunk_size];
-        reducer_args[i].data_size = (i == NUM_REDUCERS - 1) ? 
-            (global_intermediate_count - i * chunk_size) : chunk_size;
-        reducer_args[i].reducer_id = i;
-        
-        pthread_create(&reducer_threads[i], NULL, reducer, &reducer_args[i]);
+    // The same persistent workers run every phase
+    if (!start_pool(pin_mode)) {
+        cerr << "Error reading the CPUs this process may use\n";
+        return 1;
     }
     
-    // Wait for reducers to complete
-    for (int i = 0; i < NUM_REDUCERS; i++) {
-        pthread_join(reducer_threads[i], NULL);
-        sem_wait(&reducer_sem);
+    if (input_choice == 3) {
+        run_stats.mode = "stream";
+        int status = run_streaming(filename, budget_mb << 20);
+        run_stats.total_seconds = now_seconds() - start;
+        if (status == 0) report_run(stats_path);
+        delete[] workers;
+        pool_destroy(&pool);
+        log_shutdown();
+        pthread_mutex_destroy(&global_mutex);
+        return status;
     }
     
-    // Sort final results alphabetically
-    sort(global_final_results, 
-         global_final_results + global_final_count, 
-         [](const KeyValuePair& a, const KeyValuePair& b) {
-             return strcmp(a.word, b.word) < 0;
-         });
+    // Map Phase: many small tasks, whitespace-aligned byte ranges of a
+    // mapped file or fixed-size word chunks of manual input
+    struct MapArgs map_args;
+    map_args.input_data = input_choice == 1 ? input_data : NULL;
+    map_args.input_size = input_size;
+    map_args.text = input_file.data;
+    map_args.partials = NULL;
+    map_args.reader = NULL;
+    int num_tasks;
+    std::vector<KeyValuePair> cached_partials;
+    StringArena cache_arena;
+    std::vector<InputRange> input_ranges;
+    std::vector<size_t> task_offsets;
+    struct ReadAhead reader;
+    StringArena* phrase_arenas = NULL;
+    for (size_t i = 0; i < input_files.size(); i++) {
+        run_stats.bytes += input_files[i].size;
+    }
+    if (input_choice == 1) {
+        num_tasks = input_size / MAP_TASK_WORDS + 1;
+    } else if (cache_dir != NULL) {
+        // Map the cached partial counts instead of the text
+        bool cached = true;
+        for (size_t i = 0; i < input_files.size() && cached; i++) {
+            const char* path = input_files[i].path.c_str();
+            struct MappedFile file = input_file;
+            cached = (input_files.size() == 1 || map_file(path, &file)) &&
+                     load_or_count(cache_dir, path, &file, &cache_arena,
+                                   &cached_partials);
+            if (input_files.size() > 1) unmap_file(&file);
+        }
+        if (!cached) {
+            cerr << "Error reading or writing the cache\n";
+            return 1;
+        }
+        map_args.partials = cached_partials.data();
+        num_tasks = max((size_t)num_workers * TASKS_PER_WORKER,
+                        cached_partials.size() / MAP_TASK_PARTIALS + 1);
+        map_args.bounds.resize(num_tasks + 1);
+        for (int t = 0; t <= num_tasks; t++) {
+            map_args.bounds[t] = cached_partials.size() * t / num_tasks;
+        }
+    } else if (input_files.size() > 1) {
+        // Large files become byte-range tasks, small ones are batched
+        size_t task_bytes = min(MAP_TASK_BYTES,
+                                run_stats.bytes / (num_workers * TASKS_PER_WORKER) + 1);
+        if (!plan_input_tasks(input_files, task_bytes, &input_ranges, &task_offsets)) {
+            cerr << "Error opening file\n";
+            return 1;
+        }
+        num_tasks = (int)task_offsets.size() - 1;
+        readahead_start(&reader, &input_files, &input_ranges, &task_offsets,
+                        READAHEAD_THREADS, (size_t)num_workers * READAHEAD_TASKS_PER_WORKER);
+        map_args.reader = &reader;
+    } else {
+        num_tasks = max((size_t)num_workers * TASKS_PER_WORKER,
+                        input_file.size / MAP_TASK_BYTES + 1);
+        map_args.bounds.resize(num_tasks + 1);
+        split_on_whitespace(input_file.data, input_file.size, num_tasks,
+                            map_args.bounds.data());
+    }
     
-    // Print final results
-    cout << "\nFinal Results (Sorted Alphabetically):\n";
-    for (int i = 0; i < global_final_count; i++) {
-        cout << global_final_results[i].word << ": " 
-             << global_final_results[i].count << endl;
+    // In --top mode each reducer keeps only a heap of its best words
+    if (!pipeline) global_partition_results.resize(num_partitions);
+    if (top_k > 0 && !pipeline) {
+        global_top_parts.resize(num_partitions);
+        for (int r = 0; r < num_partitions; r++) global_top_parts[r].k = top_k;
+    }
+    auto job = make_word_count_job(&map_args,
+        [](const char* word, int count, int partition) {
+            if (log_enabled(LOG_TRACE)) {
+                log_printf(LOG_TRACE, "Reducer %d reduced word: %s (%d)",
+                           partition, word, count);
+            }
+            KeyValuePair kv = {word, 0, count};
+            if (top_k > 0) {
+                global_top_parts[partition].offer(kv);
+            } else {
+                kv.hash = hash_key(word, strlen(word));
+                global_partition_results[partition].records.push_back(kv);
+            }
+        });
+    run_stats.mode = pipeline ? "pipeline" : "batch";
+    if (pipeline) {
+        run_pipelined(&map_args, num_tasks);
+    } else if (approximate) {
+        run_stats.mode = "approx";
+        run_approximate(&map_args, num_tasks);
+    } else if (ngram_size > 0) {
+        run_stats.mode = "ngram";
+        phrase_arenas = new StringArena[num_partitions];
+        run_ngrams(&map_args, num_tasks, phrase_arenas);
+    } else {
+        job.run(num_tasks);
+        summarize_job(job, cache_dir == NULL);
+    }
+    if (map_args.reader != NULL && !readahead_stop(&reader)) {
+        cerr << "Error reading input files\n";
+        return 1;
+    }
+    
+    double reduced = now_seconds();
+    if (top_k > 0) {
+        // Merge the reducers' heaps; the full result is never built
+        print_top(merge_top_k(&pool, global_top_parts));
+        if (approximate) print_estimates();
+    } else {
+        print_sorted_results();
     }
+    run_stats.output_seconds = now_seconds() - reduced;
+    run_stats.total_seconds = now_seconds() - start;
+    report_run(stats_path);
     
     // Free allocated memory
     for (int i = 0; i < input_size; i++) {
         free(input_data[i]);
     }
+    unmap_file(&input_file);
     
     // Cleanup
+    delete[] phrase_arenas;
+    if (approximate) delete[] sketches;
+    delete[] workers;
+    pool_destroy(&pool);
+    log_shutdown();
     pthread_mutex_destroy(&global_mutex);
-    sem_destroy(&mapper_sem);
-    sem_destroy(&reducer_sem);
     
     return 0;
 }
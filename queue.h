@@ -0,0 +1,119 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sched.h>
+#include <time.h>
+#include <atomic>
+#include "metrics.h"
+
+// Wait a little longer each time a queue operation cannot make progress:
+// spin-yield first, then sleep up to 100 microseconds
+inline void queue_backoff(int* attempts) {
+    if (*attempts < 64) {
+        sched_yield();
+    } else {
+        struct timespec pause = {0, 1000L * (*attempts < 128 ? 10 : 100)};
+        nanosleep(&pause, NULL);
+    }
+    (*attempts)++;
+}
+
+// Bounded lock-free multi-producer single-consumer queue. Each cell carries
+// a sequence number telling producers and the consumer whose turn it is,
+// so neither side ever takes a lock. push() blocks while the queue is full,
+// which gives producers backpressure.
+template <typename T>
+struct MpscQueue {
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    Cell* cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> tail;   // next cell to fill (producers)
+    alignas(64) size_t head;                // next cell to drain (consumer)
+    alignas(64) std::atomic<bool> closed;   // no more pushes will come
+
+    // capacity must be a power of two
+    void init(size_t capacity) {
+        cells = new Cell[capacity];
+        mask = capacity - 1;
+        for (size_t i = 0; i < capacity; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        tail.store(0, std::memory_order_relaxed);
+        head = 0;
+        closed.store(false, std::memory_order_release);
+    }
+
+    void destroy() {
+        delete[] cells;
+    }
+
+    bool try_push(const T& value) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (1) {
+            Cell* cell = &cells[pos & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+                    cell->value = value;
+                    cell->sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;   // full
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void push(const T& value) {
+        metrics_add(METRIC_QUEUE_PUSHES, 1);
+        if (try_push(value)) return;
+        metrics_add(METRIC_QUEUE_FULL_WAITS, 1);
+        int attempts = 0;
+        while (!try_push(value)) queue_backoff(&attempts);
+    }
+
+    // Consumer only
+    bool try_pop(T* value) {
+        Cell* cell = &cells[head & mask];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        if (sequence != head + 1) return false;
+        *value = cell->value;
+        cell->sequence.store(head + mask + 1, std::memory_order_release);
+        head++;
+        return true;
+    }
+
+    // Consumer only. Waits for the next value; returns false once the queue
+    // is closed and drained.
+    bool pop(T* value) {
+        int attempts = 0;
+        while (!try_pop(value)) {
+            if (closed.load(std::memory_order_acquire)) return try_pop(value);
+            queue_backoff(&attempts);
+        }
+        metrics_queue_depth(depth() + 1);
+        return true;
+    }
+
+    // Called after the last push
+    void close() {
+        closed.store(true, std::memory_order_release);
+    }
+
+    // Values waiting, as seen by the consumer
+    size_t depth() const {
+        return tail.load(std::memory_order_relaxed) - head;
+    }
+};
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+#include "input.h"
+#include "metrics.h"
+
+// Asynchronous read-ahead for multi-file input. A few I/O threads read map
+// tasks' data in task order, staying at most `window` tasks ahead of the
+// mappers, so disk reads overlap tokenizing and memory stays bounded. Map
+// tasks take loaded tasks in the same order, whatever task number the
+// pool gave them, so no mapper waits on a task the readers have not
+// reached while earlier ones sit loaded.
+
+struct ReadAhead {
+    const std::vector<InputFile>* files;
+    const std::vector<InputRange>* ranges;
+    const std::vector<size_t>* task_offsets;
+    size_t num_tasks;
+    size_t window;              // tasks loaded but not yet taken, at most
+    std::vector<std::vector<char> > buffers;    // per task, while loaded
+    std::vector<char> loaded;   // per task: its buffer is ready
+    size_t next_read;           // next task for a reader to claim
+    size_t next_take;           // next task for a mapper to take
+    bool failed;                // a read failed
+    bool stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;     // a task was loaded or taken
+    std::vector<pthread_t> threads;
+};
+
+// Read one task's ranges, a newline after each, so words never run from
+// one file into the next
+inline bool read_task(struct ReadAhead* reader, size_t task, std::vector<char>* data) {
+    data->clear();
+    for (size_t i = (*reader->task_offsets)[task]; i < (*reader->task_offsets)[task + 1]; i++) {
+        const InputRange& range = (*reader->ranges)[i];
+        int fd = open((*reader->files)[range.file].path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        size_t offset = data->size();
+        data->resize(offset + range.end - range.begin);
+        size_t done = 0;
+        while (done < range.end - range.begin) {
+            ssize_t n = pread(fd, data->data() + offset + done,
+                              range.end - range.begin - done, range.begin + done);
+            if (n <= 0) break;
+            done += n;
+        }
+        close(fd);
+        data->resize(offset + done);
+        data->push_back('\n');
+        if (done < range.end - range.begin) return false;
+    }
+    return true;
+}
+
+inline void* readahead_thread(void* args) {
+    struct ReadAhead* reader = (struct ReadAhead*)args;
+    metrics_name_thread("reader");
+    std::vector<char> data;
+    pthread_mutex_lock(&reader->mutex);
+    while (1) {
+        while (!reader->stop && reader->next_read < reader->num_tasks &&
+               reader->next_read >= reader->next_take + reader->window) {
+            pthread_cond_wait(&reader->changed, &reader->mutex);
+        }
+        if (reader->stop || reader->next_read == reader->num_tasks) break;
+        size_t task = reader->next_read++;
+        pthread_mutex_unlock(&reader->mutex);
+
+        bool ok = read_task(reader, task, &data);
+        metrics_add(METRIC_BYTES, data.size());
+
+        pthread_mutex_lock(&reader->mutex);
+        reader->buffers[task].swap(data);
+        reader->loaded[task] = 1;
+        if (!ok) reader->failed = true;
+        pthread_cond_broadcast(&reader->changed);
+    }
+    pthread_mutex_unlock(&reader->mutex);
+    return NULL;
+}
+
+// Start num_threads readers over a task plan from plan_input_tasks
+inline void readahead_start(struct ReadAhead* reader, const std::vector<InputFile>* files,
+                            const std::vector<InputRange>* ranges,
+                            const std::vector<size_t>* task_offsets,
+                            int num_threads, size_t window) {
+    reader->files = files;
+    reader->ranges = ranges;
+    reader->task_offsets = task_offsets;
+    reader->num_tasks = task_offsets->size() - 1;
+    reader->window = window > 0 ? window : 1;
+    reader->buffers.assign(reader->num_tasks, std::vector<char>());
+    reader->loaded.assign(reader->num_tasks, 0);
+    reader->next_read = 0;
+    reader->next_take = 0;
+    reader->failed = false;
+    reader->stop = false;
+    pthread_mutex_init(&reader->mutex, NULL);
+    pthread_cond_init(&reader->changed, NULL);
+    reader->threads.resize(num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&reader->threads[i], NULL, readahead_thread, reader);
+    }
+}
+
+// Take the next task in read order, waiting until it is loaded; its data
+// is swapped into *data. False if there are no tasks left or a read failed.
+inline bool readahead_take(struct ReadAhead* reader, std::vector<char>* data) {
+    metrics_lock(&reader->mutex);
+    if (reader->next_take == reader->num_tasks) {
+        pthread_mutex_unlock(&reader->mutex);
+        return false;
+    }
+    size_t task = reader->next_take++;
+    pthread_cond_broadcast(&reader->changed);
+    while (!reader->loaded[task]) {
+        pthread_cond_wait(&reader->changed, &reader->mutex);
+    }
+    data->swap(reader->buffers[task]);
+    std::vector<char>().swap(reader->buffers[task]);
+    bool ok = !reader->failed;
+    pthread_mutex_unlock(&reader->mutex);
+    return ok;
+}
+
+// Stop the readers; tasks not yet taken are dropped
+inline bool readahead_stop(struct ReadAhead* reader) {
+    pthread_mutex_lock(&reader->mutex);
+    reader->stop = true;
+    pthread_cond_broadcast(&reader->changed);
+    pthread_mutex_unlock(&reader->mutex);
+    for (size_t i = 0; i < reader->threads.size(); i++) {
+        pthread_join(reader->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&reader->mutex);
+    pthread_cond_destroy(&reader->changed);
+    bool ok = !reader->failed;
+    reader->buffers.clear();
+    return ok;
+}
+
+#endif
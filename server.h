@@ -0,0 +1,576 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "input.h"
+#include "job.h"
+#include "log.h"
+#include "merge.h"
+#include "metrics.h"
+#include "ngram.h"
+#include "pool.h"
+#include "tokenize.h"
+#include "topk.h"
+
+// Job server. One process keeps the worker pool and the workers' arenas
+// resident and runs counting jobs submitted over a Unix-domain socket.
+// A fixed number of session threads accept connections; each reads its
+// client's requests, runs them on the shared pool and streams the results
+// back, so jobs of different sessions run at once. The pool takes their
+// tasks in turn, and a job may be limited to a number of workers. More
+// clients than sessions wait in the listen queue.
+//
+// The protocol is line-based text. A request is a COUNT line with options,
+// one PATH line per input file or directory, and an empty line:
+//
+//   COUNT [mode=words|ngram] [n=N] [threads=N] [top=K]
+//   PATH /absolute/path
+//   <empty line>
+//
+// The reply is "OK <job>", one "word: count" line per result, sorted as
+// the batch engine sorts them, and "DONE <job> tokens=T distinct=D
+// seconds=S". A request that cannot run gets one "ERROR <reason>" line
+// instead. STATUS replies with one STATUS line; SHUTDOWN replies "OK",
+// stops accepting connections and returns once every running job has
+// finished. Connections stay open for further requests until the client
+// closes them.
+
+const int SERVER_POLL_MS = 200;             // how often idle threads check for stop
+const size_t SERVER_REPLY_BYTES = 64 << 10; // results buffered per send
+const size_t SERVER_ARENA_BLOCKS = 16;      // blocks kept per worker arena
+const int SERVER_MAX_PATHS = 4096;
+const size_t SERVER_MAX_LINE = PATH_MAX + 64;   // a PATH line and then some
+
+// Set by the caller before server_init()
+struct ServerConfig {
+    int sessions;               // connections served at once
+    int partitions_per_worker;  // reduce tasks per worker a job may use
+    int tasks_per_worker;       // minimum map tasks per worker
+    size_t task_bytes;          // largest map task
+};
+
+struct Server {
+    struct WorkerPool* pool;
+    struct ServerConfig config;
+    int listen_socket;
+    std::vector<pthread_t> threads;
+    std::vector<struct ServerSession*> sessions;
+
+    pthread_mutex_t mutex;      // guards the counts below
+    int connections;            // sessions with a client
+    int running;                // jobs running now
+    int next_job;
+    long jobs_done;
+    std::atomic<bool> stop;
+};
+
+// A parsed COUNT request
+struct ServerRequest {
+    int ngram;                  // 0 for words
+    int threads;                // worker budget, 0 for every worker
+    size_t top;                 // 0 for every result
+    std::vector<std::string> paths;
+};
+
+// A session thread and its current client: buffered line reader and
+// reply writer, plus one arena per worker that the session's jobs keep
+// their words in. The arenas are emptied, not freed, after each job.
+struct ServerSession {
+    struct Server* server;
+    int socket;
+    std::string input;          // bytes read, not yet returned as lines
+    std::string reply;          // bytes not yet sent
+    bool ok;                    // false once a send failed or the client
+                                // sent a line too long to buffer
+    std::vector<StringArena*> arenas;
+};
+
+// Send everything buffered; false if the client went away
+inline bool server_flush(struct ServerSession* session) {
+    size_t sent = 0;
+    while (session->ok && sent < session->reply.size()) {
+        ssize_t n = send(session->socket, session->reply.data() + sent,
+                         session->reply.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) session->ok = false;
+        else sent += n;
+    }
+    session->reply.clear();
+    return session->ok;
+}
+
+inline void server_reply(struct ServerSession* session, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Buffer one formatted line, sending the buffer once it is full
+inline void server_reply(struct ServerSession* session, const char* format, ...) {
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    session->reply.append(line, std::min((size_t)n, sizeof(line) - 1));
+    session->reply.push_back('\n');
+    if (session->reply.size() >= SERVER_REPLY_BYTES) server_flush(session);
+}
+
+// Buffer one result line; words may be longer than a formatted line
+inline void server_reply_result(struct ServerSession* session,
+                                const KeyValuePair& kv) {
+    char count[16];
+    session->reply.append(kv.word);
+    session->reply.append(count, snprintf(count, sizeof(count), ": %d\n", kv.count));
+    if (session->reply.size() >= SERVER_REPLY_BYTES) server_flush(session);
+}
+
+// Next line from the client, without its newline. False when the client
+// closed the session, or the server is stopping and no request has
+// been started. A client that sends more than SERVER_MAX_LINE bytes
+// without a newline gets an error and the session ends, so one
+// connection cannot make the server buffer without limit.
+inline bool server_read_line(struct ServerSession* session, std::string* line,
+                             bool in_request) {
+    while (1) {
+        size_t newline = session->input.find('\n');
+        if (newline != std::string::npos) {
+            line->assign(session->input, 0, newline);
+            if (!line->empty() && (*line)[line->size() - 1] == '\r') line->resize(line->size() - 1);
+            session->input.erase(0, newline + 1);
+            return true;
+        }
+        if (!in_request && session->input.empty() && session->server->stop) return false;
+        if (session->input.size() > SERVER_MAX_LINE) {
+            server_reply(session, "ERROR line too long");
+            server_flush(session);
+            session->ok = false;
+            return false;
+        }
+
+        struct pollfd ready = {session->socket, POLLIN, 0};
+        int n = poll(&ready, 1, SERVER_POLL_MS);
+        if (n < 0 && errno != EINTR) return false;
+        if (n <= 0) continue;
+        char buffer[4096];
+        ssize_t got = recv(session->socket, buffer, sizeof(buffer), 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        session->input.append(buffer, got);
+    }
+}
+
+// Parse the options of a COUNT line and the PATH lines after it. The
+// whole request is read even if it is bad, so the next one starts in
+// step; error says what was wrong with it.
+inline bool server_read_request(struct ServerSession* session, const std::string& first,
+                                struct ServerRequest* request, std::string* error) {
+    request->ngram = 0;
+    request->threads = 0;
+    request->top = 0;
+    request->paths.clear();
+
+    bool ngram = false;
+    int n = 2;
+    char option[256];
+    const char* p = first.c_str() + strlen("COUNT");
+    int used;
+    while (sscanf(p, " %255s%n", option, &used) == 1) {
+        p += used;
+        char* value = strchr(option, '=');
+        if (value == NULL) {
+            if (error->empty()) *error = std::string("option without a value: ") + option;
+            continue;
+        }
+        *value++ = '\0';
+        if (strcmp(option, "mode") == 0 && strcmp(value, "words") == 0) {
+            ngram = false;
+        } else if (strcmp(option, "mode") == 0 && strcmp(value, "ngram") == 0) {
+            ngram = true;
+        } else if (strcmp(option, "n") == 0 && atoi(value) >= 2 && atoi(value) <= MAX_NGRAM) {
+            n = atoi(value);
+        } else if (strcmp(option, "threads") == 0 && atoi(value) > 0) {
+            request->threads = atoi(value);
+        } else if (strcmp(option, "top") == 0 && atol(value) > 0) {
+            request->top = strtoul(value, NULL, 10);
+        } else if (error->empty()) {
+            *error = std::string("bad option ") + option + "=" + value;
+        }
+    }
+    if (ngram) request->ngram = n;
+
+    std::string line;
+    bool complete = false;
+    while (server_read_line(session, &line, true)) {
+        if (line.empty()) {
+            complete = true;
+            break;
+        }
+        if (line.compare(0, 5, "PATH ") != 0) {
+            if (error->empty()) *error = "expected PATH or an empty line, got: " + line.substr(0, 64);
+        } else if ((int)request->paths.size() == SERVER_MAX_PATHS) {
+            if (error->empty()) *error = "too many paths";
+        } else {
+            request->paths.push_back(line.substr(5));
+        }
+    }
+    if (!complete) {
+        *error = "connection closed in the middle of a request";
+        return false;
+    }
+    if (request->paths.empty() && error->empty()) *error = "no input paths";
+    return error->empty();
+}
+
+// A map task of a server job: bytes [begin, end) of a mapped file, which
+// ends at limit
+struct ServerTask {
+    const char* begin;
+    const char* end;
+    const char* limit;
+};
+
+// Everything one running job reads and fills in
+struct ServerJob {
+    int id;
+    const struct ServerRequest* request;
+    std::vector<ServerTask> tasks;
+    std::atomic<size_t> tokens;
+    std::vector<std::vector<KeyValuePair> > results;    // per partition
+    std::vector<TopK> tops;                             // per partition, with top
+    StringArena* phrases;                               // per partition, n-grams
+};
+
+// Reduce Function of a server job: keep one final count
+inline void server_keep(struct ServerJob* job, const KeyValuePair& kv, int partition) {
+    if (job->request->top > 0) {
+        job->tops[partition].offer(kv);
+    } else {
+        job->results[partition].push_back(kv);
+    }
+}
+
+// Count words or n-grams of the job's tasks. Words live in arenas,
+// phrases in job->phrases. Returns the number of distinct results.
+inline size_t server_count(struct Server* server, struct ServerJob* job,
+                           const std::vector<StringArena*>* arenas, int workers,
+                           int num_partitions) {
+    struct WorkerPool* pool = server->pool;
+    size_t distinct = 0;
+    if (job->request->ngram == 0) {
+        auto count = make_job<const char*, int>(
+            [job](int task, int, auto& emit) {
+                const struct ServerTask& range = job->tasks[task];
+                size_t tokens = tokenize_clean(range.begin, range.end,
+                                               [&](const char* word, size_t length) {
+                    emit(word, hash_key(word, length), 1);
+                });
+                job->tokens += tokens;
+                metrics_add(METRIC_TOKENS, tokens);
+                metrics_add(METRIC_BYTES, range.end - range.begin);
+            },
+            SumCombine(),
+            [job](const char* word, int count, int partition) {
+                server_keep(job, KeyValuePair{word, 0, count}, partition);
+            },
+            pool, num_partitions);
+        count.max_workers = workers;
+        count.lent_arenas = arenas;
+        count.run((int)job->tasks.size());
+        for (int r = 0; r < num_partitions; r++) distinct += count.partition_keys[r];
+    } else {
+        int n = job->request->ngram;
+        auto count = make_job<NgramKey, int>(
+            [job, n](int task, int, auto& emit) {
+                const struct ServerTask& range = job->tasks[task];
+                size_t tokens = scan_ngrams(range.begin, range.end, range.limit, n,
+                                            [&](const NgramKey& key) { emit(key, 1); });
+                job->tokens += tokens;
+                metrics_add(METRIC_TOKENS, tokens);
+                metrics_add(METRIC_BYTES, range.end - range.begin);
+            },
+            SumCombine(),
+            [job](const NgramKey& key, int count, int partition) {
+                // A phrase that cannot make the top cut is never built
+                if (job->request->top > 0 && job->tops[partition].heap.size() == job->request->top &&
+                    count < job->tops[partition].heap.front().count) {
+                    return;
+                }
+                static thread_local std::string phrase;
+                ngram_text(key.text, key.length, &phrase);
+                const char* text = job->phrases[partition].intern(phrase.data(), phrase.size());
+                server_keep(job, KeyValuePair{text, 0, count}, partition);
+            },
+            pool, num_partitions);
+        count.max_workers = workers;
+        count.run((int)job->tasks.size());
+        for (int r = 0; r < num_partitions; r++) distinct += count.partition_keys[r];
+    }
+    return distinct;
+}
+
+// Run one request and stream its results to the client. Input files are
+// mapped for the length of the job.
+inline void server_run_job(struct ServerSession* session,
+                           const struct ServerRequest* request) {
+    struct Server* server = session->server;
+    double start = now_seconds();
+
+    std::vector<InputFile> files;
+    for (size_t i = 0; i < request->paths.size(); i++) {
+        if (request->paths[i].empty() || request->paths[i][0] != '/') {
+            server_reply(session, "ERROR path is not absolute: %s", request->paths[i].c_str());
+            return;
+        }
+        if (!list_input_files(request->paths[i].c_str(), &files)) {
+            server_reply(session, "ERROR cannot read %s", request->paths[i].c_str());
+            return;
+        }
+    }
+    std::vector<MappedFile> mapped(files.size(), MappedFile{NULL, 0});
+    bool ok = true;
+    size_t total = 0;
+    for (size_t f = 0; f < files.size() && ok; f++) {
+        ok = map_file(files[f].path.c_str(), &mapped[f]);
+        if (!ok) server_reply(session, "ERROR cannot map %s", files[f].path.c_str());
+        total += mapped[f].size;
+    }
+
+    struct ServerJob job;
+    job.request = request;
+    job.tokens = 0;
+    job.phrases = NULL;
+    int workers = request->threads > 0 ? std::min(request->threads, server->pool->num_workers)
+                                       : server->pool->num_workers;
+    int num_partitions = workers * server->config.partitions_per_worker;
+
+    // Whitespace-aligned byte ranges of every file; n-grams may read past
+    // the end of their range, up to the end of the file
+    size_t task_bytes = std::min(server->config.task_bytes,
+                                 total / (workers * server->config.tasks_per_worker) + 1);
+    for (size_t f = 0; f < mapped.size() && ok; f++) {
+        if (mapped[f].size == 0) continue;
+        int num_tasks = (int)(mapped[f].size / task_bytes) + 1;
+        std::vector<size_t> bounds(num_tasks + 1);
+        split_on_whitespace(mapped[f].data, mapped[f].size, num_tasks, bounds.data());
+        for (int t = 0; t < num_tasks; t++) {
+            job.tasks.push_back(ServerTask{mapped[f].data + bounds[t], mapped[f].data + bounds[t + 1],
+                                           mapped[f].data + mapped[f].size});
+        }
+    }
+
+    if (ok) {
+        pthread_mutex_lock(&server->mutex);
+        job.id = server->next_job++;
+        server->running++;
+        pthread_mutex_unlock(&server->mutex);
+        log_printf(LOG_INFO, "Job %d started: %zu files, %zu bytes, %d workers%s", job.id,
+                   files.size(), total, workers, request->ngram > 0 ? ", n-grams" : "");
+        server_reply(session, "OK %d", job.id);
+        server_flush(session);
+
+        // Map, shuffle and reduce on the shared pool
+        job.results.resize(num_partitions);
+        if (request->top > 0) {
+            job.tops.resize(num_partitions);
+            for (int r = 0; r < num_partitions; r++) job.tops[r].k = request->top;
+        }
+        if (request->ngram > 0) job.phrases = new StringArena[num_partitions];
+        size_t distinct = server_count(server, &job, &session->arenas, workers, num_partitions);
+
+        // Stream the results, sorted as in the batch engine
+        if (request->top > 0) {
+            std::vector<KeyValuePair> top = merge_top_k(server->pool, job.tops, workers);
+            for (size_t i = 0; i < top.size() && session->ok; i++) {
+                server_reply_result(session, top[i]);
+            }
+        } else {
+            size_t count = 0;
+            for (int r = 0; r < num_partitions; r++) count += job.results[r].size();
+            std::vector<KeyValuePair> sorted(count);
+            parallel_sort_merge(server->pool, job.results, sorted.data(),
+                                [](const KeyValuePair& a, const KeyValuePair& b) {
+                                    return strcmp(a.word, b.word) < 0;
+                                }, workers);
+            for (size_t i = 0; i < sorted.size() && session->ok; i++) {
+                server_reply_result(session, sorted[i]);
+            }
+        }
+        double seconds = now_seconds() - start;
+        server_reply(session, "DONE %d tokens=%zu distinct=%zu seconds=%.3f", job.id,
+                     job.tokens.load(), distinct, seconds);
+        server_flush(session);
+        log_printf(LOG_INFO, "Job %d finished: %zu tokens, %zu distinct in %.3f seconds%s",
+                   job.id, job.tokens.load(), distinct, seconds,
+                   session->ok ? "" : ", client gone");
+
+        // The words are sent; the arenas stay warm for the next job
+        delete[] job.phrases;
+        for (size_t w = 0; w < session->arenas.size(); w++) {
+            session->arenas[w]->recycle(SERVER_ARENA_BLOCKS);
+        }
+        pthread_mutex_lock(&server->mutex);
+        server->running--;
+        server->jobs_done++;
+        pthread_mutex_unlock(&server->mutex);
+    }
+    for (size_t f = 0; f < mapped.size(); f++) unmap_file(&mapped[f]);
+}
+
+// Serve one client's requests until it closes the connection or the
+// server stops
+inline void server_serve(struct ServerSession* session) {
+    struct Server* server = session->server;
+    std::string line;
+    while (session->ok && server_read_line(session, &line, false)) {
+        if (line.compare(0, 5, "COUNT") == 0 && (line.size() == 5 || line[5] == ' ')) {
+            struct ServerRequest request;
+            std::string error;
+            if (server_read_request(session, line, &request, &error)) {
+                server_run_job(session, &request);
+            } else {
+                server_reply(session, "ERROR %s", error.c_str());
+            }
+        } else if (line == "STATUS") {
+            pthread_mutex_lock(&server->mutex);
+            server_reply(session, "STATUS workers=%d sessions=%d connections=%d "
+                         "running=%d done=%ld", server->pool->num_workers,
+                         server->config.sessions, server->connections,
+                         server->running, server->jobs_done);
+            pthread_mutex_unlock(&server->mutex);
+        } else if (line == "SHUTDOWN") {
+            log_printf(LOG_INFO, "Shutdown requested");
+            server->stop = true;
+            server_reply(session, "OK");
+        } else if (!line.empty()) {
+            server_reply(session, "ERROR unknown request: %.64s", line.c_str());
+        }
+        server_flush(session);
+    }
+}
+
+// Session thread: accept a client, serve it, and accept the next one
+// until the server stops. Idle sessions all wait on the listening socket,
+// which is non-blocking, so only one of them gets each client.
+inline void* server_session(void* args) {
+    struct ServerSession* session = (struct ServerSession*)args;
+    struct Server* server = session->server;
+    char name[32];
+    snprintf(name, sizeof(name), "session %d",
+             (int)(std::find(server->sessions.begin(), server->sessions.end(), session) -
+                   server->sessions.begin()));
+    metrics_name_thread(name);
+
+    while (!server->stop) {
+        struct pollfd ready = {server->listen_socket, POLLIN, 0};
+        if (poll(&ready, 1, SERVER_POLL_MS) <= 0) continue;
+        session->socket = accept(server->listen_socket, NULL, NULL);
+        if (session->socket < 0) continue;
+
+        pthread_mutex_lock(&server->mutex);
+        server->connections++;
+        pthread_mutex_unlock(&server->mutex);
+        session->input.clear();
+        session->reply.clear();
+        session->ok = true;
+        server_serve(session);
+        close(session->socket);
+        pthread_mutex_lock(&server->mutex);
+        server->connections--;
+        pthread_mutex_unlock(&server->mutex);
+    }
+    return NULL;
+}
+
+// Listen on socket_path, replacing a stale socket file but not a live
+// server. Each session's arenas are allocated up front.
+inline bool server_init(struct Server* server, struct WorkerPool* pool,
+                        const char* socket_path) {
+    server->pool = pool;
+    server->connections = 0;
+    server->running = 0;
+    server->next_job = 1;
+    server->jobs_done = 0;
+    server->stop = false;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) return false;
+    strcpy(address.sun_path, socket_path);
+
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe < 0) return false;
+    bool live = connect(probe, (struct sockaddr*)&address, sizeof(address)) == 0;
+    close(probe);
+    if (live) {
+        errno = EADDRINUSE;
+        return false;
+    }
+    unlink(socket_path);
+
+    server->listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->listen_socket < 0) return false;
+    if (bind(server->listen_socket, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(server->listen_socket, 64) < 0 ||
+        fcntl(server->listen_socket, F_SETFL, O_NONBLOCK) < 0) {
+        close(server->listen_socket);
+        return false;
+    }
+
+    pthread_mutex_init(&server->mutex, NULL);
+    for (int i = 0; i < server->config.sessions; i++) {
+        struct ServerSession* session = new ServerSession();
+        session->server = server;
+        session->socket = -1;
+        session->ok = false;
+        for (int w = 0; w < pool->num_workers; w++) {
+            session->arenas.push_back(new StringArena());
+            session->arenas.back()->recycle(SERVER_ARENA_BLOCKS);
+        }
+        server->sessions.push_back(session);
+    }
+    return true;
+}
+
+// Serve until stop is set, by SHUTDOWN or by the caller, then wait for
+// every session, and with it every running job, to finish
+inline void server_run(struct Server* server) {
+    server->threads.resize(server->sessions.size());
+    for (size_t i = 0; i < server->sessions.size(); i++) {
+        pthread_create(&server->threads[i], NULL, server_session, server->sessions[i]);
+    }
+    for (size_t i = 0; i < server->threads.size(); i++) {
+        pthread_join(server->threads[i], NULL);
+    }
+    close(server->listen_socket);
+}
+
+// Remove the socket file and free the sessions and their arenas
+inline void server_destroy(struct Server* server, const char* socket_path) {
+    unlink(socket_path);
+    for (size_t i = 0; i < server->sessions.size(); i++) {
+        for (size_t w = 0; w < server->sessions[i]->arenas.size(); w++) {
+            delete server->sessions[i]->arenas[w];
+        }
+        delete server->sessions[i];
+    }
+    server->sessions.clear();
+    pthread_mutex_destroy(&server->mutex);
+}
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef SHUFFLE_H
+#define SHUFFLE_H
+
+#include <pthread.h>
+#include <vector>
+#include "common.h"
+
+// Reducer partition that owns a record's key. Uses the high bits of the
+// hash; the low bits index the reducers' hash tables. Works for any record
+// with a 32-bit `hash` member (KeyValuePair, JobRecord).
+template <typename Record>
+inline int partition_of(const Record& record, int num_partitions) {
+    return (int)(((uint64_t)record.hash * num_partitions) >> 32);
+}
+
+// Skew-aware partitioning: the hash space is cut into SHUFFLE_BUCKETS
+// buckets by the top bits of the hash, and every bucket is assigned to a
+// partition. shuffle_balance samples the records and assigns contiguous
+// runs of buckets so that each partition gets about the same number of
+// records; a bucket heavier than a fair share gets a partition to itself.
+// Combiners have already folded each key into one record per worker, so
+// no single key can outweigh a bucket.
+const int SHUFFLE_BUCKET_BITS = 12;
+const int SHUFFLE_BUCKETS = 1 << SHUFFLE_BUCKET_BITS;
+const int SHUFFLE_SAMPLES = 1 << 16;        // records sampled per plan
+
+// Two-pass parallel hash partitioning of records. The input is cut into
+// num_slices slices; shuffle_count runs once per slice, then
+// shuffle_prefix_sum, then shuffle_scatter once per slice. Partition r ends
+// up in output[partition_offset[r] .. partition_offset[r + 1]).
+template <typename Record>
+struct ShufflePlan {
+    const Record* input;
+    Record* output;
+    int count;
+    int num_slices;
+    int num_partitions;
+    std::vector<int> bucket_partition;  // partition of each hash bucket
+    std::vector<int> cursor;            // [slice * num_partitions + r]
+    std::vector<int> partition_offset;  // num_partitions + 1 entries
+};
+
+// Partition of a record under a plan
+template <typename Record>
+inline int plan_partition(const ShufflePlan<Record>* plan, const Record& record) {
+    return plan->bucket_partition[record.hash >> (32 - SHUFFLE_BUCKET_BITS)];
+}
+
+template <typename Record>
+inline void shuffle_init(ShufflePlan<Record>* plan, const Record* input,
+                         int count, Record* output,
+                         int num_slices, int num_partitions) {
+    plan->input = input;
+    plan->output = output;
+    plan->count = count;
+    plan->num_slices = num_slices;
+    plan->num_partitions = num_partitions;
+
+    // Equal hash ranges until shuffle_balance has seen the records
+    plan->bucket_partition.resize(SHUFFLE_BUCKETS);
+    for (int b = 0; b < SHUFFLE_BUCKETS; b++) {
+        plan->bucket_partition[b] = (int)((long)b * num_partitions / SHUFFLE_BUCKETS);
+    }
+    plan->cursor.assign((size_t)num_slices * num_partitions, 0);
+    plan->partition_offset.assign(num_partitions + 1, 0);
+}
+
+// Choose partition boundaries from a histogram of evenly spaced sample
+// records. Each partition takes buckets until it holds its share of what
+// is left, so a heavy bucket that fills one partition does not starve the
+// partitions after it.
+template <typename Record>
+inline void shuffle_balance(ShufflePlan<Record>* plan) {
+    if (plan->count == 0 || plan->num_partitions == 1) return;
+    std::vector<long> weight(SHUFFLE_BUCKETS, 0);
+    long samples = plan->count < SHUFFLE_SAMPLES ? plan->count : SHUFFLE_SAMPLES;
+    for (long i = 0; i < samples; i++) {
+        const Record& record = plan->input[(long)plan->count * i / samples];
+        weight[record.hash >> (32 - SHUFFLE_BUCKET_BITS)]++;
+    }
+
+    long remaining = samples;
+    int partition = 0;
+    long filled = 0;
+    double share = (double)remaining / plan->num_partitions;
+    for (int b = 0; b < SHUFFLE_BUCKETS; b++) {
+        // Close the partition once this bucket would take it past its share
+        if (filled > 0 && filled + weight[b] / 2.0 > share &&
+            partition < plan->num_partitions - 1) {
+            remaining -= filled;
+            partition++;
+            filled = 0;
+            share = (double)remaining / (plan->num_partitions - partition);
+        }
+        plan->bucket_partition[b] = partition;
+        filled += weight[b];
+    }
+}
+
+template <typename Record>
+inline int slice_begin(const ShufflePlan<Record>* plan, int slice) {
+    return (int)((long)plan->count * slice / plan->num_slices);
+}
+
+// First pass: count how many pairs of this slice go to each partition
+template <typename Record>
+inline void shuffle_count(ShufflePlan<Record>* plan, int slice) {
+    int* cursor = &plan->cursor[(size_t)slice * plan->num_partitions];
+    int end = slice_begin(plan, slice + 1);
+    for (int i = slice_begin(plan, slice); i < end; i++) {
+        cursor[plan_partition(plan, plan->input[i])]++;
+    }
+}
+
+// Turn the per-slice counts into write positions: partition-major, then
+// slice order within a partition
+template <typename Record>
+inline void shuffle_prefix_sum(ShufflePlan<Record>* plan) {
+    int offset = 0;
+    for (int r = 0; r < plan->num_partitions; r++) {
+        plan->partition_offset[r] = offset;
+        for (int s = 0; s < plan->num_slices; s++) {
+            int* cursor = &plan->cursor[(size_t)s * plan->num_partitions + r];
+            int size = *cursor;
+            *cursor = offset;
+            offset += size;
+        }
+    }
+    plan->partition_offset[plan->num_partitions] = offset;
+}
+
+// Second pass: scatter the slice into its reserved range of each partition
+template <typename Record>
+inline void shuffle_scatter(ShufflePlan<Record>* plan, int slice) {
+    int* cursor = &plan->cursor[(size_t)slice * plan->num_partitions];
+    int end = slice_begin(plan, slice + 1);
+    for (int i = slice_begin(plan, slice); i < end; i++) {
+        int r = plan_partition(plan, plan->input[i]);
+        plan->output[cursor[r]++] = plan->input[i];
+    }
+}
+
+// Shuffler Arguments Struct
+template <typename Record>
+struct ShuffleArgs {
+    ShufflePlan<Record>* plan;
+    int slice;
+};
+
+template <typename Record>
+inline void* shuffle_count_thread(void* args) {
+    ShuffleArgs<Record>* shuffle_args = (ShuffleArgs<Record>*)args;
+    shuffle_count(shuffle_args->plan, shuffle_args->slice);
+    return NULL;
+}
+
+template <typename Record>
+inline void* shuffle_scatter_thread(void* args) {
+    ShuffleArgs<Record>* shuffle_args = (ShuffleArgs<Record>*)args;
+    shuffle_scatter(shuffle_args->plan, shuffle_args->slice);
+    return NULL;
+}
+
+// Balance a plan, then run it with one short-lived thread per slice
+template <typename Record>
+inline void partition_pairs(ShufflePlan<Record>* plan) {
+    shuffle_balance(plan);
+    std::vector<pthread_t> threads(plan->num_slices);
+    std::vector<ShuffleArgs<Record> > shuffle_args(plan->num_slices);
+    for (int i = 0; i < plan->num_slices; i++) {
+        shuffle_args[i].plan = plan;
+        shuffle_args[i].slice = i;
+        pthread_create(&threads[i], NULL, shuffle_count_thread<Record>, &shuffle_args[i]);
+    }
+    for (int i = 0; i < plan->num_slices; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    shuffle_prefix_sum(plan);
+
+    for (int i = 0; i < plan->num_slices; i++) {
+        pthread_create(&threads[i], NULL, shuffle_scatter_thread<Record>, &shuffle_args[i]);
+    }
+    for (int i = 0; i < plan->num_slices; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "common.h"
+
+// Fixed-memory approximate counting. A Count-Min Sketch estimates how
+// often each word occurs, a small table of heavy-hitter candidates
+// remembers which words to ask it about, and a HyperLogLog estimates how
+// many distinct words there are. The memory depends only on the error
+// bounds, never on the vocabulary, and two sketches of the same shape
+// merge by adding or taking the maximum of their arrays element by element.
+
+// Count-Min Sketch: depth rows of width counters. A word adds its count to
+// one counter per row and its estimate is the smallest of those counters.
+// With width = e / epsilon and depth = ln(1 / delta), an estimate exceeds
+// the true count by at most epsilon * total with probability 1 - delta,
+// and is never below it.
+struct CountMinSketch {
+    size_t width;
+    int depth;
+    std::vector<uint32_t> counters;     // row-major, depth * width
+
+    CountMinSketch() : width(0), depth(0) {}
+
+    void init(double epsilon, double delta) {
+        width = (size_t)ceil(M_E / epsilon);
+        depth = std::max(1, (int)ceil(log(1 / delta)));
+        counters.assign(width * depth, 0);
+    }
+
+    // Counter of hash in row: double hashing over the two halves of hash
+    size_t column(uint64_t hash, int row) const {
+        uint32_t h = (uint32_t)hash + (uint32_t)row * ((uint32_t)(hash >> 32) | 1);
+        return row * width + (size_t)(((uint64_t)h * width) >> 32);
+    }
+
+    void add(uint64_t hash, uint32_t count) {
+        for (int row = 0; row < depth; row++) counters[column(hash, row)] += count;
+    }
+
+    uint32_t estimate(uint64_t hash) const {
+        uint32_t best = UINT32_MAX;
+        for (int row = 0; row < depth; row++) {
+            best = std::min(best, counters[column(hash, row)]);
+        }
+        return best;
+    }
+
+    // Fold counters [begin, end) of other in
+    void merge(const CountMinSketch& other, size_t begin, size_t end) {
+        uint32_t* into = counters.data();
+        const uint32_t* from = other.counters.data();
+        for (size_t i = begin; i < end; i++) into[i] += from[i];
+    }
+};
+
+// HyperLogLog with 2^precision one-byte registers. The first precision
+// bits of a hash pick a register, which keeps the longest run of leading
+// zeros seen in the remaining bits. The relative standard error of the
+// estimate is 1.04 / sqrt(2^precision).
+struct HyperLogLog {
+    int precision;
+    std::vector<uint8_t> registers;
+
+    HyperLogLog() : precision(0) {}
+
+    void init(int bits) {
+        precision = bits;
+        registers.assign((size_t)1 << bits, 0);
+    }
+
+    void add(uint64_t hash) {
+        size_t index = hash >> (64 - precision);
+        uint64_t rest = (hash << precision) | ((uint64_t)1 << (precision - 1));
+        uint8_t rank = (uint8_t)(__builtin_clzll(rest) + 1);
+        if (registers[index] < rank) registers[index] = rank;
+    }
+
+    // Fold registers [begin, end) of other in
+    void merge(const HyperLogLog& other, size_t begin, size_t end) {
+        uint8_t* into = registers.data();
+        const uint8_t* from = other.registers.data();
+        for (size_t i = begin; i < end; i++) into[i] = std::max(into[i], from[i]);
+    }
+
+    double estimate() const {
+        double m = (double)registers.size();
+        double sum = 0;
+        size_t zeros = 0;
+        for (size_t i = 0; i < registers.size(); i++) {
+            sum += ldexp(1.0, -registers[i]);
+            if (registers[i] == 0) zeros++;
+        }
+        double alpha = 0.7213 / (1 + 1.079 / m);
+        double raw = alpha * m * m / sum;
+
+        // Few distinct words: count empty registers instead
+        if (raw <= 2.5 * m && zeros > 0) return m * log(m / zeros);
+        return raw;
+    }
+
+    double relative_error() const {
+        return 1.04 / sqrt((double)registers.size());
+    }
+};
+
+// Heavy-hitter candidates of one mapper: the words with the highest sketch
+// estimates offered so far. The table holds up to twice capacity words;
+// when it fills, it is pruned to the best capacity, so offers stay O(1)
+// amortized and memory stays bounded.
+struct HeavyHitters {
+    size_t capacity;
+    StringArena arena;          // words of the table
+    StringArena spare;          // the next arena, while pruning
+    WordCountMap words;         // word -> latest estimate
+
+    HeavyHitters() : capacity(0), words(&arena) {}
+
+    void offer(const char* word, size_t length, uint32_t hash, int estimate) {
+        size_t i = words.find(word, hash);
+        if (words.slots[i].entry != -1) {
+            // Estimates only grow, so the latest is the best
+            words.entries[words.slots[i].entry].count = estimate;
+            return;
+        }
+        words.insert(i, KeyValuePair{arena.intern(word, length), hash, estimate});
+        if (words.entries.size() >= 2 * capacity) prune();
+    }
+
+    // Keep the best capacity words, copied into a fresh arena
+    void prune() {
+        std::vector<KeyValuePair> kept;
+        kept.swap(words.entries);
+        std::nth_element(kept.begin(), kept.begin() + capacity, kept.end(),
+                         [](const KeyValuePair& a, const KeyValuePair& b) {
+                             return a.count > b.count;
+                         });
+        kept.resize(capacity);
+        words.clear_counts();
+        for (size_t i = 0; i < kept.size(); i++) {
+            kept[i].word = spare.intern(kept[i].word, strlen(kept[i].word));
+            words.add(kept[i]);
+        }
+        arena.swap(spare);
+        spare.reset();
+    }
+};
+
+// Everything one mapper knows about the words it saw
+struct WordSketch {
+    CountMinSketch counts;
+    HyperLogLog distinct;
+    HeavyHitters heavy;
+    uint64_t total;             // every count added
+
+    WordSketch() : total(0) {}
+
+    void init(double epsilon, double delta, int precision, size_t candidates) {
+        counts.init(epsilon, delta);
+        distinct.init(precision);
+        heavy.capacity = candidates;
+        total = 0;
+    }
+
+    // Add a word's count, typically one task's combined count of it
+    void add(const char* word, size_t length, uint32_t hash, int count) {
+        uint64_t hash64 = mix_hash(hash_word(word, length));
+        counts.add(hash64, count);
+        distinct.add(hash64);
+        total += count;
+        heavy.offer(word, length, hash, counts.estimate(hash64));
+    }
+
+    // Bytes of the fixed-size arrays
+    size_t memory_usage() const {
+        return counts.counters.size() * sizeof(uint32_t) + distinct.registers.size();
+    }
+};
+
+#endif
@@ -0,0 +1,398 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <queue>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "shuffle.h"
+#include "tokenize.h"
+#include "input.h"
+
+// Size of the read buffer each streaming mapper refills from its byte range
+const size_t STREAM_CHUNK_SIZE = 1 << 20;
+
+// Sorted runs spilled to disk, one list per reducer partition
+struct SpillRuns {
+    char dir[PATH_MAX];
+    pthread_mutex_t mutex;
+    int next_run;
+    std::vector<std::vector<std::string> > files;
+};
+
+// Create a private temp directory for runs under $TMPDIR (or /tmp)
+inline bool open_spill_runs(struct SpillRuns* runs, int num_partitions) {
+    runs->files.assign(num_partitions, std::vector<std::string>());
+    const char* tmp = getenv("TMPDIR");
+    snprintf(runs->dir, sizeof(runs->dir), "%s/mapreduce-XXXXXX",
+             tmp ? tmp : "/tmp");
+    if (mkdtemp(runs->dir) == NULL) return false;
+    pthread_mutex_init(&runs->mutex, NULL);
+    runs->next_run = 0;
+    return true;
+}
+
+// Remove every run file and the temp directory
+inline void close_spill_runs(struct SpillRuns* runs) {
+    for (size_t r = 0; r < runs->files.size(); r++) {
+        for (size_t i = 0; i < runs->files[r].size(); i++) {
+            unlink(runs->files[r][i].c_str());
+        }
+        runs->files[r].clear();
+    }
+    rmdir(runs->dir);
+    pthread_mutex_destroy(&runs->mutex);
+}
+
+// Reserve a fresh run file name in the spill directory
+inline std::string next_run_path(struct SpillRuns* runs, const char* tag) {
+    pthread_mutex_lock(&runs->mutex);
+    int id = runs->next_run++;
+    pthread_mutex_unlock(&runs->mutex);
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/%s-%d", runs->dir, tag, id);
+    return path;
+}
+
+// Sorted runs are written in blocks of about RUN_BLOCK_SIZE bytes. Each
+// block is a RunBlockHeader and a payload of records. A record is a varint
+// count of bytes shared with the previous word, a varint suffix length,
+// the suffix, and a varint count. The first record of a block shares
+// nothing, so every block decodes on its own. After the last block comes
+// an index block: for each block, its varint file offset, a length byte
+// and its first word. The file ends with the index block's 8-byte offset.
+const size_t RUN_BLOCK_SIZE = 64 << 10;
+const uint32_t RUN_BLOCK_MAGIC = 0x4b4c4252;    // "RBLK"
+const uint32_t RUN_INDEX_MAGIC = 0x58444952;    // "RIDX"
+
+struct RunBlockHeader {
+    uint32_t magic;
+    uint32_t num_records;
+    uint32_t payload_size;
+    uint32_t checksum;          // low bits of hash_bytes of the payload
+};
+
+// Sequential writer of a sorted run of count pairs, one block at a time
+struct RunWriter {
+    FILE* file;
+    std::vector<char> block;    // payload of the block being filled
+    uint32_t block_records;
+    char previous[MAX_WORD_LENGTH];
+    size_t previous_length;
+    uint64_t offset;            // file offset of the block being filled
+    std::vector<char> index;
+
+    RunWriter() : file(NULL), block_records(0), previous_length(0), offset(0) {}
+
+    bool open(const std::string& path) {
+        file = fopen(path.c_str(), "wb");
+        block.clear();
+        block_records = 0;
+        previous_length = 0;
+        offset = 0;
+        index.clear();
+        return file != NULL;
+    }
+
+    bool write_block(uint32_t magic, uint32_t num_records, const std::vector<char>& payload) {
+        struct RunBlockHeader header = {magic, num_records, (uint32_t)payload.size(),
+                                        (uint32_t)hash_bytes(payload.data(), payload.size())};
+        offset += sizeof(header) + payload.size();
+        return fwrite(&header, sizeof(header), 1, file) == 1 &&
+               (payload.empty() ||
+                fwrite(payload.data(), 1, payload.size(), file) == payload.size());
+    }
+
+    bool flush() {
+        if (block_records == 0) return true;
+        bool ok = write_block(RUN_BLOCK_MAGIC, block_records, block);
+        block.clear();
+        block_records = 0;
+        return ok;
+    }
+
+    bool write(const struct KeyValuePair& kv) {
+        size_t length = strlen(kv.word);
+        if (block.size() >= RUN_BLOCK_SIZE && !flush()) return false;
+        size_t shared = 0;
+        if (block_records == 0) {
+            // First word of a block: index it, and share nothing
+            put_varint(&index, offset);
+            index.push_back((char)length);
+            index.insert(index.end(), kv.word, kv.word + length);
+        } else {
+            while (shared < length && shared < previous_length &&
+                   kv.word[shared] == previous[shared]) {
+                shared++;
+            }
+        }
+        put_varint(&block, shared);
+        put_varint(&block, length - shared);
+        block.insert(block.end(), kv.word + shared, kv.word + length);
+        put_varint(&block, (uint32_t)kv.count);
+        memcpy(previous, kv.word, length);
+        previous_length = length;
+        block_records++;
+        return true;
+    }
+
+    bool close() {
+        bool ok = flush();
+        uint64_t index_offset = offset;
+        ok = ok && write_block(RUN_INDEX_MAGIC, 0, index) &&
+             fwrite(&index_offset, sizeof(index_offset), 1, file) == 1;
+        return fclose(file) == 0 && ok;
+    }
+};
+
+// Sequential reader of a sorted run, one block in memory at a time;
+// current holds the record at the head and its word points into the
+// reader's own buffer. A damaged block ends the run and sets failed.
+struct RunReader {
+    FILE* file;
+    struct KeyValuePair current;
+    char word[MAX_WORD_LENGTH];
+    size_t word_length;
+    std::vector<char> block;
+    const char* p;              // next record in block
+    uint32_t records_left;      // in the current block
+    bool failed;
+
+    bool open(const std::string& path) {
+        file = fopen(path.c_str(), "rb");
+        current.word = word;
+        word_length = 0;
+        block.clear();
+        p = NULL;
+        records_left = 0;
+        failed = false;
+        return file != NULL;
+    }
+
+    // Load the next data block; false at the index block or on damage
+    bool load_block() {
+        struct RunBlockHeader header;
+        if (fread(&header, sizeof(header), 1, file) != 1) {
+            failed = true;
+            return false;
+        }
+        if (header.magic == RUN_INDEX_MAGIC) return false;
+        block.resize(header.payload_size);
+        if (header.magic != RUN_BLOCK_MAGIC || header.num_records == 0 ||
+            fread(block.data(), 1, block.size(), file) != block.size() ||
+            header.checksum != (uint32_t)hash_bytes(block.data(), block.size())) {
+            failed = true;
+            return false;
+        }
+        p = block.data();
+        records_left = header.num_records;
+        word_length = 0;
+        return true;
+    }
+
+    bool next() {
+        if (records_left == 0 && !load_block()) return false;
+        const char* end = block.data() + block.size();
+        uint64_t shared, suffix, count;
+        if (!get_varint(&p, end, &shared) || !get_varint(&p, end, &suffix) ||
+            shared > word_length || shared + suffix >= MAX_WORD_LENGTH ||
+            suffix > (uint64_t)(end - p)) {
+            failed = true;
+            return false;
+        }
+        memcpy(word + shared, p, suffix);
+        p += suffix;
+        word_length = shared + suffix;
+        word[word_length] = '\0';
+        if (!get_varint(&p, end, &count)) {
+            failed = true;
+            return false;
+        }
+        current.count = (int)count;
+        current.hash = hash_key(word, word_length);
+        records_left--;
+        return true;
+    }
+
+    // Move to the first record whose word is not below key, using the block
+    // index to skip the blocks before it. False if there is none, or on
+    // damage, which also sets failed.
+    bool seek(const char* key) {
+        uint64_t index_offset;
+        struct RunBlockHeader header;
+        if (fseek(file, -(long)sizeof(index_offset), SEEK_END) != 0 ||
+            fread(&index_offset, sizeof(index_offset), 1, file) != 1 ||
+            fseek(file, (long)index_offset, SEEK_SET) != 0 ||
+            fread(&header, sizeof(header), 1, file) != 1 ||
+            header.magic != RUN_INDEX_MAGIC) {
+            failed = true;
+            return false;
+        }
+        std::vector<char> index(header.payload_size);
+        if (fread(index.data(), 1, index.size(), file) != index.size() ||
+            header.checksum != (uint32_t)hash_bytes(index.data(), index.size())) {
+            failed = true;
+            return false;
+        }
+        uint64_t start = index_offset;      // no block: seek to the end
+        const char* q = index.data();
+        const char* end = q + index.size();
+        while (q < end) {
+            uint64_t block_offset;
+            if (!get_varint(&q, end, &block_offset) || q >= end) {
+                failed = true;
+                return false;
+            }
+            size_t length = (unsigned char)*q++;
+            if (length > (size_t)(end - q)) {
+                failed = true;
+                return false;
+            }
+            std::string first(q, length);
+            q += length;
+            if (start != index_offset && strcmp(first.c_str(), key) > 0) break;
+            start = block_offset;
+        }
+        records_left = 0;
+        if (fseek(file, (long)start, SEEK_SET) != 0) {
+            failed = true;
+            return false;
+        }
+        while (next()) {
+            if (strcmp(word, key) >= 0) return true;
+        }
+        return false;
+    }
+
+    void close() {
+        fclose(file);
+    }
+};
+
+// Write the combiner's contents as one sorted run per partition, register
+// the runs and empty the combiner. Returns false on an I/O error.
+inline bool spill_combiner(WordCountMap& combiner, struct SpillRuns* runs) {
+    int num_partitions = (int)runs->files.size();
+    std::vector<std::pair<int, const KeyValuePair*> > sorted;
+    sorted.reserve(combiner.entries.size());
+    for (size_t i = 0; i < combiner.entries.size(); i++) {
+        const KeyValuePair* kv = &combiner.entries[i];
+        sorted.push_back(std::make_pair(partition_of(*kv, num_partitions), kv));
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](const std::pair<int, const KeyValuePair*>& a,
+                 const std::pair<int, const KeyValuePair*>& b) {
+                  if (a.first != b.first) return a.first < b.first;
+                  return strcmp(a.second->word, b.second->word) < 0;
+              });
+
+    size_t i = 0;
+    while (i < sorted.size()) {
+        int r = sorted[i].first;
+        std::string path = next_run_path(runs, "run");
+        struct RunWriter writer;
+        if (!writer.open(path)) return false;
+        bool ok = true;
+        for (; i < sorted.size() && sorted[i].first == r; i++) {
+            ok = writer.write(*sorted[i].second) && ok;
+        }
+        ok = writer.close() && ok;
+
+        pthread_mutex_lock(&runs->mutex);
+        runs->files[r].push_back(path);
+        pthread_mutex_unlock(&runs->mutex);
+        if (!ok) return false;
+    }
+
+    combiner.clear();
+    return true;
+}
+
+// k-way merge of sorted runs. Calls emit(kv) once per distinct word, in
+// ascending order, with the counts of all runs summed; kv.word is only
+// valid during the call. Memory use is one block and one stdio buffer
+// per run.
+template <typename Emit>
+inline bool merge_runs(const std::vector<std::string>& files, Emit emit) {
+    std::vector<RunReader> readers(files.size());
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!readers[i].open(files[i])) {
+            for (size_t k = 0; k < i; k++) readers[k].close();
+            return false;
+        }
+    }
+
+    auto greater = [&readers](size_t a, size_t b) {
+        return strcmp(readers[a].current.word, readers[b].current.word) > 0;
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+    for (size_t i = 0; i < readers.size(); i++) {
+        if (readers[i].next()) heap.push(i);
+    }
+
+    struct KeyValuePair pending;
+    char pending_word[MAX_WORD_LENGTH];
+    bool has_pending = false;
+    while (!heap.empty()) {
+        size_t i = heap.top();
+        heap.pop();
+        if (has_pending && strcmp(pending.word, readers[i].current.word) == 0) {
+            pending.count += readers[i].current.count;
+        } else {
+            if (has_pending) emit(pending);
+            pending = readers[i].current;
+            strcpy(pending_word, readers[i].word);
+            pending.word = pending_word;
+            has_pending = true;
+        }
+        if (readers[i].next()) heap.push(i);
+    }
+    if (has_pending) emit(pending);
+
+    bool ok = true;
+    for (size_t i = 0; i < readers.size(); i++) {
+        ok = !readers[i].failed && ok;
+        readers[i].close();
+    }
+    return ok;
+}
+
+// Stream [begin, end) of fd through a fixed-size buffer, calling
+// emit(word, length) for each cleaned word as tokenize_clean does and adding
+// the number of tokens to *tokens. A token is only cut in two if it is
+// longer than the whole buffer.
+template <typename Emit>
+inline bool stream_tokens(int fd, size_t begin, size_t end, char* buffer,
+                          size_t buffer_size, size_t* tokens, Emit emit) {
+    size_t carry = 0;
+    size_t offset = begin;
+    while (offset < end || carry > 0) {
+        size_t want = std::min(buffer_size - carry, end - offset);
+        ssize_t n = want > 0 ? pread(fd, buffer + carry, want, offset) : 0;
+        if (n < 0) return false;
+        offset += n;
+        size_t length = carry + n;
+
+        // Keep a trailing partial token for the next refill
+        size_t cut = length;
+        if (offset < end && n > 0) {
+            while (cut > 0 && !isspace((unsigned char)buffer[cut - 1])) cut--;
+            if (cut == 0) cut = length;
+        }
+        *tokens += tokenize_clean(buffer, buffer + cut, emit);
+
+        carry = length - cut;
+        memmove(buffer, buffer + cut, carry);
+        if (n == 0 && want > 0) break; // file ended early
+    }
+    return true;
+}
+
+#endif
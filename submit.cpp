@@ -0,0 +1,139 @@
+// Client for the engine's --serve mode. Submits one job over the server's
+// Unix socket and prints its results as they arrive, "word: count" per
+// line, like the batch engine; the job's summary goes to stderr. Paths
+// are made absolute first, since the server may run in another directory.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s SOCKET [--threads N] [--top K] [--ngram N] PATH...   run a job\n"
+            "       %s SOCKET --status                                   server status\n"
+            "       %s SOCKET --shutdown                                 stop the server\n",
+            program, program, program);
+}
+
+int connect_to(const char* path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) return -1;
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool send_all(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::string request;
+    bool job = false;
+    std::vector<std::string> paths;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--status") == 0) {
+            request = "STATUS\n";
+        } else if (strcmp(argv[i], "--shutdown") == 0) {
+            request = "SHUTDOWN\n";
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            request += std::string(" threads=") + argv[++i];
+        } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            request += std::string(" top=") + argv[++i];
+        } else if (strcmp(argv[i], "--ngram") == 0 && i + 1 < argc) {
+            request += std::string(" mode=ngram n=") + argv[++i];
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            char absolute[PATH_MAX];
+            if (realpath(argv[i], absolute) == NULL) {
+                fprintf(stderr, "%s: no such file or directory\n", argv[i]);
+                return 1;
+            }
+            paths.push_back(absolute);
+            job = true;
+        }
+    }
+    if (job) {
+        request = "COUNT" + request + "\n";
+        for (size_t i = 0; i < paths.size(); i++) request += "PATH " + paths[i] + "\n";
+        request += "\n";
+    } else if (request.empty() || request[0] == ' ') {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int fd = connect_to(argv[1]);
+    if (fd < 0) {
+        fprintf(stderr, "%s: no server listening\n", argv[1]);
+        return 1;
+    }
+    if (!send_all(fd, request)) {
+        fprintf(stderr, "Error sending the request\n");
+        close(fd);
+        return 1;
+    }
+
+    // Copy result lines to stdout until the reply's last line. Results are
+    // lowercase, so they never look like OK, DONE or ERROR.
+    int status = 1;
+    std::string pending;
+    char buffer[1 << 16];
+    ssize_t n;
+    bool done = false;
+    while (!done && (n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        pending.append(buffer, n);
+        size_t start = 0, newline;
+        while (!done && (newline = pending.find('\n', start)) != std::string::npos) {
+            std::string line = pending.substr(start, newline - start);
+            start = newline + 1;
+            if (!job) {
+                printf("%s\n", line.c_str());
+                status = line.compare(0, 5, "ERROR") == 0;
+                done = true;
+            } else if (line.compare(0, 3, "OK ") == 0) {
+                continue;
+            } else if (line.compare(0, 5, "DONE ") == 0) {
+                fprintf(stderr, "%s\n", line.c_str());
+                status = 0;
+                done = true;
+            } else if (line.compare(0, 6, "ERROR ") == 0) {
+                fprintf(stderr, "%s\n", line.c_str() + 6);
+                done = true;
+            } else {
+                fwrite(line.data(), 1, line.size(), stdout);
+                fputc('\n', stdout);
+            }
+        }
+        pending.erase(0, start);
+    }
+    close(fd);
+    if (!done) fprintf(stderr, "Connection closed before the job finished\n");
+    return status;
+}
@@ -0,0 +1,28 @@
+#ifndef TESTS_CHECK_H
+#define TESTS_CHECK_H
+
+#include <stdio.h>
+
+// Minimal checks for the unit tests: a failed CHECK prints where it failed
+// and the test keeps going, so one run reports every failure.
+
+static int check_failures = 0;
+
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            check_failures++; \
+        } \
+    } while (0)
+
+// Print the test's result; returns its exit status
+inline int check_report(const char* name) {
+    if (check_failures > 0) {
+        printf("%s: %d checks failed\n", name, check_failures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,148 @@
+// Result index: build, open, point and prefix lookups against the words
+// it was built from, and rejection of a damaged file
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "check.h"
+#include "index.h"
+
+using namespace std;
+
+bool truncate_copy(const string& from, const string& to, long size) {
+    FILE* in = fopen(from.c_str(), "rb");
+    FILE* out = fopen(to.c_str(), "wb");
+    if (in == NULL || out == NULL) return false;
+    int c;
+    for (long i = 0; i < size && (c = fgetc(in)) != EOF; i++) fputc(c, out);
+    fclose(in);
+    return fclose(out) == 0;
+}
+
+// Copy from to to, with size bytes at offset replaced by value
+bool patch_copy(const string& from, const string& to, size_t offset,
+                const void* value, size_t size) {
+    FILE* in = fopen(from.c_str(), "rb");
+    if (in == NULL) return false;
+    vector<char> data;
+    int c;
+    while ((c = fgetc(in)) != EOF) data.push_back((char)c);
+    fclose(in);
+    if (offset + size > data.size()) return false;
+    memcpy(data.data() + offset, value, size);
+    FILE* out = fopen(to.c_str(), "wb");
+    if (out == NULL) return false;
+    bool ok = fwrite(data.data(), 1, data.size(), out) == data.size();
+    return fclose(out) == 0 && ok;
+}
+
+int main() {
+    const char* tmp = getenv("TMPDIR");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/index_test-%d", tmp ? tmp : "/tmp", (int)getpid());
+
+    map<string, int> counts;
+    char word[32];
+    srand(1);
+    for (int i = 0; i < 20000; i++) {
+        snprintf(word, sizeof(word), "%c%c%d", 'a' + rand() % 5, 'a' + rand() % 26, rand() % 5000);
+        counts[word] = 1 + rand() % 1000;
+    }
+
+    struct IndexBuilder builder;
+    for (map<string, int>::iterator it = counts.begin(); it != counts.end(); ++it) {
+        builder.add(KeyValuePair{it->first.c_str(), 0, it->second});
+    }
+    CHECK(builder.write(path));
+
+    struct ResultIndex index;
+    CHECK(index_open(path, &index));
+    CHECK(index.num_words == counts.size());
+
+    // Every word, in order, with its count
+    bool found = true;
+    size_t i = 0;
+    for (map<string, int>::iterator it = counts.begin(); it != counts.end(); ++it, i++) {
+        found = found && it->first == index_word(&index, i) &&
+                index_lookup(&index, it->first.c_str()) == (uint32_t)it->second;
+    }
+    CHECK(found);
+
+    // Words that are not there: before, between and after the others
+    CHECK(index_lookup(&index, "") == 0);
+    CHECK(index_lookup(&index, "a") == 0);
+    CHECK(index_lookup(&index, "aa99999") == 0);
+    CHECK(index_lookup(&index, "zzz") == 0);
+
+    // Prefix queries against a scan of the map
+    const char* prefixes[] = {"", "a", "bq", "c1", "e", "ez4", "f", "q"};
+    for (size_t p = 0; p < sizeof(prefixes) / sizeof(prefixes[0]); p++) {
+        string prefix = prefixes[p];
+        vector<pair<string, int> > expected, got;
+        for (map<string, int>::iterator it = counts.begin(); it != counts.end(); ++it) {
+            if (it->first.compare(0, prefix.size(), prefix) == 0) expected.push_back(*it);
+        }
+        index_prefix(&index, prefix.c_str(), [&](const char* word, uint32_t count) {
+            got.push_back(make_pair(string(word), (int)count));
+            return true;
+        });
+        CHECK(got == expected);
+    }
+
+    // Stopping early
+    size_t visited = 0;
+    index_prefix(&index, "a", [&](const char*, uint32_t) { return ++visited < 3; });
+    CHECK(visited == 3);
+    index_close(&index);
+
+    // A truncated file, and one that is not an index at all
+    string damaged = string(path) + ".damaged";
+    CHECK(truncate_copy(path, damaged, sizeof(struct IndexHeader) + 64));
+    CHECK(!index_open(damaged.c_str(), &index));
+    FILE* out = fopen(damaged.c_str(), "wb");
+    fputs("not an index, but long enough to hold a header of one", out);
+    fclose(out);
+    CHECK(!index_open(damaged.c_str(), &index));
+
+    // Header fields that would wrap around when added, or point the
+    // offsets into the header itself
+    const uint64_t bad_fields[][2] = {
+        {offsetof(IndexHeader, offsets_offset), UINT64_MAX - 7},
+        {offsetof(IndexHeader, offsets_offset), 0},
+        {offsetof(IndexHeader, num_words), (uint64_t)1 << 61},
+        {offsetof(IndexHeader, strings_offset), UINT64_MAX - 15},
+        {offsetof(IndexHeader, strings_size), UINT64_MAX},
+    };
+    for (size_t f = 0; f < sizeof(bad_fields) / sizeof(bad_fields[0]); f++) {
+        CHECK(patch_copy(path, damaged, bad_fields[f][0], &bad_fields[f][1], sizeof(uint64_t)));
+        CHECK(!index_open(damaged.c_str(), &index));
+    }
+
+    // A word offset past the string area reads as the empty word; the
+    // other words are still found
+    uint64_t bad_offset = UINT64_MAX / 2;
+    CHECK(patch_copy(path, damaged, sizeof(struct IndexHeader) + 5 * sizeof(uint64_t),
+                     &bad_offset, sizeof(bad_offset)));
+    CHECK(index_open(damaged.c_str(), &index));
+    CHECK(strcmp(index_word(&index, 5), "") == 0);
+    CHECK(index_lookup(&index, counts.rbegin()->first.c_str()) == (uint32_t)counts.rbegin()->second);
+    size_t visited_all = 0;
+    index_prefix(&index, "", [&](const char*, uint32_t) { visited_all++; return true; });
+    CHECK(visited_all <= counts.size());
+    index_close(&index);
+
+    // An empty index still opens
+    struct IndexBuilder empty;
+    CHECK(empty.write(path));
+    CHECK(index_open(path, &index));
+    CHECK(index.num_words == 0 && index_lookup(&index, "a") == 0);
+    index_close(&index);
+
+    unlink(damaged.c_str());
+    unlink(path);
+    return check_report("index_test");
+}
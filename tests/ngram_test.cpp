@@ -0,0 +1,105 @@
+// N-gram scanning against a naive counter that cleans every word and joins
+// each run of n words, with the input cut into tasks at random points
+#include <stdlib.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "check.h"
+#include "ngram.h"
+
+using namespace std;
+
+bool is_space(char c) {
+    return c == ' ' || (unsigned)(c - '\t') < 5;
+}
+
+map<string, int> naive_counts(const string& text, int n) {
+    vector<string> words;
+    size_t i = 0;
+    while (i < text.size()) {
+        while (i < text.size() && is_space(text[i])) i++;
+        size_t start = i;
+        while (i < text.size() && !is_space(text[i])) i++;
+        string token = text.substr(start, i - start);
+        vector<char> cleaned(token.size() + 1);
+        clean_word(token.c_str(), cleaned.data());
+        if (cleaned[0] != '\0') words.push_back(cleaned.data());
+    }
+    map<string, int> counts;
+    for (size_t w = 0; w + n <= words.size(); w++) {
+        string phrase = words[w];
+        for (int k = 1; k < n; k++) phrase += " " + words[w + k];
+        counts[phrase]++;
+    }
+    return counts;
+}
+
+// Random text from a small vocabulary, so phrases repeat, with case,
+// punctuation and tokens that clean to nothing mixed in
+string random_text(size_t words) {
+    static const char* vocabulary[] = {"the", "The", "cat", "cat,", "sat", "ON", "mat.",
+                                       "a", "--", "42", "dog's", "!!"};
+    static const char* spaces[] = {" ", "  ", "\n", "\t", " \r\n"};
+    string text;
+    for (size_t i = 0; i < words; i++) {
+        text += vocabulary[rand() % (sizeof(vocabulary) / sizeof(vocabulary[0]))];
+        text += spaces[rand() % (sizeof(spaces) / sizeof(spaces[0]))];
+    }
+    return text;
+}
+
+// Scan text as tasks cut at random whitespace, as the engine cuts its
+// input, and total the counts by phrase. Every occurrence of a phrase
+// must have the same hash, or the engine's map would split it.
+map<string, int> scanned_counts(const string& text, int n, size_t* tokens) {
+    vector<size_t> bounds(1, 0);
+    while (bounds.back() < text.size()) {
+        size_t next = bounds.back() + 1 + rand() % 64;
+        while (next < text.size() && !is_space(text[next])) next++;
+        bounds.push_back(next < text.size() ? next : text.size());
+    }
+
+    map<string, int> counts;
+    map<string, uint64_t> hashes;
+    bool same_hash = true;
+    string phrase;
+    const char* data = text.data();
+    *tokens = 0;
+    for (size_t t = 0; t + 1 < bounds.size(); t++) {
+        *tokens += scan_ngrams(data + bounds[t], data + bounds[t + 1], data + text.size(), n,
+                               [&](const NgramKey& key) {
+            ngram_text(key.text, key.length, &phrase);
+            counts[phrase]++;
+            if (hashes.count(phrase) > 0) same_hash = same_hash && hashes[phrase] == key.hash;
+            hashes[phrase] = key.hash;
+        });
+    }
+    CHECK(same_hash);
+    return counts;
+}
+
+int main() {
+    srand(1);
+    for (int n = 2; n <= MAX_NGRAM; n++) {
+        for (int round = 0; round < 20; round++) {
+            string text = random_text(rand() % 300);
+            size_t tokens;
+            map<string, int> counts = scanned_counts(text, n, &tokens);
+            CHECK(counts == naive_counts(text, n));
+            size_t expected_tokens = tokenize_clean(text.data(), text.data() + text.size(),
+                                                    [](const char*, size_t) {});
+            CHECK(tokens == expected_tokens);
+        }
+    }
+
+    // Spans that differ only in case and punctuation are the same phrase
+    const char* text = "The cat sat; the cat, sat";
+    vector<NgramKey> keys;
+    scan_ngrams(text, text + strlen(text), text + strlen(text), 2,
+                [&](const NgramKey& key) { keys.push_back(key); });
+    CHECK(keys.size() == 5);
+    CHECK(ngram_equal(keys[0], keys[3]));
+    CHECK(ngram_equal(keys[1], keys[4]));
+    CHECK(!ngram_equal(keys[0], keys[1]));
+    return check_report("ngram_test");
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Build and run every unit test in tests/. Extra arguments are passed to the
+# compiler, e.g. tests/run.sh -fsanitize=address. Exits non-zero if any test
+# fails to build or fails.
+cd "$(dirname "$0")/.." || exit 1
+out=${TMPDIR:-/tmp}/wordcount-tests
+mkdir -p "$out" || exit 1
+status=0
+for test in tests/*_test.cpp; do
+    name=$(basename "$test" .cpp)
+    if ! g++ -std=c++17 -O2 -pthread -I. "$@" "$test" -o "$out/$name"; then
+        echo "$name: build failed"
+        status=1
+        continue
+    fi
+    "$out/$name" || status=1
+done
+exit $status
@@ -0,0 +1,117 @@
+// Approximate counting: Count-Min estimates stay within their error bound,
+// HyperLogLog within a few standard errors, merges equal a single sketch
+// of the whole stream, and the heavy hitters hold the most frequent words
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "check.h"
+#include "corpus.h"
+#include "sketch.h"
+
+using namespace std;
+
+const double EPSILON = 0.001;
+const double DELTA = 0.01;
+const int PRECISION = 12;
+
+uint64_t word_hash(int word) {
+    char text[16];
+    int length = snprintf(text, sizeof(text), "w%d", word);
+    return mix_hash(hash_word(text, length));
+}
+
+// Skewed stream over vocabulary words: word i is drawn about 1 / (i + 1)
+// as often as word 0
+vector<int> skewed_stream(size_t length, int vocabulary, uint64_t seed) {
+    vector<int> stream;
+    for (size_t i = 0; i < length; i++) {
+        double u = (corpus_random(&seed) >> 11) * (1.0 / 9007199254740992.0);
+        stream.push_back((int)(pow((double)vocabulary, u)) - 1);
+    }
+    return stream;
+}
+
+void check_count_min() {
+    const int vocabulary = 50000;
+    vector<int> stream = skewed_stream(1000000, vocabulary, 1);
+    vector<uint32_t> truth(vocabulary, 0);
+    CountMinSketch whole, first, second;
+    whole.init(EPSILON, DELTA);
+    first.init(EPSILON, DELTA);
+    second.init(EPSILON, DELTA);
+    for (size_t i = 0; i < stream.size(); i++) {
+        uint64_t hash = word_hash(stream[i]);
+        truth[stream[i]]++;
+        whole.add(hash, 1);
+        (i < stream.size() / 2 ? first : second).add(hash, 1);
+    }
+
+    // Never below the true count; above it by more than epsilon * total
+    // for at most a delta share of the words, with some slack
+    size_t under = 0, over = 0;
+    double bound = EPSILON * stream.size();
+    for (int w = 0; w < vocabulary; w++) {
+        uint32_t estimate = whole.estimate(word_hash(w));
+        if (estimate < truth[w]) under++;
+        if (estimate > truth[w] + bound) over++;
+    }
+    CHECK(under == 0);
+    CHECK(over <= 2 * DELTA * vocabulary);
+
+    // Merging the halves, in two pieces, gives the same counters
+    first.merge(second, 0, first.counters.size() / 3);
+    first.merge(second, first.counters.size() / 3, first.counters.size());
+    CHECK(first.counters == whole.counters);
+}
+
+void check_hyperloglog() {
+    const size_t sizes[] = {10, 1000, 20000, 300000, 2000000};
+    uint64_t seed = 2;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        HyperLogLog whole, first, second;
+        whole.init(PRECISION);
+        first.init(PRECISION);
+        second.init(PRECISION);
+        for (size_t i = 0; i < sizes[s]; i++) {
+            uint64_t hash = mix_hash(corpus_random(&seed));
+            whole.add(hash);
+            whole.add(hash);        // repeats change nothing
+            (i % 2 ? first : second).add(hash);
+        }
+        double error = fabs(whole.estimate() - sizes[s]) / sizes[s];
+        CHECK(error <= 4 * whole.relative_error());
+
+        first.merge(second, 0, first.registers.size());
+        CHECK(first.registers == whole.registers);
+    }
+}
+
+void check_heavy_hitters() {
+    const int vocabulary = 20000;
+    vector<int> stream = skewed_stream(500000, vocabulary, 3);
+    WordSketch sketch;
+    sketch.init(EPSILON, DELTA, PRECISION, 100);
+    char text[16];
+    for (size_t i = 0; i < stream.size(); i++) {
+        int length = snprintf(text, sizeof(text), "w%d", stream[i]);
+        sketch.add(text, length, hash_key(text, length), 1);
+    }
+    CHECK(sketch.total == stream.size());
+    CHECK(sketch.heavy.words.entries.size() < 2 * sketch.heavy.capacity);
+
+    // The 20 most frequent words are the lowest ranks, and all are kept
+    for (int w = 0; w < 20; w++) {
+        int length = snprintf(text, sizeof(text), "w%d", w);
+        size_t i = sketch.heavy.words.find(text, hash_key(text, length));
+        CHECK(sketch.heavy.words.slots[i].entry != -1);
+    }
+}
+
+int main() {
+    check_count_min();
+    check_hyperloglog();
+    check_heavy_hitters();
+    return check_report("sketch_test");
+}
@@ -0,0 +1,130 @@
+// Sorted runs: write and read back across blocks, seek through the block
+// index, and reject damaged blocks
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "check.h"
+#include "spill.h"
+
+using namespace std;
+
+// Sorted distinct words with long shared prefixes, enough for many blocks
+vector<string> sorted_words(size_t count) {
+    vector<string> words;
+    char word[64];
+    for (size_t i = 0; i < count; i++) {
+        snprintf(word, sizeof(word), "prefix%zu-%07zu", i % 7, i * 13);
+        words.push_back(word);
+    }
+    sort(words.begin(), words.end());
+    words.erase(unique(words.begin(), words.end()), words.end());
+    return words;
+}
+
+bool write_run(const string& path, const vector<string>& words) {
+    struct RunWriter writer;
+    if (!writer.open(path)) return false;
+    bool ok = true;
+    for (size_t i = 0; i < words.size(); i++) {
+        ok = writer.write(KeyValuePair{words[i].c_str(), 0, (int)i + 1}) && ok;
+    }
+    return writer.close() && ok;
+}
+
+void check_round_trip(const string& path, const vector<string>& words) {
+    struct RunReader reader;
+    CHECK(reader.open(path));
+    size_t i = 0;
+    bool ordered = true;
+    while (reader.next()) {
+        ordered = ordered && i < words.size() && words[i] == reader.current.word &&
+                  reader.current.count == (int)i + 1 &&
+                  reader.current.hash == hash_key(words[i].c_str(), words[i].size());
+        i++;
+    }
+    CHECK(ordered);
+    CHECK(i == words.size());
+    CHECK(!reader.failed);
+    reader.close();
+}
+
+void check_seek(const string& path, const vector<string>& words) {
+    for (size_t probe = 0; probe < words.size(); probe += words.size() / 97 + 1) {
+        // An existing word, and a key just below it
+        string below = words[probe].substr(0, words[probe].size() - 1);
+        const string keys[2] = {words[probe], below};
+        for (int k = 0; k < 2; k++) {
+            size_t expected = lower_bound(words.begin(), words.end(), keys[k]) - words.begin();
+            struct RunReader reader;
+            CHECK(reader.open(path));
+            CHECK(reader.seek(keys[k].c_str()));
+            CHECK(!reader.failed && words[expected] == reader.current.word);
+            CHECK(reader.current.count == (int)expected + 1);
+            reader.close();
+        }
+    }
+
+    // Past the last word: no record, but no damage either
+    struct RunReader reader;
+    CHECK(reader.open(path));
+    CHECK(!reader.seek("zzz"));
+    CHECK(!reader.failed);
+    reader.close();
+}
+
+// Flip one byte at offset and check that reading or seeking notices
+void check_damage(const string& path, const vector<string>& words, long offset,
+                  bool in_index) {
+    string damaged = path + ".damaged";
+    FILE* in = fopen(path.c_str(), "rb");
+    FILE* out = fopen(damaged.c_str(), "wb");
+    int c;
+    for (long i = 0; (c = fgetc(in)) != EOF; i++) fputc(i == offset ? c ^ 0x20 : c, out);
+    fclose(in);
+    fclose(out);
+
+    struct RunReader reader;
+    CHECK(reader.open(damaged));
+    if (in_index) {
+        CHECK(!reader.seek(words[0].c_str()));
+    } else {
+        size_t records = 0;
+        while (reader.next()) records++;
+        CHECK(records < words.size());
+    }
+    CHECK(reader.failed);
+    reader.close();
+    unlink(damaged.c_str());
+}
+
+int main() {
+    struct SpillRuns runs;
+    CHECK(open_spill_runs(&runs, 1));
+    string path = next_run_path(&runs, "test");
+
+    vector<string> words = sorted_words(40000);
+    CHECK(write_run(path, words));
+    check_round_trip(path, words);
+    check_seek(path, words);
+
+    // A byte of the first block's payload, then one of the index block
+    FILE* file = fopen(path.c_str(), "rb");
+    uint64_t index_offset = 0;
+    fseek(file, -(long)sizeof(index_offset), SEEK_END);
+    CHECK(fread(&index_offset, sizeof(index_offset), 1, file) == 1);
+    fclose(file);
+    CHECK(index_offset > RUN_BLOCK_SIZE);
+    check_damage(path, words, sizeof(struct RunBlockHeader) + 100, false);
+    check_damage(path, words, (long)index_offset + sizeof(struct RunBlockHeader) + 1, true);
+
+    // An empty run has only its index
+    CHECK(write_run(path, vector<string>()));
+    check_round_trip(path, vector<string>());
+
+    unlink(path.c_str());
+    close_spill_runs(&runs);
+    return check_report("spill_test");
+}
@@ -0,0 +1,94 @@
+// The fused tokenizer, for every implementation this CPU can run, against
+// clean_word applied to each whitespace-separated token
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "check.h"
+#include "tokenize.h"
+
+using namespace std;
+
+// Whitespace as the tokenizer sees it
+bool is_space(char c) {
+    return c == ' ' || (unsigned)(c - '\t') < 5;
+}
+
+// What tokenize_clean should give: each token cleaned by clean_word,
+// empty words dropped, long words truncated
+size_t reference_words(const string& text, vector<string>* words) {
+    size_t tokens = 0;
+    size_t i = 0;
+    while (i < text.size()) {
+        while (i < text.size() && is_space(text[i])) i++;
+        if (i == text.size()) break;
+        size_t start = i;
+        while (i < text.size() && !is_space(text[i])) i++;
+        tokens++;
+        string token = text.substr(start, i - start);
+        vector<char> cleaned(token.size() + 1);
+        clean_word(token.c_str(), cleaned.data());
+        string word = cleaned.data();
+        if (word.size() > (size_t)MAX_WORD_LENGTH - 1) word.resize(MAX_WORD_LENGTH - 1);
+        if (!word.empty()) words->push_back(word);
+    }
+    return tokens;
+}
+
+size_t tokenizer_words(const string& text, TokenizeIsa isa, vector<string>* words) {
+    return tokenize_clean(text.data(), text.data() + text.size(),
+                          [&](const char* word, size_t length) {
+        CHECK(strlen(word) == length);
+        words->push_back(string(word, length));
+    }, isa);
+}
+
+// Random ASCII text, without NUL, heavy on whitespace and punctuation and
+// with the occasional token longer than a word may be
+string random_text(size_t size) {
+    static const char alphabet[] = "aZ9 \t\n\r\v\f.,'-!Mq0_ ";
+    string text;
+    while (text.size() < size) {
+        int kind = rand() % 20;
+        if (kind == 0) {
+            text.append(300 + rand() % 100, "xY7"[rand() % 3]);
+        } else if (kind < 4) {
+            text.push_back((char)(1 + rand() % 127));
+        } else {
+            text.push_back(alphabet[rand() % (sizeof(alphabet) - 1)]);
+        }
+    }
+    text.resize(size);
+    return text;
+}
+
+void check_isa(TokenizeIsa isa) {
+    for (int round = 0; round < 2000; round++) {
+        string text = random_text(rand() % 400);
+        vector<string> expected, got;
+        size_t expected_tokens = reference_words(text, &expected);
+        size_t tokens = tokenizer_words(text, isa, &got);
+        CHECK(tokens == expected_tokens);
+        CHECK(got == expected);
+    }
+
+    // Every block boundary a token can straddle
+    for (size_t offset = 0; offset < 2 * TOKENIZE_BLOCK; offset++) {
+        string text = string(offset, ' ') + "Hello, WORLD! it's 42";
+        vector<string> got;
+        CHECK(tokenizer_words(text, isa, &got) == 4);
+        CHECK(got == vector<string>({"hello", "world", "its", "42"}));
+    }
+}
+
+int main() {
+    srand(1);
+    check_isa(TOKENIZE_SCALAR);
+#if defined(__SSE2__)
+    check_isa(TOKENIZE_SSE2);
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) check_isa(TOKENIZE_AVX2);
+#endif
+    return check_report("tokenize_test");
+}
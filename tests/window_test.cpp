@@ -0,0 +1,117 @@
+// Windowed counting: pane totals as panes are added and evicted, against
+// a naive sum of the window's last panes, plus the length and token
+// helpers
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "check.h"
+#include "window.h"
+
+using namespace std;
+
+typedef map<string, int> Counts;
+
+// Live totals of the window
+Counts window_totals(const WindowState& state) {
+    Counts totals;
+    const vector<KeyValuePair>& entries = state.counts.totals.entries;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].count > 0) totals[entries[i].word] += entries[i].count;
+    }
+    return totals;
+}
+
+// Fold a pane's counts in, in two batches as two workers would
+void fold_pane(WindowState* state, const Counts& pane) {
+    vector<KeyValuePair> batches[2];
+    int b = 0;
+    for (Counts::const_iterator it = pane.begin(); it != pane.end(); ++it, b ^= 1) {
+        const char* word = it->first.c_str();
+        batches[b].push_back(KeyValuePair{word, hash_key(word, it->first.size()), it->second});
+    }
+    state->fold(batches[0]);
+    state->fold(batches[1]);
+}
+
+// Panes mixing a steady vocabulary with words seen only once, so evicted
+// entries pile up and the totals are compacted
+void check_panes(int num_panes) {
+    struct WindowSpec spec = {WINDOW_TOKENS, 100.0 * num_panes, 100};
+    WindowState state;
+    state.init(&spec);
+    CHECK(state.num_panes == num_panes);
+
+    vector<Counts> history;
+    size_t largest = 0;
+    char word[32];
+    for (int p = 0; p < 60; p++) {
+        Counts pane;
+        for (int i = 0; i < 300; i++) {
+            snprintf(word, sizeof(word), "common%d", rand() % 50);
+            pane[word]++;
+        }
+        for (int i = 0; i < 2000; i++) {
+            snprintf(word, sizeof(word), "once%d-%d", p, i);
+            pane[word] = 1;
+        }
+        history.push_back(pane);
+
+        state.open(p * 100.0);
+        fold_pane(&state, pane);
+        state.close(p * 100.0 + 100);
+
+        Counts expected;
+        int oldest = p + 1 >= num_panes ? p + 1 - num_panes : 0;
+        for (int q = oldest; q <= p; q++) {
+            for (Counts::iterator it = history[q].begin(); it != history[q].end(); ++it) {
+                expected[it->first] += it->second;
+            }
+        }
+        CHECK(window_totals(state) == expected);
+        CHECK(state.counts.live == expected.size());
+        CHECK(state.first() == oldest * 100.0);
+        if (state.counts.totals.entries.size() > largest) {
+            largest = state.counts.totals.entries.size();
+        }
+    }
+
+    // Compaction keeps evicted entries below the live ones, or below its
+    // threshold, so the table never grows past about two windows
+    CHECK(largest <= 2 * (size_t)(num_panes + 1) * 2050 + 1024);
+}
+
+void check_helpers() {
+    int unit;
+    double length;
+    CHECK(parse_window_length("1000", &unit, &length) && unit == WINDOW_TOKENS && length == 1000);
+    CHECK(parse_window_length("10s", &unit, &length) && unit == WINDOW_SECONDS && length == 10);
+    CHECK(parse_window_length("250ms", &unit, &length) && unit == WINDOW_SECONDS && length == 0.25);
+    CHECK(!parse_window_length("1.5", &unit, &length));
+    CHECK(!parse_window_length("0", &unit, &length));
+    CHECK(!parse_window_length("10m", &unit, &length));
+    CHECK(!parse_window_length("s", &unit, &length));
+
+    struct WindowSpec tumbling = {WINDOW_TOKENS, 1000, 1000};
+    struct WindowSpec sliding = {WINDOW_SECONDS, 1.0, 0.1};
+    struct WindowSpec uneven = {WINDOW_TOKENS, 1000, 300};
+    CHECK(window_panes(&tumbling) == 1);
+    CHECK(window_panes(&sliding) == 10);
+    CHECK(window_panes(&uneven) == 0);
+
+    const char* text = "  one two\tthree\nfou";
+    size_t size = strlen(text), tokens;
+    CHECK(skip_tokens(text, size, 2, &tokens) == 9 && tokens == 2);
+    CHECK(skip_tokens(text, size, 10, &tokens) == size && tokens == 4);
+    CHECK(whole_tokens(text, size) == 16);
+    CHECK(whole_tokens("partial", 7) == 0);
+}
+
+int main() {
+    srand(1);
+    check_helpers();
+    check_panes(1);
+    check_panes(4);
+    return check_report("window_test");
+}
@@ -0,0 +1,222 @@
+#ifndef TOKENIZE_H
+#define TOKENIZE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Fused tokenizer and normalizer. One pass over the input splits it on
+// whitespace, drops non-alphanumeric bytes and lowercases ASCII, giving the
+// same words as clean_word on each whitespace-separated token. Bytes are
+// classified 32 at a time with AVX2 or SSE2 when the CPU has them, with a
+// scalar fallback; the per-token work only walks the resulting bit masks.
+
+const int TOKENIZE_BLOCK = 32;
+
+// Classification of one block: lowercased bytes plus bit masks of the
+// alphanumeric and whitespace positions
+struct TokenBlock {
+    char lowered[TOKENIZE_BLOCK];
+    uint32_t alnum;
+    uint32_t space;
+};
+
+// Word being assembled across blocks
+struct TokenState {
+    char word[MAX_WORD_LENGTH];
+    size_t length;
+    uint32_t prev_nonspace;     // 1 if the previous byte ended inside a token
+    size_t tokens;              // whitespace-separated tokens seen so far
+};
+
+inline void classify_scalar(const char* p, int n, struct TokenBlock* block) {
+    block->alnum = 0;
+    block->space = 0;
+    for (int i = 0; i < n; i++) {
+        unsigned char c = p[i];
+        bool upper = (unsigned)(c - 'A') < 26;
+        bool lower = (unsigned)(c - 'a') < 26;
+        bool digit = (unsigned)(c - '0') < 10;
+        block->lowered[i] = upper ? c + 32 : c;
+        if (upper || lower || digit) block->alnum |= 1u << i;
+        if (c == ' ' || (unsigned)(c - '\t') < 5) block->space |= 1u << i;
+    }
+}
+
+#if defined(__SSE2__)
+// Unsigned "x - lo <= range" on 16 bytes
+inline __m128i in_range_sse2(__m128i x, char lo, char range) {
+    __m128i d = _mm_sub_epi8(x, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(range)), d);
+}
+
+inline void classify_sse2(const char* p, struct TokenBlock* block) {
+    uint32_t alnum = 0, space = 0;
+    for (int half = 0; half < 2; half++) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(p + 16 * half));
+        __m128i upper = in_range_sse2(c, 'A', 25);
+        __m128i letter = _mm_or_si128(upper, in_range_sse2(c, 'a', 25));
+        __m128i digit = in_range_sse2(c, '0', 9);
+        __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+                                  in_range_sse2(c, '\t', 4));
+        __m128i lowered = _mm_add_epi8(c, _mm_and_si128(upper, _mm_set1_epi8(32)));
+        _mm_storeu_si128((__m128i*)(block->lowered + 16 * half), lowered);
+        alnum |= (uint32_t)_mm_movemask_epi8(_mm_or_si128(letter, digit)) << (16 * half);
+        space |= (uint32_t)_mm_movemask_epi8(ws) << (16 * half);
+    }
+    block->alnum = alnum;
+    block->space = space;
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+inline __m256i in_range_avx2(__m256i x, char lo, char range) {
+    __m256i d = _mm256_sub_epi8(x, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(range)), d);
+}
+
+__attribute__((target("avx2")))
+inline void classify_avx2(const char* p, struct TokenBlock* block) {
+    __m256i c = _mm256_loadu_si256((const __m256i*)p);
+    __m256i upper = in_range_avx2(c, 'A', 25);
+    __m256i letter = _mm256_or_si256(upper, in_range_avx2(c, 'a', 25));
+    __m256i digit = in_range_avx2(c, '0', 9);
+    __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+                                 in_range_avx2(c, '\t', 4));
+    __m256i lowered = _mm256_add_epi8(c, _mm256_and_si256(upper, _mm256_set1_epi8(32)));
+    _mm256_storeu_si256((__m256i*)block->lowered, lowered);
+    block->alnum = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(letter, digit));
+    block->space = (uint32_t)_mm256_movemask_epi8(ws);
+}
+#endif
+
+// Consume the first n bytes of a classified block: count token starts and
+// append alphanumeric runs to the current word, emitting it at whitespace
+template <typename Emit>
+inline void walk_block(const struct TokenBlock* block, int n,
+                       struct TokenState* state, Emit& emit) {
+    uint32_t valid = n == 32 ? 0xffffffffu : (1u << n) - 1;
+    uint32_t nonspace = ~block->space & valid;
+    uint32_t starts = nonspace & ~((nonspace << 1) | state->prev_nonspace);
+    state->tokens += __builtin_popcount(starts);
+    state->prev_nonspace = (nonspace >> (n - 1)) & 1;
+
+    uint32_t alnum = block->alnum & valid;
+    uint32_t events = alnum | (block->space & valid);
+    while (events) {
+        int pos = __builtin_ctz(events);
+        if (block->space & (1u << pos)) {
+            if (state->length > 0) {
+                state->word[state->length] = '\0';
+                emit((const char*)state->word, state->length);
+                state->length = 0;
+            }
+            events &= events - 1;
+            continue;
+        }
+
+        // Copy the whole run of alphanumeric bytes starting at pos
+        uint32_t rest = ~(alnum >> pos);
+        int run = rest ? __builtin_ctz(rest) : 32 - pos;
+        size_t room = MAX_WORD_LENGTH - 1 - state->length;
+        size_t copy = (size_t)run < room ? (size_t)run : room;
+        memcpy(state->word + state->length, block->lowered + pos, copy);
+        state->length += copy;
+        events = pos + run >= 32 ? 0 : events & (~0u << (pos + run));
+    }
+}
+
+enum TokenizeIsa { TOKENIZE_SCALAR, TOKENIZE_SSE2, TOKENIZE_AVX2 };
+
+// Best implementation for this CPU, detected once
+inline TokenizeIsa tokenize_isa() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const TokenizeIsa isa = __builtin_cpu_supports("avx2") ? TOKENIZE_AVX2 :
+#if defined(__SSE2__)
+                                   TOKENIZE_SSE2;
+#else
+                                   TOKENIZE_SCALAR;
+#endif
+    return isa;
+#else
+    return TOKENIZE_SCALAR;
+#endif
+}
+
+template <typename Emit>
+inline void tokenize_scalar(const char* p, const char* end,
+                            struct TokenState* state, Emit& emit) {
+    struct TokenBlock block;
+    while (p < end) {
+        int n = end - p < TOKENIZE_BLOCK ? (int)(end - p) : TOKENIZE_BLOCK;
+        classify_scalar(p, n, &block);
+        walk_block(&block, n, state, emit);
+        p += n;
+    }
+}
+
+#if defined(__SSE2__)
+template <typename Emit>
+inline const char* tokenize_sse2(const char* p, const char* end,
+                                 struct TokenState* state, Emit& emit) {
+    struct TokenBlock block;
+    while (end - p >= TOKENIZE_BLOCK) {
+        classify_sse2(p, &block);
+        walk_block(&block, TOKENIZE_BLOCK, state, emit);
+        p += TOKENIZE_BLOCK;
+    }
+    return p;
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+template <typename Emit>
+__attribute__((target("avx2")))
+inline const char* tokenize_avx2(const char* p, const char* end,
+                                 struct TokenState* state, Emit& emit) {
+    struct TokenBlock block;
+    while (end - p >= TOKENIZE_BLOCK) {
+        classify_avx2(p, &block);
+        walk_block(&block, TOKENIZE_BLOCK, state, emit);
+        p += TOKENIZE_BLOCK;
+    }
+    return p;
+}
+#endif
+
+// Tokenize and normalize [begin, end), calling emit(word, length) for every
+// non-empty cleaned word; word is NUL-terminated and only valid during the
+// call. Words are truncated to MAX_WORD_LENGTH - 1 characters. Returns the
+// number of whitespace-separated tokens, including ones that clean to
+// nothing.
+template <typename Emit>
+inline size_t tokenize_clean(const char* begin, const char* end, Emit emit,
+                             TokenizeIsa isa = tokenize_isa()) {
+    struct TokenState state;
+    state.length = 0;
+    state.prev_nonspace = 0;
+    state.tokens = 0;
+
+    const char* p = begin;
+#if defined(__x86_64__) || defined(__i386__)
+    if (isa == TOKENIZE_AVX2) p = tokenize_avx2(p, end, &state, emit);
+#endif
+#if defined(__SSE2__)
+    if (isa == TOKENIZE_SSE2) p = tokenize_sse2(p, end, &state, emit);
+#endif
+    tokenize_scalar(p, end, &state, emit);
+
+    if (state.length > 0) {
+        state.word[state.length] = '\0';
+        emit((const char*)state.word, state.length);
+    }
+    return state.tokens;
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "common.h"
+#include "pool.h"
+
+// Ranking of the top-K output: higher count first, ties alphabetical
+inline bool ranks_before(const KeyValuePair& a, const KeyValuePair& b) {
+    if (a.count != b.count) return a.count > b.count;
+    return strcmp(a.word, b.word) < 0;
+}
+
+// Bounded min-heap keeping the k best-ranked records offered to it. The
+// worst kept record sits on top, so each offer is one comparison unless
+// the record makes the cut. Reducers fill neighbouring heaps at once, so
+// each heap has cache lines of its own.
+struct alignas(64) TopK {
+    size_t k;
+    std::vector<KeyValuePair> heap;
+    StringArena* arena;         // copy kept words here, if they are transient
+    size_t arena_limit;         // arena size that triggers a rebuild
+
+    TopK() : k(0), arena(NULL), arena_limit(StringArena::BLOCK_SIZE) {}
+
+    void offer(const KeyValuePair& kv) {
+        if (k == 0) return;
+        if (heap.size() == k) {
+            if (!ranks_before(kv, heap.front())) return;
+            std::pop_heap(heap.begin(), heap.end(), ranks_before);
+            heap.pop_back();
+        }
+        heap.push_back(kv);
+        if (arena != NULL) {
+            heap.back().word = arena->intern(kv.word, strlen(kv.word));
+            if (arena->memory_usage() > arena_limit) rebuild_arena();
+        }
+        std::push_heap(heap.begin(), heap.end(), ranks_before);
+    }
+
+    // Words of records pushed out of the heap stay in the arena. When keys
+    // arrive in key order rather than by count most offers make the cut for
+    // a while, so once the arena doubles the kept words are copied into a
+    // fresh one and the old one is dropped, keeping it within a small
+    // multiple of the k words.
+    void rebuild_arena() {
+        StringArena fresh;
+        for (size_t i = 0; i < heap.size(); i++) {
+            heap[i].word = fresh.intern(heap[i].word, strlen(heap[i].word));
+        }
+        arena->swap(fresh);
+        arena_limit = 2 * arena->memory_usage() + StringArena::BLOCK_SIZE;
+    }
+
+    // Fold in another heap; its words are already stored somewhere stable
+    void merge(const TopK& other) {
+        StringArena* saved = arena;
+        arena = NULL;
+        for (size_t i = 0; i < other.heap.size(); i++) offer(other.heap[i]);
+        arena = saved;
+    }
+
+    // Kept records, best first
+    std::vector<KeyValuePair> sorted() const {
+        std::vector<KeyValuePair> result = heap;
+        std::sort(result.begin(), result.end(), ranks_before);
+        return result;
+    }
+};
+
+struct TopKMergeArgs {
+    std::vector<TopK>* parts;
+    size_t step;
+};
+
+// Fold part 2 * step * task + step into part 2 * step * task
+inline void top_k_merge_task(void* args, int task, int) {
+    struct TopKMergeArgs* merge_args = (struct TopKMergeArgs*)args;
+    std::vector<TopK>& parts = *merge_args->parts;
+    size_t into = 2 * merge_args->step * task;
+    if (into + merge_args->step < parts.size()) {
+        parts[into].merge(parts[into + merge_args->step]);
+    }
+}
+
+// Merge per-partition heaps pairwise in a tree, each level in parallel on
+// the pool. Returns the overall top k, best first. Kept words must stay
+// valid while the result is used; the merge itself copies none.
+inline std::vector<KeyValuePair> merge_top_k(struct WorkerPool* pool,
+                                             std::vector<TopK>& parts,
+                                             int max_workers = 0) {
+    if (parts.empty()) return std::vector<KeyValuePair>();
+    struct TopKMergeArgs merge_args = {&parts, 1};
+    for (; merge_args.step < parts.size(); merge_args.step *= 2) {
+        size_t tasks = (parts.size() + 2 * merge_args.step - 1) / (2 * merge_args.step);
+        pool_run(pool, (int)tasks, top_k_merge_task, &merge_args, max_workers);
+    }
+    return parts[0].sorted();
+}
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef WINDOW_H
+#define WINDOW_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "common.h"
+
+// Windowed counting over an unbounded stream. A window of size tokens or
+// seconds moves forward by slide; with slide equal to size the windows
+// tumble, otherwise they overlap. The stream is cut into panes of slide
+// each, counted one at a time, and a window is the sum of its last
+// size / slide panes. When a pane closes its counts are added to the
+// window totals; when it leaves the window they are subtracted again, so
+// each step costs the pane's distinct words, not the window's, and memory
+// holds only the panes of one window.
+
+enum WindowUnit { WINDOW_TOKENS, WINDOW_SECONDS };
+
+const int MAX_WINDOW_PANES = 4096;
+
+struct WindowSpec {
+    int unit;
+    double size;                // tokens or seconds
+    double slide;
+};
+
+// "N" tokens, or "Ns" / "Nms" of wall-clock time. False if malformed.
+inline bool parse_window_length(const char* text, int* unit, double* length) {
+    char* end;
+    *length = strtod(text, &end);
+    if (end == text || *length <= 0) return false;
+    if (*end == '\0') {
+        *unit = WINDOW_TOKENS;
+        return *length == (double)(long)*length;
+    }
+    *unit = WINDOW_SECONDS;
+    if (strcmp(end, "ms") == 0) {
+        *length /= 1000;
+        return true;
+    }
+    return strcmp(end, "s") == 0;
+}
+
+// Number of panes per window, or 0 unless size is a whole multiple of
+// slide in the same unit
+inline int window_panes(const struct WindowSpec* spec) {
+    double panes = spec->size / spec->slide;
+    long whole = (long)(panes + 0.5);
+    if (whole < 1 || whole > MAX_WINDOW_PANES) return 0;
+    if (panes - whole > 1e-9 || whole - panes > 1e-9) return 0;
+    return (int)whole;
+}
+
+inline bool window_space(char c) {
+    return c == ' ' || (unsigned)(c - '\t') < 5;
+}
+
+// Offset just past the want-th whitespace-separated token of
+// [data, data + size), or size if it has fewer. tokens gets how many were
+// passed.
+inline size_t skip_tokens(const char* data, size_t size, size_t want, size_t* tokens) {
+    size_t i = 0;
+    *tokens = 0;
+    while (*tokens < want) {
+        while (i < size && window_space(data[i])) i++;
+        if (i == size) break;
+        while (i < size && !window_space(data[i])) i++;
+        (*tokens)++;
+    }
+    return i;
+}
+
+// Length of the prefix of data that ends on whitespace, so holds only
+// whole tokens; 0 if it has no whitespace
+inline size_t whole_tokens(const char* data, size_t size) {
+    while (size > 0 && !window_space(data[size - 1])) size--;
+    return size;
+}
+
+// Counts of one pane, with their words
+struct WindowPane {
+    StringArena arena;
+    WordCountMap counts;
+    size_t tokens;
+    double first;               // first token index or start time
+    double last;                // one past the last token, or end time
+
+    WindowPane() : counts(&arena), tokens(0), first(0), last(0) {}
+};
+
+// Word of a total whose count dropped to zero. Its pane's arena may be
+// gone, and no word is empty, so the entry matches nothing.
+const char WINDOW_EVICTED[] = "";
+
+// Totals of the panes in the window. An entry's word points into the
+// newest pane that has the word, which is the last of them to leave, so
+// the totals need no arena of their own. Entries whose count drops to
+// zero stay in the table, matching nothing, until they outnumber the
+// live ones and the table is rebuilt.
+struct WindowCounts {
+    WordCountMap totals;
+    size_t live;                // entries with a count above zero
+
+    WindowCounts() : live(0) {}
+
+    void add(const KeyValuePair& kv) {
+        size_t i = totals.find(kv.word, kv.hash);
+        if (totals.slots[i].entry != -1) {
+            KeyValuePair& total = totals.entries[totals.slots[i].entry];
+            total.count += kv.count;
+            total.word = kv.word;
+            return;
+        }
+        totals.insert(i, kv);
+        live++;
+    }
+
+    void remove(const KeyValuePair& kv) {
+        size_t i = totals.find(kv.word, kv.hash);
+        KeyValuePair& total = totals.entries[totals.slots[i].entry];
+        total.count -= kv.count;
+        if (total.count == 0) {
+            total.word = WINDOW_EVICTED;
+            live--;
+        }
+    }
+
+    // Rebuild without the evicted entries once they are the majority.
+    // Returns the number dropped.
+    size_t compact() {
+        size_t dead = totals.entries.size() - live;
+        if (dead <= live || dead < 1024) return 0;
+        std::vector<KeyValuePair> entries;
+        entries.swap(totals.entries);
+        totals.clear_counts();
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].count > 0) totals.add(entries[i]);
+        }
+        return dead;
+    }
+};
+
+// The panes of one window, in a ring, and their totals
+struct WindowState {
+    struct WindowSpec spec;
+    int num_panes;
+    std::vector<WindowPane*> panes;
+    long next;                  // panes opened so far
+    WindowCounts counts;
+
+    WindowState() : num_panes(0), next(0) {}
+    WindowState(const WindowState&) = delete;
+    WindowState& operator=(const WindowState&) = delete;
+    ~WindowState() {
+        for (size_t i = 0; i < panes.size(); i++) delete panes[i];
+    }
+
+    void init(const struct WindowSpec* window) {
+        spec = *window;
+        num_panes = window_panes(window);
+        for (int i = 0; i < num_panes; i++) panes.push_back(new WindowPane());
+    }
+
+    WindowPane* current() {
+        return panes[(next - 1) % num_panes];
+    }
+
+    // Open the next pane, starting at first. Its slot holds the pane that
+    // has just left the window, whose counts are taken out of the totals
+    // first. Returns the number of words evicted that way.
+    size_t open(double first) {
+        WindowPane* pane = panes[next % num_panes];
+        size_t evicted = 0;
+        if (next >= num_panes) {
+            for (size_t i = 0; i < pane->counts.entries.size(); i++) {
+                counts.remove(pane->counts.entries[i]);
+            }
+            evicted = pane->counts.entries.size();
+            pane->counts.clear();
+            counts.compact();
+        }
+        pane->tokens = 0;
+        pane->first = first;
+        pane->last = first;
+        next++;
+        return evicted;
+    }
+
+    // Add the current pane to the totals; the window now ends with it
+    void close(double last) {
+        WindowPane* pane = current();
+        pane->last = last;
+        for (size_t i = 0; i < pane->counts.entries.size(); i++) {
+            counts.add(pane->counts.entries[i]);
+        }
+    }
+
+    // Fold one worker's combined counts into the current pane, copying
+    // new words into the pane's arena
+    void fold(const std::vector<KeyValuePair>& entries) {
+        WordCountMap& pane = current()->counts;
+        for (size_t i = 0; i < entries.size(); i++) {
+            const KeyValuePair& kv = entries[i];
+            size_t slot = pane.find(kv.word, kv.hash);
+            if (pane.slots[slot].entry != -1) {
+                pane.entries[pane.slots[slot].entry].count += kv.count;
+            } else {
+                const char* word = pane.arena->intern(kv.word, strlen(kv.word));
+                pane.insert(slot, KeyValuePair{word, kv.hash, kv.count});
+            }
+        }
+    }
+
+    // First token index or start time of the window ending with the
+    // current pane
+    double first() {
+        long oldest = next > num_panes ? next - num_panes : 0;
+        return panes[oldest % num_panes]->first;
+    }
+};
+
+#endif